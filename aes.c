@@ -38,6 +38,9 @@ NOTE:   String length must be evenly divisible by 16byte (str_len % 16 == 0)
 #include <stdint.h>
 #include <string.h> // CBC mode, for memset
 #include "aes.h"
+#if defined(ACCEL) && (ACCEL == 1)
+  #include "aesni.h"
+#endif
 
 /*****************************************************************************/
 /* Defines:                                                                  */
@@ -226,6 +229,12 @@ void AES_init_ctx(struct AES_ctx* ctx, const uint8_t* key)
 {
   KeyExpansion(ctx->RoundKey, key);
 }
+
+void AES_init_key(struct AES_key* key, const uint8_t* rawkey)
+{
+  KeyExpansion(key->RoundKey, rawkey);
+}
+
 #if (defined(CBC) && (CBC == 1)) || (defined(CTR) && (CTR == 1))
 void AES_init_ctx_iv(struct AES_ctx* ctx, const uint8_t* key, const uint8_t* iv)
 {
@@ -497,37 +506,64 @@ static void XorWithIv(uint8_t* buf, const uint8_t* Iv)
   }
 }
 
-void AES_CBC_encrypt_buffer(struct AES_ctx *ctx, uint8_t* buf, uint32_t length)
+// The CBC loops only read the key schedule, the chaining state is 'Iv'
+static void CBC_encrypt(const uint8_t* RoundKey, uint8_t* storeIv, uint8_t* buf, uint32_t length)
 {
   uintptr_t i;
-  uint8_t *Iv = ctx->Iv;
+  uint8_t *Iv = storeIv;
+#if defined(ACCEL) && (ACCEL == 1)
+  if (AESNI_CBC_encrypt(RoundKey, storeIv, buf, length)) return;
+#endif
   for (i = 0; i < length; i += AES_BLOCKLEN)
   {
     XorWithIv(buf, Iv);
-    Cipher((state_t*)buf, ctx->RoundKey);
+    Cipher((state_t*)buf, RoundKey);
     Iv = buf;
     buf += AES_BLOCKLEN;
     //printf("Step %d - %d", i/16, i);
   }
-  /* store Iv in ctx for next call */
-  memcpy(ctx->Iv, Iv, AES_BLOCKLEN);
+  /* store Iv for next call */
+  memcpy(storeIv, Iv, AES_BLOCKLEN);
 }
 
-void AES_CBC_decrypt_buffer(struct AES_ctx* ctx, uint8_t* buf,  uint32_t length)
+static void CBC_decrypt(const uint8_t* RoundKey, uint8_t* Iv, uint8_t* buf, uint32_t length)
 {
   uintptr_t i;
   uint8_t storeNextIv[AES_BLOCKLEN];
+#if defined(ACCEL) && (ACCEL == 1)
+  if (AESNI_CBC_decrypt(RoundKey, Iv, buf, length)) return;
+#endif
   for (i = 0; i < length; i += AES_BLOCKLEN)
   {
     memcpy(storeNextIv, buf, AES_BLOCKLEN);
-    InvCipher((state_t*)buf, ctx->RoundKey);
-    XorWithIv(buf, ctx->Iv);
-    memcpy(ctx->Iv, storeNextIv, AES_BLOCKLEN);
+    InvCipher((state_t*)buf, RoundKey);
+    XorWithIv(buf, Iv);
+    memcpy(Iv, storeNextIv, AES_BLOCKLEN);
     buf += AES_BLOCKLEN;
   }
 
 }
 
+void AES_CBC_encrypt_buffer(struct AES_ctx *ctx, uint8_t* buf, uint32_t length)
+{
+  CBC_encrypt(ctx->RoundKey, ctx->Iv, buf, length);
+}
+
+void AES_CBC_decrypt_buffer(struct AES_ctx* ctx, uint8_t* buf,  uint32_t length)
+{
+  CBC_decrypt(ctx->RoundKey, ctx->Iv, buf, length);
+}
+
+void AES_CBC_encrypt_stream(const struct AES_key* key, uint8_t* iv, uint8_t* buf, uint32_t length)
+{
+  CBC_encrypt(key->RoundKey, iv, buf, length);
+}
+
+void AES_CBC_decrypt_stream(const struct AES_key* key, uint8_t* iv, uint8_t* buf, uint32_t length)
+{
+  CBC_decrypt(key->RoundKey, iv, buf, length);
+}
+
 #endif // #if defined(CBC) && (CBC == 1)
 
 
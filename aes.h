@@ -22,6 +22,11 @@
   #define CTR 0
 #endif
 
+// ACCEL runs CBC on the x86 AES instructions (AES-NI, VAES) where the CPU has them, see aesni.h.
+#ifndef ACCEL
+  #define ACCEL 1
+#endif
+
 
 #define AES128 1
 //#define AES192 1
@@ -40,6 +45,14 @@
     #define AES_keyExpSize 176
 #endif
 
+#define AES_CACHELINE 64
+
+#ifdef __cplusplus
+  #define AES_ALIGNED alignas(AES_CACHELINE)
+#else
+  #define AES_ALIGNED _Alignas(AES_CACHELINE)
+#endif
+
 struct AES_ctx
 {
   uint8_t RoundKey[AES_keyExpSize];
@@ -48,7 +61,16 @@ struct AES_ctx
 #endif
 };
 
+// An expanded key on its own. Nothing writes to it after AES_init_key(),
+// so any number of threads can share one (const) key, each with its own
+// IV. Cache line aligned, the schedule takes as few lines as it can.
+struct AES_key
+{
+  AES_ALIGNED uint8_t RoundKey[AES_keyExpSize];
+};
+
 void AES_init_ctx(struct AES_ctx* ctx, const uint8_t* key);
+void AES_init_key(struct AES_key* key, const uint8_t* rawkey);
 #if (defined(CBC) && (CBC == 1)) || (defined(CTR) && (CTR == 1))
 void AES_init_ctx_iv(struct AES_ctx* ctx, const uint8_t* key, const uint8_t* iv);
 void AES_ctx_set_iv(struct AES_ctx* ctx, const uint8_t* iv);
@@ -72,6 +94,11 @@ void AES_ECB_decrypt(const struct AES_ctx* ctx, uint8_t* buf);
 void AES_CBC_encrypt_buffer(struct AES_ctx* ctx, uint8_t* buf, uint32_t length);
 void AES_CBC_decrypt_buffer(struct AES_ctx* ctx, uint8_t* buf, uint32_t length);
 
+// Same as above with a shared key. 'iv' is the state of the stream: it
+// starts out as the IV and is left ready for the next call, like ctx->Iv.
+void AES_CBC_encrypt_stream(const struct AES_key* key, uint8_t* iv, uint8_t* buf, uint32_t length);
+void AES_CBC_decrypt_stream(const struct AES_key* key, uint8_t* iv, uint8_t* buf, uint32_t length);
+
 #endif // #if defined(CBC) && (CBC == 1)
 
 
@@ -0,0 +1,190 @@
+#include "aesni.h"
+
+#include "aes.h"
+#include "cpu.hpp"
+#include "secmem.hpp"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define AESNI_X86
+#include <immintrin.h>
+// GCC's AVX-512 intrinsics pass an undefined vector to the builtins, which it
+// then warns about
+#pragma GCC diagnostic ignored "-Wuninitialized"
+#pragma GCC diagnostic ignored "-Wmaybe-uninitialized"
+#endif
+
+#ifdef AESNI_X86
+
+// Rounds of the key schedule in aes.h
+#define AESNI_ROUNDS (AES_keyExpSize / AES_BLOCKLEN - 1)
+// Blocks per iteration of the CBC decryption loops
+#define AESNI_BLOCKS 8
+#define VAES_VECTORS 8
+#define VAES_LANES 4
+
+__attribute__((target("aes")))
+static void loadEncryptKeys(const uint8_t* roundKey, __m128i keys[AESNI_ROUNDS + 1]) {
+    for (int i = 0; i <= AESNI_ROUNDS; i++) {
+        keys[i] = _mm_loadu_si128((const __m128i*)(roundKey + i * AES_BLOCKLEN));
+    }
+}
+
+// The round keys of the equivalent inverse cipher, in the order they are used
+__attribute__((target("aes")))
+static void loadDecryptKeys(const uint8_t* roundKey, __m128i keys[AESNI_ROUNDS + 1]) {
+    keys[0] = _mm_loadu_si128((const __m128i*)(roundKey + AESNI_ROUNDS * AES_BLOCKLEN));
+    for (int i = 1; i < AESNI_ROUNDS; i++) {
+        keys[i] = _mm_aesimc_si128(_mm_loadu_si128((const __m128i*)(roundKey + (AESNI_ROUNDS - i) * AES_BLOCKLEN)));
+    }
+    keys[AESNI_ROUNDS] = _mm_loadu_si128((const __m128i*)roundKey);
+}
+
+__attribute__((target("aes")))
+static inline __m128i decryptBlock(__m128i block, const __m128i keys[AESNI_ROUNDS + 1]) {
+    block = _mm_xor_si128(block, keys[0]);
+    for (int r = 1; r < AESNI_ROUNDS; r++) {
+        block = _mm_aesdec_si128(block, keys[r]);
+    }
+    return _mm_aesdeclast_si128(block, keys[AESNI_ROUNDS]);
+}
+
+// Decrypts the blocks from 'i' on one at a time, returns the last ciphertext block
+__attribute__((target("aes")))
+static __m128i decryptTail(const __m128i keys[AESNI_ROUNDS + 1], __m128i prev, uint8_t* buf, size_t i, const size_t blocks) {
+    for (; i < blocks; i++) {
+        __m128i* p = (__m128i*)(buf + i * AES_BLOCKLEN);
+        __m128i c = _mm_loadu_si128(p);
+        _mm_storeu_si128(p, _mm_xor_si128(decryptBlock(c, keys), prev));
+        prev = c;
+    }
+    return prev;
+}
+
+__attribute__((target("aes")))
+static void cbcEncryptAesni(const uint8_t* roundKey, uint8_t* iv, uint8_t* buf, const size_t blocks) {
+    __m128i keys[AESNI_ROUNDS + 1];
+    loadEncryptKeys(roundKey, keys);
+
+    __m128i state = _mm_loadu_si128((const __m128i*)iv);
+    for (size_t i = 0; i < blocks; i++) {
+        __m128i* p = (__m128i*)(buf + i * AES_BLOCKLEN);
+        state = _mm_xor_si128(_mm_xor_si128(_mm_loadu_si128(p), state), keys[0]);
+        for (int r = 1; r < AESNI_ROUNDS; r++) {
+            state = _mm_aesenc_si128(state, keys[r]);
+        }
+        state = _mm_aesenclast_si128(state, keys[AESNI_ROUNDS]);
+        _mm_storeu_si128(p, state);
+    }
+    _mm_storeu_si128((__m128i*)iv, state);
+    SecureMemory::zero(keys, sizeof(keys));
+}
+
+__attribute__((target("aes")))
+static void cbcDecryptAesni(const uint8_t* roundKey, uint8_t* iv, uint8_t* buf, const size_t blocks) {
+    __m128i keys[AESNI_ROUNDS + 1];
+    loadDecryptKeys(roundKey, keys);
+
+    __m128i prev = _mm_loadu_si128((const __m128i*)iv);
+    size_t i = 0;
+    for (; i + AESNI_BLOCKS <= blocks; i += AESNI_BLOCKS) {
+        __m128i* p = (__m128i*)(buf + i * AES_BLOCKLEN);
+        __m128i c[AESNI_BLOCKS], b[AESNI_BLOCKS];
+        for (int j = 0; j < AESNI_BLOCKS; j++) {
+            c[j] = _mm_loadu_si128(p + j);
+            b[j] = _mm_xor_si128(c[j], keys[0]);
+        }
+        for (int r = 1; r < AESNI_ROUNDS; r++) {
+            for (int j = 0; j < AESNI_BLOCKS; j++) b[j] = _mm_aesdec_si128(b[j], keys[r]);
+        }
+        for (int j = 0; j < AESNI_BLOCKS; j++) {
+            b[j] = _mm_aesdeclast_si128(b[j], keys[AESNI_ROUNDS]);
+            _mm_storeu_si128(p + j, _mm_xor_si128(b[j], (j == 0) ? prev : c[j - 1]));
+        }
+        prev = c[AESNI_BLOCKS - 1];
+    }
+    prev = decryptTail(keys, prev, buf, i, blocks);
+    _mm_storeu_si128((__m128i*)iv, prev);
+    SecureMemory::zero(keys, sizeof(keys));
+}
+
+// Decrypts N vectors of four blocks each. 'prev' has the ciphertext block
+// before them in its last lane, and is left with the last one of them
+template <int N>
+__attribute__((target("avx512f,vaes")))
+static inline void decryptVectors(const __m512i keys[AESNI_ROUNDS + 1], __m512i& prev, uint8_t* buf) {
+    __m512i* p = (__m512i*)buf;
+    __m512i c[N], b[N];
+    for (int j = 0; j < N; j++) {
+        c[j] = _mm512_loadu_si512(p + j);
+        b[j] = _mm512_xor_si512(c[j], keys[0]);
+    }
+    for (int r = 1; r < AESNI_ROUNDS; r++) {
+        for (int j = 0; j < N; j++) b[j] = _mm512_aesdec_epi128(b[j], keys[r]);
+    }
+    for (int j = 0; j < N; j++) {
+        b[j] = _mm512_aesdeclast_epi128(b[j], keys[AESNI_ROUNDS]);
+        // The ciphertext blocks one lane back: the last of the vector before, then the first three
+        __m512i chain = _mm512_alignr_epi64(c[j], (j == 0) ? prev : c[j - 1], 6);
+        _mm512_storeu_si512(p + j, _mm512_xor_si512(b[j], chain));
+    }
+    prev = c[N - 1];
+}
+
+__attribute__((target("avx512f,vaes,aes")))
+static void cbcDecryptVaes(const uint8_t* roundKey, uint8_t* iv, uint8_t* buf, const size_t blocks) {
+    __m128i keys[AESNI_ROUNDS + 1];
+    __m512i wide[AESNI_ROUNDS + 1];
+    loadDecryptKeys(roundKey, keys);
+    for (int i = 0; i <= AESNI_ROUNDS; i++) wide[i] = _mm512_broadcast_i32x4(keys[i]);
+
+    __m512i prev = _mm512_inserti32x4(_mm512_setzero_si512(), _mm_loadu_si128((const __m128i*)iv), 3);
+    size_t i = 0;
+    for (; i + VAES_VECTORS * VAES_LANES <= blocks; i += VAES_VECTORS * VAES_LANES) {
+        decryptVectors<VAES_VECTORS>(wide, prev, buf + i * AES_BLOCKLEN);
+    }
+    for (; i + VAES_LANES <= blocks; i += VAES_LANES) {
+        decryptVectors<1>(wide, prev, buf + i * AES_BLOCKLEN);
+    }
+    __m128i last = decryptTail(keys, _mm512_extracti32x4_epi32(prev, 3), buf, i, blocks);
+    _mm_storeu_si128((__m128i*)iv, last);
+    SecureMemory::zero(keys, sizeof(keys));
+    SecureMemory::zero(wide, sizeof(wide));
+}
+
+typedef void (*CbcFunction)(const uint8_t* roundKey, uint8_t* iv, uint8_t* buf, const size_t blocks);
+
+static CbcFunction selectEncrypt() {
+    return cpuFeatures().aes ? &cbcEncryptAesni : NULL;
+}
+
+static CbcFunction selectDecrypt() {
+    const CpuFeatures& cpu = cpuFeatures();
+    if (cpu.aes && cpu.avx512 && cpu.vaes) {
+        return &cbcDecryptVaes;
+    }
+    return cpu.aes ? &cbcDecryptAesni : NULL;
+}
+
+#endif
+
+bool AESNI_CBC_encrypt(const uint8_t* roundKey, uint8_t* iv, uint8_t* buf, size_t length) {
+#ifdef AESNI_X86
+    static const CbcFunction encrypt = selectEncrypt();
+    if (encrypt != NULL) {
+        encrypt(roundKey, iv, buf, length / AES_BLOCKLEN);
+        return true;
+    }
+#endif
+    return false;
+}
+
+bool AESNI_CBC_decrypt(const uint8_t* roundKey, uint8_t* iv, uint8_t* buf, size_t length) {
+#ifdef AESNI_X86
+    static const CbcFunction decrypt = selectDecrypt();
+    if (decrypt != NULL) {
+        decrypt(roundKey, iv, buf, length / AES_BLOCKLEN);
+        return true;
+    }
+#endif
+    return false;
+}
@@ -0,0 +1,25 @@
+#ifndef _AESNI_H_
+#define _AESNI_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+    x86 AES instruction kernels behind the CBC functions in aes.c.
+
+    'roundKey' is the key schedule of an AES_key or AES_ctx and is only
+    read, 'iv' is updated like the one in AES_ctx, and 'length' is a
+    multiple of AES_BLOCKLEN. CBC decryption works on many blocks at
+    once: 32 per iteration with VAES on AVX-512, 8 with AES-NI. CBC
+    encryption chains every block to the one before it, so it runs one
+    block at a time with AES-NI.
+
+    The kernels are picked at runtime from cpuFeatures(). They return false
+    without touching anything when the CPU (or the OS, for AVX-512) doesn't
+    support them, and the portable code in aes.c runs instead.
+*/
+
+bool AESNI_CBC_encrypt(const uint8_t* roundKey, uint8_t* iv, uint8_t* buf, size_t length);
+bool AESNI_CBC_decrypt(const uint8_t* roundKey, uint8_t* iv, uint8_t* buf, size_t length);
+
+#endif
@@ -0,0 +1,611 @@
+#include "archive.hpp"
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cerrno>
+#include <algorithm>
+#include <atomic>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+#ifdef __linux__
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#include "io.hpp"
+#include "stats.hpp"
+#include "trace.hpp"
+
+// Members are read this many bytes at a time
+#define ARCHIVE_BLOCKLEN (1 << 20)
+// Each worker writes its sealed chunks once it has this many bytes of them
+#define ARCHIVE_WRITELEN (4 << 20)
+
+#ifdef __linux__
+
+struct Member
+{
+    std::string name;
+    std::string path;  // Where it's read from
+    uint64_t size;  // When it was found
+    IndexMember info;
+    std::vector<ManifestEntry> chunks;
+};
+
+// Where the sealed chunks go. Offsets are handed out under the lock, and
+// the chunks are written outside of it.
+struct ArchiveWriter
+{
+    std::string tmpPath;  // Renamed to the archive once it's complete
+    int fd;
+    std::mutex lock;
+    uint64_t end;
+    // Offset of every chunk, 0 while the worker that claimed it is still
+    // sealing it. Members only get their offsets once all are written.
+    std::unordered_map<ChunkKey, uint64_t, ChunkKeyHash> stored;
+};
+
+struct ArchiveIndex
+{
+    std::vector<IndexMember> members;
+    std::vector<ManifestEntry> chunks;
+    std::string names;
+
+    std::string name(const IndexMember& member) const { return this->names.substr(member.nameOffset, member.nameLength); }
+};
+
+static void damaged(const char* path) {
+    fprintf(stderr, "\"%s\" is damaged.\n", path);
+    exit(1);
+}
+
+// Gives up on the archive that's being written, without leaving the
+// temporary file behind
+static void abandon(const ArchiveWriter& writer) {
+    unlink(writer.tmpPath.c_str());
+    exit(1);
+}
+
+// Runs 'work' on 'jobs' threads, or on this one
+static void runWorkers(const unsigned jobs, const std::function<void()>& work) {
+    if (jobs <= 1) {
+        work();
+        return;
+    }
+    std::vector<std::thread> workers;
+    for (unsigned i = 0; i < jobs; i++) {
+        workers.emplace_back([&, i]() {
+            TRACE_THREAD("worker", i + 1);
+            work();
+        });
+    }
+    for (std::thread& worker : workers) {
+        worker.join();
+    }
+}
+
+// Biggest members first, so that one big member doesn't end up last on
+// its own thread
+static std::vector<size_t> scheduleBySize(const std::vector<size_t>& members, const std::function<uint64_t(size_t)>& size) {
+    std::vector<size_t> order(members);
+    std::stable_sort(order.begin(), order.end(), [&](size_t a, size_t b) { return size(a) > size(b); });
+    return order;
+}
+
+// Turns 'path' into a member name: relative, without empty, "." or ".."
+// components. Returns false if it has ".." components.
+static bool memberName(const std::string& path, std::string& name) {
+    name.clear();
+    for (size_t i = 0; i <= path.size(); ) {
+        size_t j = path.find('/', i);
+        if (j == std::string::npos) j = path.size();
+        std::string part = path.substr(i, j - i);
+        if (part == "..") return false;
+        if (!part.empty() && part != ".") {
+            if (!name.empty()) name += '/';
+            name += part;
+        }
+        i = j + 1;
+    }
+    return true;
+}
+
+static bool sameFile(const struct stat& a, const struct stat& b) {
+    return a.st_dev == b.st_dev && a.st_ino == b.st_ino;
+}
+
+// Adds 'path' and everything below it. The archive itself is skipped.
+static void addMembers(const ArchiveWriter& writer, const std::string& path, const std::string& name,
+    const std::vector<struct stat>& skip, std::unordered_set<std::string>& names, std::vector<Member>& members)
+{
+    struct stat st;
+    if (lstat(path.c_str(), &st) == -1) {
+        perror(path.c_str());
+        abandon(writer);
+    }
+    for (const struct stat& s : skip) {
+        if (sameFile(st, s)) return;
+    }
+    if (!S_ISDIR(st.st_mode) && !S_ISREG(st.st_mode)) {
+        fprintf(stderr, "Skipping \"%s\", it isn't a file or a directory.\n", path.c_str());
+        return;
+    }
+
+    // "." itself has no name, only what's in it
+    if (!name.empty() && names.insert(name).second) {
+        Member member;
+        member.name = name;
+        member.path = path;
+        member.size = st.st_size;
+        memset(&member.info, 0, sizeof(member.info));
+        member.info.mode = st.st_mode & 07777;
+        member.info.mtime = st.st_mtime;
+        member.info.flags = S_ISDIR(st.st_mode) ? ARCHIVE_DIRECTORY : 0;
+        members.push_back(member);
+    }
+    if (!S_ISDIR(st.st_mode)) return;
+
+    DIR* dir = opendir(path.c_str());
+    if (dir == NULL) {
+        perror(path.c_str());
+        abandon(writer);
+    }
+    std::vector<std::string> entries;
+    while (struct dirent* entry = readdir(dir)) {
+        if (strcmp(entry->d_name, ".") != 0 && strcmp(entry->d_name, "..") != 0) {
+            entries.push_back(entry->d_name);
+        }
+    }
+    closedir(dir);
+    std::sort(entries.begin(), entries.end());
+    for (const std::string& entry : entries) {
+        addMembers(writer, path + "/" + entry, name.empty() ? entry : name + "/" + entry, skip, names, members);
+    }
+}
+
+// Hands out space for the pending chunks of 'member' and writes them
+static void flushChunks(ArchiveWriter& writer, Member& member, std::vector<size_t>& pendingChunks, PoolString& pending) {
+    if (pending.empty()) return;
+    uint64_t base;
+    {
+        std::lock_guard<std::mutex> guard(writer.lock);
+        base = writer.end;
+        writer.end += pending.size();
+        for (size_t i : pendingChunks) {
+            const ManifestEntry& entry = member.chunks[i];
+            writer.stored[ChunkKey(entry.id)] = base + entry.offset;
+        }
+    }
+    writeAt(writer.fd, pending.data(), pending.size(), base);
+    pendingChunks.clear();
+    pending.clear();
+}
+
+// Chunks and seals a member. Chunks that another member already has, or
+// that another worker is sealing, aren't sealed again.
+static void sealMember(ArchiveWriter& writer, const ChunkCipher& cipher, Member& member) {
+    TRACE_SPAN("member");
+    // It was a regular file when it was found. If it has been replaced
+    // since, a symlink isn't followed and a FIFO doesn't block the open.
+    int in = open(member.path.c_str(), O_RDONLY | O_NOFOLLOW | O_NONBLOCK | O_CLOEXEC);
+    if (in == -1) {
+        perror(member.path.c_str());
+        abandon(writer);
+    }
+    struct stat st;
+    if (fstat(in, &st) == -1 || !S_ISREG(st.st_mode)) {
+        fprintf(stderr, "\"%s\" is no longer a file.\n", member.path.c_str());
+        close(in);
+        abandon(writer);
+    }
+    PoolString input, pending;
+    std::vector<size_t> pendingChunks;
+    size_t start = 0;
+    bool eof = false;
+    while (true) {
+        while (!eof && input.size() - start < CDC_MAXLEN) {
+            input.erase(0, start);
+            start = 0;
+            size_t offset = input.size();
+            input.resize(offset + ARCHIVE_BLOCKLEN);
+            size_t n = readSome(in, &input[offset], ARCHIVE_BLOCKLEN);
+            input.resize(offset + n);
+            eof = (n == 0);
+        }
+        if (input.size() == start) break;
+
+        const uint8_t* data = (const uint8_t*)input.data() + start;
+        ManifestEntry entry = {};
+        entry.length = (uint32_t)cdcChunkLength(data, input.size() - start);
+        cipher.chunkId(data, entry.length, entry.id);
+        bool claimed;
+        {
+            std::lock_guard<std::mutex> guard(writer.lock);
+            claimed = writer.stored.emplace(ChunkKey(entry.id), 0).second;
+        }
+        if (claimed) {
+            // Relative to 'pending' until it's written
+            size_t at = pending.size();
+            pending.resize(at + cdcSealedLength(entry.length));
+            cipher.seal(entry.id, data, entry.length, (uint8_t*)&pending[at]);
+            entry.offset = at;
+            pendingChunks.push_back(member.chunks.size());
+        }
+        member.chunks.push_back(entry);
+        member.info.length += entry.length;
+        start += entry.length;
+        if (pending.size() >= ARCHIVE_WRITELEN) {
+            flushChunks(writer, member, pendingChunks, pending);
+        }
+    }
+    flushChunks(writer, member, pendingChunks, pending);
+    close(in);
+}
+
+void createArchive(const char* path, const AES_key* key, const char** paths, const int count, const unsigned jobs) {
+    std::string tmpPath = std::string(path) + ".tmp." + std::to_string(getpid());
+    ArchiveWriter writer;
+    writer.tmpPath = tmpPath;
+    writer.fd = open(tmpPath.c_str(), O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0600);
+    if (writer.fd == -1) {
+        fprintf(stderr, "Could not open %s for writing...\n", tmpPath.c_str());
+        exit(1);
+    }
+
+    // Neither the new archive nor the one it replaces go into it
+    std::vector<struct stat> skip(1);
+    fstat(writer.fd, &skip[0]);
+    struct stat st;
+    if (stat(path, &st) == 0) skip.push_back(st);
+
+    std::vector<Member> members;
+    std::unordered_set<std::string> names;
+    for (int i = 0; i < count; i++) {
+        std::string name;
+        if (!memberName(paths[i], name)) {
+            fprintf(stderr, "Can't archive \"%s\", paths can't go up with \"..\".\n", paths[i]);
+            abandon(writer);
+        }
+        addMembers(writer, paths[i], name, skip, names, members);
+    }
+
+    ArchiveHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, ARCHIVE_MAGIC, 8);
+    header.version = ARCHIVE_VERSION;
+    getKeyId(key, header.keyId);
+    writeAt(writer.fd, &header, sizeof(header), 0);
+    writer.end = sizeof(header);
+
+    std::vector<size_t> files;
+    for (size_t i = 0; i < members.size(); i++) {
+        if (!(members[i].info.flags & ARCHIVE_DIRECTORY)) files.push_back(i);
+    }
+    std::vector<size_t> order = scheduleBySize(files, [&](size_t i) { return members[i].size; });
+    const ChunkCipher cipher(key);
+    std::atomic<size_t> next(0);
+    runWorkers(jobs, [&]() {
+        for (size_t i = next++; i < order.size(); i = next++) {
+            sealMember(writer, cipher, members[order[i]]);
+        }
+    });
+
+    // The index, in the order the members were found
+    IndexHeader indexHeader;
+    indexHeader.memberCount = members.size();
+    indexHeader.chunkCount = 0;
+    std::string allNames;
+    std::vector<IndexMember> infos;
+    std::vector<ManifestEntry> chunks;
+    for (Member& member : members) {
+        for (ManifestEntry& entry : member.chunks) {
+            entry.offset = writer.stored[ChunkKey(entry.id)];
+        }
+        member.info.firstChunk = chunks.size();
+        member.info.chunkCount = member.chunks.size();
+        member.info.nameOffset = (uint32_t)allNames.size();
+        member.info.nameLength = (uint32_t)member.name.size();
+        allNames += member.name;
+        infos.push_back(member.info);
+        chunks.insert(chunks.end(), member.chunks.begin(), member.chunks.end());
+    }
+    indexHeader.chunkCount = chunks.size();
+    indexHeader.namesLength = allNames.size();
+
+    std::vector<uint8_t> index;
+    index.insert(index.end(), (const uint8_t*)&indexHeader, (const uint8_t*)(&indexHeader + 1));
+    index.insert(index.end(), (const uint8_t*)infos.data(), (const uint8_t*)(infos.data() + infos.size()));
+    index.insert(index.end(), (const uint8_t*)chunks.data(), (const uint8_t*)(chunks.data() + chunks.size()));
+    index.insert(index.end(), allNames.begin(), allNames.end());
+
+    ArchiveTrailer trailer;
+    memset(&trailer, 0, sizeof(trailer));
+    memcpy(trailer.magic, ARCHIVE_MAGIC, 8);
+    trailer.indexOffset = writer.end;
+    trailer.indexLength = index.size();
+    std::vector<uint8_t> sealed(cdcSealedLength(index.size()));
+    cipher.chunkId(index.data(), index.size(), trailer.indexId);
+    cipher.seal(trailer.indexId, index.data(), index.size(), sealed.data());
+    writeAt(writer.fd, sealed.data(), sealed.size(), writer.end);
+    writeAt(writer.fd, &trailer, sizeof(trailer), writer.end + sealed.size());
+
+    if (fsync(writer.fd) == -1) {
+        perror("fsync");
+        close(writer.fd);
+        unlink(tmpPath.c_str());
+        exit(1);
+    }
+    close(writer.fd);
+    if (std::rename(tmpPath.c_str(), path) != 0) {
+        perror("rename");
+        unlink(tmpPath.c_str());
+        exit(1);
+    }
+    syncDirectory(path);
+}
+
+// Opens the archive and reads its index, nothing else
+static int openArchive(const char* path, const AES_key* key, const ChunkCipher& cipher, ArchiveIndex& index) {
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd == -1) {
+        if (errno == ENOENT) {
+            fprintf(stderr, "Could not open \"%s\"... Does it exist?\n", path);
+        } else {
+            perror(path);
+        }
+        exit(1);
+    }
+    struct stat st;
+    ArchiveHeader header;
+    ArchiveTrailer trailer;
+    if (fstat(fd, &st) == -1 || (uint64_t)st.st_size < sizeof(header) + sizeof(trailer) ||
+        !readAt(fd, &header, sizeof(header), 0) || memcmp(header.magic, ARCHIVE_MAGIC, 8) != 0 ||
+        !readAt(fd, &trailer, sizeof(trailer), st.st_size - sizeof(trailer)) || memcmp(trailer.magic, ARCHIVE_MAGIC, 8) != 0) {
+        fprintf(stderr, "\"%s\" isn't an xmsg archive.\n", path);
+        exit(1);
+    }
+    if (header.version != ARCHIVE_VERSION) {
+        fprintf(stderr, "\"%s\" was written by a newer version of xmsg.\n", path);
+        exit(1);
+    }
+    uint8_t keyId[MESSAGE_KEYIDLEN];
+    getKeyId(key, keyId);
+    if (memcmp(header.keyId, keyId, MESSAGE_KEYIDLEN) != 0) {
+        fprintf(stderr, "\"%s\" was written with a different key.\n", path);
+        exit(1);
+    }
+
+    const uint64_t length = trailer.indexLength;
+    if (length < sizeof(IndexHeader) || trailer.indexOffset < sizeof(header) ||
+        trailer.indexOffset + cdcSealedLength(length) != st.st_size - sizeof(trailer)) {
+        damaged(path);
+    }
+    std::vector<uint8_t> data(cdcSealedLength(length));
+    if (!readAt(fd, data.data(), data.size(), trailer.indexOffset) ||
+        !cipher.open(trailer.indexId, data.data(), length)) {
+        damaged(path);
+    }
+
+    IndexHeader indexHeader;
+    memcpy(&indexHeader, data.data(), sizeof(indexHeader));
+    if (indexHeader.memberCount > length / sizeof(IndexMember) || indexHeader.chunkCount > length / sizeof(ManifestEntry) ||
+        indexHeader.namesLength > length || length != sizeof(indexHeader) + indexHeader.memberCount * sizeof(IndexMember) +
+        indexHeader.chunkCount * sizeof(ManifestEntry) + indexHeader.namesLength) {
+        damaged(path);
+    }
+    const uint8_t* p = data.data() + sizeof(indexHeader);
+    index.members.resize(indexHeader.memberCount);
+    memcpy(index.members.data(), p, indexHeader.memberCount * sizeof(IndexMember));
+    p += indexHeader.memberCount * sizeof(IndexMember);
+    index.chunks.resize(indexHeader.chunkCount);
+    memcpy(index.chunks.data(), p, indexHeader.chunkCount * sizeof(ManifestEntry));
+    p += indexHeader.chunkCount * sizeof(ManifestEntry);
+    index.names.assign((const char*)p, indexHeader.namesLength);
+
+    for (const ManifestEntry& chunk : index.chunks) {
+        if (chunk.offset < sizeof(header) || chunk.length == 0 || chunk.length > CDC_MAXLEN ||
+            chunk.offset + cdcSealedLength(chunk.length) > trailer.indexOffset) {
+            damaged(path);
+        }
+    }
+    for (const IndexMember& member : index.members) {
+        if (member.firstChunk > index.chunks.size() || member.chunkCount > index.chunks.size() - member.firstChunk ||
+            (uint64_t)member.nameOffset + member.nameLength > index.names.size()) {
+            damaged(path);
+        }
+        // Names can't point outside of the directory they're extracted to
+        std::string name = index.name(member), canonical;
+        if (name.empty() || !memberName(name, canonical) || canonical != name) damaged(path);
+        uint64_t total = 0;
+        for (uint64_t i = 0; i < member.chunkCount; i++) total += index.chunks[member.firstChunk + i].length;
+        if (total != member.length) damaged(path);
+    }
+    return fd;
+}
+
+void listArchive(const char* path, const AES_key* key) {
+    ChunkCipher cipher(key);
+    ArchiveIndex index;
+    int fd = openArchive(path, key, cipher, index);
+    close(fd);
+    PoolString out;
+    char line[32];
+    for (const IndexMember& member : index.members) {
+        snprintf(line, sizeof(line), "%12llu  ", (unsigned long long)member.length);
+        out += line;
+        out.append(index.names.data() + member.nameOffset, member.nameLength);
+        out += (member.flags & ARCHIVE_DIRECTORY) ? "/\n" : "\n";
+    }
+    writeOutput(1, out);
+}
+
+// Opens the directory that member 'name' goes in, one component at a time,
+// and sets 'leaf' to the last component of 'name'. Symbolic links aren't
+// followed, so a link in the tree can't send a member somewhere else.
+// Missing directories are created if 'create' is set.
+static int openParent(const std::string& name, const bool create, std::string& leaf) {
+    int dir = open(".", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (dir == -1) {
+        perror(".");
+        exit(1);
+    }
+    size_t start = 0;
+    for (size_t i = name.find('/'); i != std::string::npos; i = name.find('/', start)) {
+        std::string part = name.substr(start, i - start);
+        if (create && mkdirat(dir, part.c_str(), 0700) == -1 && errno != EEXIST) {
+            perror(name.substr(0, i).c_str());
+            exit(1);
+        }
+        int next = openat(dir, part.c_str(), O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+        if (next == -1) {
+            perror(name.substr(0, i).c_str());
+            exit(1);
+        }
+        close(dir);
+        dir = next;
+        start = i + 1;
+    }
+    leaf = name.substr(start);
+    return dir;
+}
+
+// Extracted members get the permission bits from the archive, but never
+// the setuid, setgid or sticky bits
+static mode_t memberMode(const IndexMember& member) {
+    return member.mode & 0777;
+}
+
+static void extractMember(const int fd, const char* path, const ChunkCipher& cipher, const ArchiveIndex& index, const IndexMember& member) {
+    TRACE_SPAN("member");
+    std::string name = index.name(member), leaf;
+    int dir = openParent(name, false, leaf);
+    int out = openat(dir, leaf.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_NOFOLLOW | O_CLOEXEC, 0600);
+    if (out == -1) {
+        perror(name.c_str());
+        exit(1);
+    }
+    close(dir);
+    PoolString data;
+    for (uint64_t i = 0; i < member.chunkCount; i++) {
+        const ManifestEntry& chunk = index.chunks[member.firstChunk + i];
+        size_t at = data.size();
+        data.resize(at + cdcSealedLength(chunk.length));
+        if (!readAt(fd, &data[at], data.size() - at, chunk.offset) ||
+            !cipher.open(chunk.id, (uint8_t*)&data[at], chunk.length)) {
+            damaged(path);
+        }
+        data.resize(at + chunk.length);
+        if (data.size() >= ARCHIVE_BLOCKLEN) {
+            writeAll(out, data.data(), data.size());
+            data.clear();
+        }
+    }
+    writeAll(out, data.data(), data.size());
+    fchmod(out, memberMode(member));
+    struct timespec times[2] = { { (time_t)member.mtime, 0 }, { (time_t)member.mtime, 0 } };
+    futimens(out, times);
+    close(out);
+}
+
+void extractArchive(const char* path, const AES_key* key, const char** names, const int count, const unsigned jobs) {
+    ChunkCipher cipher(key);
+    ArchiveIndex index;
+    int fd = openArchive(path, key, cipher, index);
+
+    // A name selects that member and everything below it
+    std::vector<std::string> wanted;
+    for (int i = 0; i < count; i++) {
+        std::string name;
+        memberName(names[i], name);
+        wanted.push_back(name);
+    }
+    std::vector<bool> found(wanted.size(), false);
+    std::vector<size_t> selected;
+    for (size_t i = 0; i < index.members.size(); i++) {
+        std::string name = index.name(index.members[i]);
+        bool match = wanted.empty();
+        for (size_t j = 0; j < wanted.size(); j++) {
+            if (name == wanted[j] || wanted[j].empty() ||
+                (name.compare(0, wanted[j].size(), wanted[j]) == 0 && name[wanted[j].size()] == '/')) {
+                found[j] = match = true;
+            }
+        }
+        if (match) selected.push_back(i);
+    }
+    for (size_t j = 0; j < wanted.size(); j++) {
+        if (!found[j]) {
+            fprintf(stderr, "\"%s\" isn't in the archive.\n", names[j]);
+            exit(1);
+        }
+    }
+
+    // Directories are made first, so that the workers only write files
+    std::vector<size_t> files;
+    for (size_t i : selected) {
+        const IndexMember& member = index.members[i];
+        std::string name = index.name(member), leaf;
+        int dir = openParent(name, true, leaf);
+        if (!(member.flags & ARCHIVE_DIRECTORY)) {
+            files.push_back(i);
+        } else if (mkdirat(dir, leaf.c_str(), 0700) == -1 && errno != EEXIST) {
+            perror(name.c_str());
+            exit(1);
+        }
+        close(dir);
+    }
+    std::vector<size_t> order = scheduleBySize(files, [&](size_t i) { return index.members[i].length; });
+    std::atomic<size_t> next(0);
+    runWorkers(jobs, [&]() {
+        for (size_t i = next++; i < order.size(); i = next++) {
+            extractMember(fd, path, cipher, index, index.members[order[i]]);
+        }
+    });
+    close(fd);
+
+    // Writing the files changed the directories' times. Parents come last,
+    // in case their mode keeps us out of them.
+    for (auto it = selected.rbegin(); it != selected.rend(); ++it) {
+        const IndexMember& member = index.members[*it];
+        if (!(member.flags & ARCHIVE_DIRECTORY)) continue;
+        std::string name = index.name(member), leaf;
+        int parent = openParent(name, false, leaf);
+        int dir = openat(parent, leaf.c_str(), O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+        close(parent);
+        if (dir == -1) {
+            perror(name.c_str());
+            exit(1);
+        }
+        fchmod(dir, memberMode(member));
+        struct timespec times[2] = { { (time_t)member.mtime, 0 }, { (time_t)member.mtime, 0 } };
+        futimens(dir, times);
+        close(dir);
+    }
+}
+
+#else
+
+void createArchive(const char* path, const AES_key* key, const char** paths, const int count, const unsigned jobs) {
+    fprintf(stderr, "--archive is only supported on Linux.\n");
+    exit(1);
+}
+
+void listArchive(const char* path, const AES_key* key) {
+    fprintf(stderr, "--archive is only supported on Linux.\n");
+    exit(1);
+}
+
+void extractArchive(const char* path, const AES_key* key, const char** names, const int count, const unsigned jobs) {
+    fprintf(stderr, "--archive is only supported on Linux.\n");
+    exit(1);
+}
+
+#endif
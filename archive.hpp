@@ -0,0 +1,90 @@
+#ifndef _ARCHIVE_HPP_
+#define _ARCHIVE_HPP_
+
+#include <cstddef>
+#include <cstdint>
+
+#include "aes.h"
+#include "cdc.hpp"
+#include "chunkstore.hpp"
+#include "message.hpp"
+
+/*
+    Encrypted archives of files and directories (--archive).
+
+    Archive layout (all integers are stored in host byte order):
+
+    [ArchiveHeader]   fixed size, starts with ARCHIVE_MAGIC
+    [chunk]...        sealed chunks (see cdc.hpp) of every member, in the
+                      order the workers finished them. Chunks that appear
+                      more than once, in any member, are stored once.
+    [index]           sealed like a chunk: an IndexHeader, the
+                      IndexMembers, then the ManifestEntry of every chunk
+                      (each member's are consecutive), then the names
+    [ArchiveTrailer]  fixed size, ends with ARCHIVE_MAGIC. Says where the
+                      index is.
+
+    Members are chunked and sealed by --jobs threads, and extracted the
+    same way. Listing reads the trailer and the index, and extracting a
+    member also reads its chunks, nothing else.
+
+    Names are relative paths with '/' separators and no "." or ".."
+    components.
+*/
+
+#define ARCHIVE_MAGIC "XMSGARCH"
+#define ARCHIVE_VERSION 1
+
+struct ArchiveHeader
+{
+    char magic[8];
+    uint32_t version;
+    uint32_t reserved0;
+    uint8_t keyId[MESSAGE_KEYIDLEN];
+    uint8_t reserved1[40];
+};
+
+struct ArchiveTrailer
+{
+    uint8_t indexId[CDC_IDLEN];
+    uint64_t indexOffset;
+    uint64_t indexLength;  // Without the padding
+    uint8_t reserved[24];
+    char magic[8];
+};
+
+struct IndexHeader
+{
+    uint64_t memberCount;
+    uint64_t chunkCount;
+    uint64_t namesLength;
+};
+
+#define ARCHIVE_DIRECTORY 0x1
+
+struct IndexMember
+{
+    uint64_t length;
+    uint64_t firstChunk;
+    uint64_t chunkCount;
+    int64_t mtime;  // Seconds since the epoch
+    uint32_t mode;  // Permission bits
+    uint32_t flags;
+    uint32_t nameOffset;
+    uint32_t nameLength;
+};
+
+static_assert(sizeof(ArchiveHeader) == 64, "ArchiveHeader must be 64 bytes");
+static_assert(sizeof(ArchiveTrailer) == 64, "ArchiveTrailer must be 64 bytes");
+static_assert(sizeof(IndexMember) == 48, "IndexMember must be 48 bytes");
+
+// Writes the files and directories in 'paths' (recursively) to a new
+// archive at 'path', using 'jobs' threads
+void createArchive(const char* path, const AES_key* key, const char** paths, const int count, const unsigned jobs);
+// Prints the size and name of every member
+void listArchive(const char* path, const AES_key* key);
+// Extracts the members named in 'names', and everything in the named
+// directories, below the current directory. No names means everything.
+void extractArchive(const char* path, const AES_key* key, const char** names, const int count, const unsigned jobs);
+
+#endif
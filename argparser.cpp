@@ -9,6 +9,7 @@
 #include <cstdlib>
 #include <cstring>
 #include <cstdbool>
+#include <cstdint>
 
 #define argparser_arguments ARGS
 
@@ -16,85 +17,156 @@ void cmd_help(int argc, char* argv[]);
 void cmd_version(int argc, char* argv[]);
 void cmd_debug(int argc, char* argv[]);
 void cmd_key(int argc, char* argv[]);
+void cmd_keyname(int argc, char* argv[]);
 void cmd_dumpkeys(int argc, char* argv[]);
 void cmd_encrypt(int argc, char* argv[]);
 void cmd_decrypt(int argc, char* argv[]);
+void cmd_batch(int argc, char* argv[]);
+void cmd_jobs(int argc, char* argv[]);
+void cmd_rekey(int argc, char* argv[]);
+void cmd_envelope(int argc, char* argv[]);
+void cmd_compress(int argc, char* argv[]);
+void cmd_mac(int argc, char* argv[]);
+void cmd_compact(int argc, char* argv[]);
+void cmd_stats(int argc, char* argv[]);
+void cmd_profile(int argc, char* argv[]);
+void cmd_memory(int argc, char* argv[]);
+void cmd_trace(int argc, char* argv[]);
+void cmd_incremental(int argc, char* argv[]);
+void cmd_archive(int argc, char* argv[]);
+void cmd_list(int argc, char* argv[]);
 void cmd_createkey(int argc, char* argv[]);
 void cmd_deletekey(int argc, char* argv[]);
+void cmd_importkeys(int argc, char* argv[]);
+void cmd_exportkeys(int argc, char* argv[]);
+void cmd_deletekeys(int argc, char* argv[]);
+void cmd_compactkeys(int argc, char* argv[]);
 
 // Defined as an extern variable in the H file
-const struct ARGPARSER_CmdArgument_t ARGS[] = {
-    { "-h", "--help", "Provides a list of possible arguments that can be passed to the program.", (void*)&cmd_help },
-    { "-v", "--version", "display xmsg version.", (void*)&cmd_version },
-    { "-D", "--debug", "enable debug messages.", (void*)&cmd_debug },
-    { "-k", "--key", "set encryption key to use.", (void*)&cmd_key },
-    { "-K", "--dumpkeys", "dumps available encryption keys.", (void*)&cmd_dumpkeys },
-    { "-e", "--encrypt", "enables encryption mode.", (void*)&cmd_encrypt },
-    { "-d", "--decrypt", "enables decryption mode.", (void*)&cmd_decrypt },
-    { "", "--createkey", "create encryption key.", (void*)&cmd_createkey },
-    { "", "--deletekey", "delete encryption key.", (void*)&cmd_deletekey }
+constexpr struct ARGPARSER_CmdArgument_t ARGS[] = {
+    { "-h", "--help", "Provides a list of possible arguments that can be passed to the program.", &cmd_help },
+    { "-v", "--version", "display xmsg version.", &cmd_version },
+    { "-D", "--debug", "enable debug messages.", &cmd_debug },
+    { "-k", "--key", "set encryption key to use.", &cmd_key },
+    { "", "--key-name", "set encryption key to use by name.", &cmd_keyname },
+    { "-K", "--dumpkeys", "dumps available encryption keys.", &cmd_dumpkeys },
+    { "-e", "--encrypt", "enables encryption mode.", &cmd_encrypt },
+    { "-d", "--decrypt", "enables decryption mode.", &cmd_decrypt },
+    { "-b", "--batch", "treat every line of input as a separate message.", &cmd_batch },
+    { "-j", "--jobs", "number of threads used for --batch, --rekey and --archive.", &cmd_jobs },
+    { "", "--rekey", "re-encrypt messages (one per line) from key FROM to key TO, given as indices or names.", &cmd_rekey },
+    { "", "--envelope", "encrypt once for several keys (indices or names), any of which can decrypt.", &cmd_envelope },
+    { "-c", "--compress", "compress messages before encrypting them.", &cmd_compress },
+    { "-m", "--mac", "authenticate messages with HMAC-SHA256. With --decrypt or --rekey, reject messages that aren't authenticated.", &cmd_mac },
+    { "", "--compact", "write messages in the compact format, with a smaller header and MAC tag and no padding.", &cmd_compact },
+    { "", "--incremental", "encrypt stdin into the chunk store FILE, only re-encrypting chunks that changed, or decrypt FILE to stdout.", &cmd_incremental },
+    { "", "--archive", "encrypt files and directories into the archive FILE, or extract all or the named members of FILE.", &cmd_archive },
+    { "", "--list", "list the members of an --archive.", &cmd_list },
+    { "", "--stats", "print per-stage timings to stderr when done, as text or with \"json\" as JSON.", &cmd_stats },
+    { "", "--profile", "like --stats, with hardware performance counters (IPC, cache and branch misses) per stage.", &cmd_profile },
+    { "", "--memory", "like --stats, with allocation counts and bytes and peak RSS growth per stage.", &cmd_memory },
+    { "", "--trace", "write a Chrome trace event timeline to FILE when done (needs a build with -DXMSG_TRACE).", &cmd_trace },
+    { "", "--createkey", "create encryption key.", &cmd_createkey },
+    { "", "--deletekey", "delete encryption key.", &cmd_deletekey },
+    { "", "--importkeys", "import keys from stdin, one \"<name> <hex key>\" per line, or 48 byte records with \"binary\".", &cmd_importkeys },
+    { "", "--exportkeys", "export keys to stdout, in the --importkeys format.", &cmd_exportkeys },
+    { "", "--deletekeys", "delete the keys named on stdin, one name per line.", &cmd_deletekeys },
+    { "", "--compactkeys", "drop deleted keys from the key file. Renumbers the keys.", &cmd_compactkeys }
 };
 struct ARGPARSER_Context_t argparser_context;
 
+#define ARGS_COUNT (sizeof(ARGS) / sizeof(ARGS[0]))
+
+// FNV-1a of a NUL terminated string
+constexpr uint32_t hashArgument(const char* str) {
+    uint32_t hash = 2166136261u;
+    while (*str != '\0') {
+        hash ^= (uint8_t)*str++;
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+struct ArgumentIndex
+{
+    uint32_t aliasHashes[ARGS_COUNT];
+    // ARGS index of the "-x" prefix for each character x, or -1
+    int8_t prefixes[128];
+};
+
+constexpr ArgumentIndex buildArgumentIndex() {
+    ArgumentIndex index = {};
+    for (unsigned i = 0; i < 128; i++) {
+        index.prefixes[i] = -1;
+    }
+    for (unsigned i = 0; i < ARGS_COUNT; i++) {
+        index.aliasHashes[i] = hashArgument(ARGS[i].alias);
+        if (ARGS[i].cmd[0] == '-' && ARGS[i].cmd[1] != '\0' && (uint8_t)ARGS[i].cmd[1] < 128) {
+            index.prefixes[(uint8_t)ARGS[i].cmd[1]] = (int8_t)i;
+        }
+    }
+    return index;
+}
+
+static constexpr ArgumentIndex _index = buildArgumentIndex();
+
+// Returns the ARGS index of the option 'arg' is the alias of, or -1
+static int findAlias(const char* arg) {
+    const uint32_t hash = hashArgument(arg);
+    for (unsigned i = 0; i < ARGS_COUNT; i++) {
+        if (_index.aliasHashes[i] == hash && strcmp(arg, ARGS[i].alias) == 0) return (int)i;
+    }
+    return -1;
+}
+
+// Returns the ARGS index of the option 'arg' starts with ("-k0"), or -1
+static int findPrefix(const char* arg) {
+    if (arg[0] != '-' || (uint8_t)arg[1] >= 128) return -1;
+    return _index.prefixes[(uint8_t)arg[1]];
+}
+
 void ARGPARSER_parseProgramArguments(int argc, char* argv[], char* overflow[], size_t overflow_cb, unsigned* overflow_count) {
     unsigned c_overflow = 0;
 
     int subargs_count;
-    const char** subargs;
+    char** subargs;
 
-    subargs = (const char**)malloc(sizeof(char*) * argc);
+    subargs = (char**)malloc(sizeof(char*) * argc);
     subargs_count = 0;
 
     for (int i = 0; i < argc; i++) {
-        bool found = false;
+        subargs_count = 0;
 
         std::string str;
-        for (unsigned j = 0; j < sizeof(ARGS) / sizeof(ARGS[0]); j++) {
-            int type = 0;
-            str.clear();
-
-            if (strcmp(argv[i], ARGS[j].alias) == 0)
-            {
-                for (int k = i + 1; k < argc; k++) {
-                    // If the next argument starts with '-', break
-                    if (argv[k][0] == '-') break;
-                    subargs[subargs_count] = argv[k];
-                    subargs_count++;
-                }
-                type = 1;
-                found = true;
+        int j = findAlias(argv[i]);
+        if (j >= 0) {
+            for (int k = i + 1; k < argc; k++) {
+                // If the next argument starts with '-', break
+                if (argv[k][0] == '-') break;
+                subargs[subargs_count] = argv[k];
+                subargs_count++;
             }
-            else if (strlen(ARGS[j].cmd) > 1 &&
-                strncmp(argv[i], ARGS[j].cmd, strlen(ARGS[j].cmd)) == 0)
-            {
-                for (int k = 2; argv[i][k] >= '0' && argv[i][k] <= '9'; k++) {
-                    str.push_back(argv[i][k]);
-                }
-                type = 2;
-                found = true;
+            i += subargs_count;
+        } else if ((j = findPrefix(argv[i])) >= 0) {
+            for (int k = 2; argv[i][k] >= '0' && argv[i][k] <= '9'; k++) {
+                str.push_back(argv[i][k]);
             }
-            // Call the callback function if it's not NULL to avoid segfaults
-            if (ARGS[j].callback == NULL) continue;
-
-            switch (type) {
-            case 1:
-                i += subargs_count;
-                ((void(*)(int,const char*[]))ARGS[j].callback)(subargs_count, subargs);
-                break;
-            case 2:
-                if (str.length() > 0) {
-                    subargs[0] = str.data();
-                    subargs_count = 1;
-                }
-                ((void(*)(int,const char*[]))ARGS[j].callback)(subargs_count, subargs);
-                break;
+            if (str.length() > 0) {
+                subargs[0] = &str[0];
+                subargs_count = 1;
             }
+        }
 
-            if (type != 0) break;
+        // Call the callback function if it's not NULL to avoid segfaults
+        if (j >= 0) {
+            if (ARGS[j].callback != NULL) {
+                ARGS[j].callback(subargs_count, subargs);
+            }
+            continue;
         }
 
         // Push argument to overflow buffer if no match is found
-        if (!found && overflow) {
+        if (overflow) {
             // Ensure there are no segfaults
             if ((c_overflow + 1) * sizeof(char*) > overflow_cb) {
                 continue;
@@ -136,6 +208,14 @@ void cmd_key(int argc, char* argv[]) {
     sscanf(argv[0], "%d", &argparser_context.key);
 }
 
+void cmd_keyname(int argc, char* argv[]) {
+    if (argc != 1) {
+        fprintf(stderr, "Invalid number of paramaters for --key-name (argc=%i).\n", argc);
+        exit(1);
+    }
+    argparser_context.keyName = argv[0];
+}
+
 void cmd_dumpkeys(int argc, char* argv[]) {
     // Creates Keychain object with invalid key ID.
     // Prints out all the available encryption keys
@@ -151,6 +231,104 @@ void cmd_decrypt(int argc, char* argv[]) {
     argparser_context.decrypt = true;
 }
 
+void cmd_batch(int argc, char* argv[]) {
+    argparser_context.batch = true;
+}
+
+void cmd_jobs(int argc, char* argv[]) {
+    if (argc != 1) {
+        fprintf(stderr, "Invalid number of paramaters for --jobs (argc=%i).\n", argc);
+        exit(1);
+    }
+    sscanf(argv[0], "%d", &argparser_context.jobs);
+}
+
+void cmd_rekey(int argc, char* argv[]) {
+    if (argc != 2) {
+        fprintf(stderr, "--rekey needs two keys, FROM and TO (argc=%i).\n", argc);
+        exit(1);
+    }
+    argparser_context.rekeyFrom = argv[0];
+    argparser_context.rekeyTo = argv[1];
+}
+
+void cmd_envelope(int argc, char* argv[]) {
+    if (argc < 1) {
+        fprintf(stderr, "--envelope needs at least one key.\n");
+        exit(1);
+    }
+    // 'argv' is only valid during the callback
+    argparser_context.envelopeKeys = (const char**)malloc(sizeof(char*) * argc);
+    memcpy(argparser_context.envelopeKeys, argv, sizeof(char*) * argc);
+    argparser_context.envelopeCount = argc;
+}
+
+void cmd_compress(int argc, char* argv[]) {
+    argparser_context.compress = true;
+}
+
+void cmd_mac(int argc, char* argv[]) {
+    argparser_context.mac = true;
+}
+
+void cmd_compact(int argc, char* argv[]) {
+    argparser_context.compact = true;
+}
+
+void cmd_incremental(int argc, char* argv[]) {
+    if (argc != 1) {
+        fprintf(stderr, "--incremental needs a FILE (argc=%i).\n", argc);
+        exit(1);
+    }
+    argparser_context.incrementalPath = argv[0];
+}
+
+void cmd_archive(int argc, char* argv[]) {
+    if (argc < 1) {
+        fprintf(stderr, "--archive needs a FILE.\n");
+        exit(1);
+    }
+    argparser_context.archivePath = argv[0];
+    // 'argv' is only valid during the callback
+    argparser_context.archiveMembers = (const char**)malloc(sizeof(char*) * argc);
+    memcpy(argparser_context.archiveMembers, argv + 1, sizeof(char*) * (argc - 1));
+    argparser_context.archiveMemberCount = argc - 1;
+}
+
+void cmd_list(int argc, char* argv[]) {
+    argparser_context.list = true;
+}
+
+void cmd_stats(int argc, char* argv[]) {
+    if (argc > 1 || (argc == 1 && strcmp(argv[0], "json") != 0)) {
+        fprintf(stderr, "Invalid parameters for --stats, expected nothing or \"json\".\n");
+        exit(1);
+    }
+    argparser_context.stats = true;
+    argparser_context.statsJson = (argc == 1);
+}
+
+void cmd_profile(int argc, char* argv[]) {
+    argparser_context.profile = true;
+}
+
+void cmd_memory(int argc, char* argv[]) {
+    argparser_context.memory = true;
+}
+
+void cmd_trace(int argc, char* argv[]) {
+#ifdef XMSG_TRACE
+    if (argc != 1) {
+        fprintf(stderr, "--trace needs a FILE (argc=%i).\n", argc);
+        exit(1);
+    }
+    argparser_context.traceFile = argv[0];
+#else
+    fprintf(stderr, "xmsg was built without tracing, set TRACEFLAGS in config.mk.\n");
+    exit(1);
+#endif
+}
+
 void cmd_createkey(int argc, char* argv[]) {
     Keychain::createKey();
     exit(0);
@@ -162,3 +340,31 @@ void cmd_deletekey(int argc, char* argv[]) {
     exit(0);
 }
 
+
+// Checks for the optional "binary" parameter of --importkeys/--exportkeys
+static bool isBinaryFormat(const char* option, int argc, char* argv[]) {
+    if (argc == 0) return false;
+    if (argc == 1 && strcmp(argv[0], "binary") == 0) return true;
+    fprintf(stderr, "Invalid parameters for %s, expected nothing or \"binary\".\n", option);
+    exit(1);
+}
+
+void cmd_importkeys(int argc, char* argv[]) {
+    Keychain::importKeys(isBinaryFormat("--importkeys", argc, argv));
+    exit(0);
+}
+
+void cmd_exportkeys(int argc, char* argv[]) {
+    Keychain::exportKeys(isBinaryFormat("--exportkeys", argc, argv));
+    exit(0);
+}
+
+void cmd_deletekeys(int argc, char* argv[]) {
+    Keychain::deleteKeys();
+    exit(0);
+}
+
+void cmd_compactkeys(int argc, char* argv[]) {
+    Keychain::compactKeys();
+    exit(0);
+}
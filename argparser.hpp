@@ -13,14 +13,19 @@
 
     Arguments that have no matches will be returned via.
     the overflow parameter.
+
+    The table is constexpr, so the lookup tables for it are built at
+    compile time and matching an argument doesn't scan the table.
 */
 
+typedef void (*ARGPARSER_Callback_t)(int argc, char* argv[]);
+
 struct ARGPARSER_CmdArgument_t
 {
     const char* cmd; // The argument prefix. (ex. "-d")
     const char* alias; // The argument alias. (ex. "--debug")
     const char* description; // A short description on what the argument does
-    const void* callback; // A callback function. If this is NULL, nothing is called
+    ARGPARSER_Callback_t callback; // A callback function. If this is NULL, nothing is called
 };
 
 struct ARGPARSER_Context_t
@@ -29,6 +34,26 @@ struct ARGPARSER_Context_t
     bool encrypt;
     bool decrypt;
     int key;
+    const char* keyName;
+    bool batch;
+    int jobs;
+    const char* rekeyFrom;
+    const char* rekeyTo;
+    int envelopeCount;
+    const char** envelopeKeys;
+    bool compress;
+    bool mac;
+    bool compact;
+    bool stats;
+    bool statsJson;
+    bool profile;
+    bool memory;
+    const char* traceFile;
+    const char* incrementalPath;
+    const char* archivePath;
+    const char** archiveMembers;
+    int archiveMemberCount;
+    bool list;
 };
 
 /*
@@ -27,10 +27,11 @@
 
    René Nyffenegger rene.nyffenegger@adp-gmbh.ch
 
+   Altered for xmsg: adds base64_encode_block and base64_decode_block.
+
 */
 
 #include "base64.hpp"
-#include <iostream>
 
 static const std::string base64_chars = 
              "ABCDEFGHIJKLMNOPQRSTUVWXYZ"
@@ -120,3 +121,75 @@ std::string base64_decode(std::string const& encoded_string) {
 
   return ret;
 }
+
+static const char base64_table[] =
+             "ABCDEFGHIJKLMNOPQRSTUVWXYZ"
+             "abcdefghijklmnopqrstuvwxyz"
+             "0123456789+/";
+
+// Reverse lookup table, 0xff for characters outside the alphabet
+static const unsigned char* base64_reverse_table() {
+  static unsigned char table[256];
+  static bool initialized = false;
+  if (!initialized) {
+    for (int i = 0; i < 256; i++) table[i] = 0xff;
+    for (int i = 0; i < 64; i++) table[(unsigned char)base64_table[i]] = (unsigned char)i;
+    initialized = true;
+  }
+  return table;
+}
+
+size_t base64_encode_block(unsigned char const* in, size_t len, char* out) {
+  char* start = out;
+  size_t i = 0;
+
+  for (; i + 3 <= len; i += 3) {
+    const unsigned v = (in[i] << 16) | (in[i + 1] << 8) | in[i + 2];
+    *out++ = base64_table[(v >> 18) & 0x3f];
+    *out++ = base64_table[(v >> 12) & 0x3f];
+    *out++ = base64_table[(v >> 6) & 0x3f];
+    *out++ = base64_table[v & 0x3f];
+  }
+
+  if (i < len) {
+    const unsigned v = (in[i] << 16) | ((i + 1 < len) ? in[i + 1] << 8 : 0);
+    *out++ = base64_table[(v >> 18) & 0x3f];
+    *out++ = base64_table[(v >> 12) & 0x3f];
+    *out++ = (i + 1 < len) ? base64_table[(v >> 6) & 0x3f] : '=';
+    *out++ = '=';
+  }
+
+  return out - start;
+}
+
+size_t base64_decode_block(char const* in, size_t len, unsigned char* out) {
+  static const unsigned char* table = base64_reverse_table();
+  unsigned char* start = out;
+
+  for (size_t i = 0; i < len; i += 4) {
+    const unsigned char a = table[(unsigned char)in[i]];
+    const unsigned char b = table[(unsigned char)in[i + 1]];
+    if ((a | b) == 0xff) return (size_t)-1;
+
+    // Padding may only appear in the last group
+    if (in[i + 2] == '=' || in[i + 3] == '=') {
+      if (i + 4 != len || (in[i + 2] == '=' && in[i + 3] != '=')) return (size_t)-1;
+      *out++ = (unsigned char)((a << 2) | (b >> 4));
+      if (in[i + 2] != '=') {
+        const unsigned char c = table[(unsigned char)in[i + 2]];
+        if (c == 0xff) return (size_t)-1;
+        *out++ = (unsigned char)((b << 4) | (c >> 2));
+      }
+      break;
+    }
+
+    const unsigned char c = table[(unsigned char)in[i + 2]];
+    const unsigned char d = table[(unsigned char)in[i + 3]];
+    if ((c | d) == 0xff) return (size_t)-1;
+    *out++ = (unsigned char)((a << 2) | (b >> 4));
+    *out++ = (unsigned char)((b << 4) | (c >> 2));
+    *out++ = (unsigned char)((c << 6) | d);
+  }
+
+  return out - start;
+}
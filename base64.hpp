@@ -7,8 +7,17 @@
 #define BASE64_H_C0CE2A47_D10E_42C9_A27C_C883944E704A
 
 #include <string>
+#include <cstddef>
 
 std::string base64_encode(unsigned char const* , unsigned int len);
 std::string base64_decode(std::string const& s);
 
+// Block-wise variants for streaming, added for xmsg.
+// base64_encode_block writes 4 * ((len + 2) / 3) characters; only the last
+// block of a stream may have a length that isn't a multiple of 3.
+size_t base64_encode_block(unsigned char const* in, size_t len, char* out);
+// base64_decode_block decodes 'len' characters, a multiple of 4, and returns
+// the number of bytes written, or (size_t)-1 if the input isn't base64.
+size_t base64_decode_block(char const* in, size_t len, unsigned char* out);
+
 #endif /* BASE64_H_C0CE2A47_D10E_42C9_A27C_C883944E704A */
@@ -0,0 +1,211 @@
+/*
+    Microbenchmarks for the hot kernels: AES, base64, the random generator,
+    SHA-256 and compression. Run with "make bench".
+
+    Every kernel is timed over message sizes from 16 bytes up to
+    --max-size, repeating it until --min-time seconds have passed. Results
+    are written to stdout as JSON, for tracking regressions:
+    ns per operation, cycles per byte (TSC cycles, where available) and GB/s.
+
+    Usage: xmsg-bench [--min-time SECONDS] [--max-size BYTES] [--filter NAME]
+*/
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <chrono>
+#include <string>
+#include <vector>
+
+// The block functions and the key expansion are static, so include the
+// implementation itself
+#include "aes.c"
+#include "base64.hpp"
+#include "compress.hpp"
+#include "cpu.hpp"
+#include "drbg.hpp"
+#include "sha256.hpp"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <x86intrin.h>
+#define BENCH_TSC
+#endif
+
+#define BENCH_MINSIZE 16
+#define BENCH_DEFAULT_MAXSIZE (64u << 20)
+
+static double _minTime = 0.2;
+static size_t _maxSize = BENCH_DEFAULT_MAXSIZE;
+static const char* _filter = NULL;
+static bool _first = true;
+// Keeps results alive so the compiler can't drop the work
+static volatile uint8_t _sink;
+
+static uint64_t readCycles() {
+#ifdef BENCH_TSC
+    return __rdtsc();
+#else
+    return 0;
+#endif
+}
+
+// Runs 'op' until the minimum time has passed and prints one result.
+// 'size' is the number of bytes one operation processes.
+template <typename Op>
+static void measure(const char* kernel, const size_t size, Op op) {
+    if (_filter != NULL && strstr(kernel, _filter) == NULL) return;
+
+    // Warm up caches and lazily initialized state
+    op();
+
+    uint64_t iterations = 0, batch = 1, cycles = 0;
+    double seconds = 0;
+    while (seconds < _minTime) {
+        auto start = std::chrono::steady_clock::now();
+        uint64_t startCycles = readCycles();
+        for (uint64_t i = 0; i < batch; i++) {
+            op();
+        }
+        cycles += readCycles() - startCycles;
+        seconds += std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        iterations += batch;
+        if (batch < (1u << 20)) batch *= 2;
+    }
+
+    double bytes = (double)size * iterations;
+    printf("%s\n    {\"kernel\": \"%s\", \"bytes\": %zu, \"iterations\": %llu, \"ns_per_op\": %.2f, ",
+        _first ? "" : ",", kernel, size, (unsigned long long)iterations, seconds * 1e9 / iterations);
+    if (cycles > 0) {
+        printf("\"cycles_per_byte\": %.3f, ", cycles / bytes);
+    } else {
+        printf("\"cycles_per_byte\": null, ");
+    }
+    printf("\"gb_per_s\": %.4f}", bytes / seconds / 1e9);
+    fflush(stdout);
+    _first = false;
+}
+
+static void fillText(uint8_t* data, const size_t size) {
+    // Log-like text, so compression has something to work with
+    static const char sample[] = "{\"ts\":1700000000,\"level\":\"info\",\"svc\":\"api\",\"msg\":\"request handled\",\"latency_ms\":";
+    for (size_t i = 0; i < size; i++) {
+        data[i] = (i % 97 < sizeof(sample) - 1) ? sample[i % 97] : (uint8_t)('0' + (i * 7919) % 10);
+    }
+}
+
+static void benchKeyExpansion() {
+    uint8_t key[AES_KEYLEN];
+    uint8_t roundKey[AES_keyExpSize];
+    Drbg::local().generate(key, sizeof(key));
+    measure("KeyExpansion", AES_KEYLEN, [&]() {
+        KeyExpansion(roundKey, key);
+        key[0] ^= roundKey[AES_keyExpSize - 1];
+    });
+    _sink = key[0];
+}
+
+static void benchBlocks(const AES_ctx* ctx) {
+    uint8_t block[AES_BLOCKLEN] = { 0 };
+    measure("Cipher", AES_BLOCKLEN, [&]() {
+        Cipher((state_t*)block, ctx->RoundKey);
+    });
+    measure("InvCipher", AES_BLOCKLEN, [&]() {
+        InvCipher((state_t*)block, ctx->RoundKey);
+    });
+    _sink = block[0];
+}
+
+static void benchSize(AES_ctx* ctx, const size_t size) {
+    std::vector<uint8_t> data(size);
+    fillText(data.data(), size);
+
+    measure("AES_CBC_encrypt_buffer", size, [&]() {
+        AES_CBC_encrypt_buffer(ctx, data.data(), (uint32_t)size);
+    });
+    measure("AES_CBC_decrypt_buffer", size, [&]() {
+        AES_CBC_decrypt_buffer(ctx, data.data(), (uint32_t)size);
+    });
+
+    fillText(data.data(), size);
+    std::string encoded;
+    measure("base64_encode", size, [&]() {
+        encoded = base64_encode(data.data(), (unsigned)size);
+    });
+    measure("base64_decode", size, [&]() {
+        _sink = base64_decode(encoded)[0];
+    });
+    measure("base64_encode_block", size, [&]() {
+        base64_encode_block(data.data(), size, &encoded[0]);
+    });
+    measure("base64_decode_block", size, [&]() {
+        base64_decode_block(encoded.data(), encoded.size(), data.data());
+    });
+    encoded.clear();
+    encoded.shrink_to_fit();
+
+    measure("generateRandomBytes", size, [&]() {
+        Drbg::local().generate(data.data(), size);
+    });
+
+    fillText(data.data(), size);
+    uint8_t digest[SHA256_DIGESTLEN];
+    measure("sha256", size, [&]() {
+        Sha256 hash;
+        hash.update(data.data(), size);
+        hash.final(digest);
+    });
+    _sink = digest[0];
+
+    std::vector<uint8_t> packed(compressBound(size));
+    size_t packedSize = 0;
+    measure("compress", size, [&]() {
+        packedSize = compress(data.data(), size, packed.data());
+    });
+    Decompressor decompressor;
+    PoolString unpacked;
+    measure("decompress", size, [&]() {
+        unpacked.clear();
+        decompressor.feed(packed.data(), packedSize, unpacked);
+    });
+}
+
+static void parseArguments(int argc, char* argv[]) {
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--min-time") == 0 && i + 1 < argc) {
+            _minTime = atof(argv[++i]);
+        } else if (strcmp(argv[i], "--max-size") == 0 && i + 1 < argc) {
+            _maxSize = strtoull(argv[++i], NULL, 10);
+        } else if (strcmp(argv[i], "--filter") == 0 && i + 1 < argc) {
+            _filter = argv[++i];
+        } else {
+            fprintf(stderr, "Usage: %s [--min-time SECONDS] [--max-size BYTES] [--filter NAME]\n", argv[0]);
+            exit(1);
+        }
+    }
+}
+
+int main(int argc, char* argv[]) {
+    parseArguments(argc, argv);
+
+    AES_ctx ctx;
+    uint8_t key[AES_KEYLEN], iv[AES_BLOCKLEN];
+    Drbg::local().generate(key, sizeof(key));
+    Drbg::local().generate(iv, sizeof(iv));
+    AES_init_ctx_iv(&ctx, key, iv);
+
+    const CpuFeatures& cpu = cpuFeatures();
+    printf("{\n  \"cpu\": {\"ssse3\": %s, \"sse41\": %s, \"sha\": %s, \"aes\": %s, \"avx512\": %s, \"vaes\": %s},\n",
+        cpu.ssse3 ? "true" : "false", cpu.sse41 ? "true" : "false", cpu.sha ? "true" : "false",
+        cpu.aes ? "true" : "false", cpu.avx512 ? "true" : "false", cpu.vaes ? "true" : "false");
+    printf("  \"min_time\": %.3f,\n  \"results\": [", _minTime);
+
+    benchKeyExpansion();
+    benchBlocks(&ctx);
+    // 16 B, 64 B, 256 B ... up to the maximum size
+    for (size_t size = BENCH_MINSIZE; size <= _maxSize; size *= 4) {
+        benchSize(&ctx, size);
+    }
+
+    printf("\n  ]\n}\n");
+    return 0;
+}
@@ -0,0 +1,172 @@
+#include "bufpool.hpp"
+#include "memory.hpp"
+#include "secmem.hpp"
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstdint>
+#include <mutex>
+
+#ifdef __linux__
+#include <sys/mman.h>
+#elif defined(_WIN32)
+#include <malloc.h>
+#endif
+
+#define BUFPOOL_ALIGNMENT 64
+// Size classes from BUFPOOL_MINSIZE (4 KiB, 2^12) to BUFPOOL_MAXCACHED (2^24)
+#define BUFPOOL_MINSHIFT 12
+#define BUFPOOL_MAXSHIFT 24
+#define BUFPOOL_CLASSES (2 * (BUFPOOL_MAXSHIFT - BUFPOOL_MINSHIFT) + 1)
+// Buffers kept per class, by each thread and in the shared list
+#define BUFPOOL_THREADCACHED 2
+#define BUFPOOL_SHARED 8
+
+// Size classes are 2^k and 1.5 * 2^k. Returns -1 for sizes that aren't
+// pooled, and the size to allocate in 'classSize'.
+static int sizeClass(const size_t size, size_t* classSize) {
+    if (size < BUFPOOL_MINSIZE || size > BUFPOOL_MAXCACHED) {
+        *classSize = size;
+        return -1;
+    }
+    int shift = BUFPOOL_MINSHIFT;
+    while (((size_t)1 << shift) < size) shift++;
+    size_t power = (size_t)1 << shift;
+    int index = 2 * (shift - BUFPOOL_MINSHIFT);
+    if (shift > BUFPOOL_MINSHIFT && size <= power / 4 * 3) {
+        *classSize = power / 4 * 3;
+        return index - 1;
+    }
+    *classSize = power;
+    return index;
+}
+
+static size_t classSizeOf(const int index) {
+    size_t power = (size_t)1 << (BUFPOOL_MINSHIFT + (index + 1) / 2);
+    return (index % 2 == 0) ? power : power / 4 * 3;
+}
+
+#ifdef __linux__
+// Huge buffers are mapped in whole huge pages
+static size_t mappingSize(const size_t size) {
+    return (size + BUFPOOL_HUGESIZE - 1) / BUFPOOL_HUGESIZE * BUFPOOL_HUGESIZE;
+}
+#endif
+
+static void* allocateBuffer(const size_t size) {
+#ifdef __linux__
+    if (size >= BUFPOOL_HUGESIZE) {
+        // Map one huge page more than needed and trim the ends, which
+        // leaves the buffer aligned to a huge page
+        const size_t length = mappingSize(size);
+        void* p = mmap(NULL, length + BUFPOOL_HUGESIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (p == MAP_FAILED) {
+            perror("mmap");
+            exit(1);
+        }
+        uint8_t* start = (uint8_t*)p;
+        uint8_t* aligned = (uint8_t*)(((uintptr_t)start + BUFPOOL_HUGESIZE - 1) & ~(uintptr_t)(BUFPOOL_HUGESIZE - 1));
+        if (aligned > start) munmap(start, aligned - start);
+        if (aligned < start + BUFPOOL_HUGESIZE) munmap(aligned + length, start + BUFPOOL_HUGESIZE - aligned);
+        madvise(aligned, length, MADV_HUGEPAGE);
+        return aligned;
+    }
+    void* p = NULL;
+    if (posix_memalign(&p, BUFPOOL_ALIGNMENT, (size > 0) ? size : 1) != 0) p = NULL;
+#elif defined(_WIN32)
+    void* p = _aligned_malloc((size > 0) ? size : 1, BUFPOOL_ALIGNMENT);
+#endif
+    if (p == NULL) {
+        fprintf(stderr, "Out of memory allocating %zu bytes.\n", size);
+        exit(1);
+    }
+    return p;
+}
+
+static void freeBuffer(void* p, const size_t size) {
+#ifdef __linux__
+    if (size >= BUFPOOL_HUGESIZE) {
+        munmap(p, mappingSize(size));
+        return;
+    }
+    free(p);
+#elif defined(_WIN32)
+    _aligned_free(p);
+#endif
+}
+
+// Plain arrays, so they outlive the thread caches that are destroyed at exit
+static std::mutex _sharedLock;
+static void* _shared[BUFPOOL_CLASSES][BUFPOOL_SHARED];
+static unsigned _sharedCounts[BUFPOOL_CLASSES];
+
+// Puts a buffer on the shared list, or frees it if the list is full
+static void releaseShared(void* p, const int index, const size_t size) {
+    {
+        std::lock_guard<std::mutex> guard(_sharedLock);
+        if (_sharedCounts[index] < BUFPOOL_SHARED) {
+            _shared[index][_sharedCounts[index]++] = p;
+            return;
+        }
+    }
+    freeBuffer(p, size);
+}
+
+struct ThreadCache
+{
+    void* buffers[BUFPOOL_CLASSES][BUFPOOL_THREADCACHED];
+    unsigned counts[BUFPOOL_CLASSES];
+
+    ThreadCache() : counts() {}
+    // Hands what's left to the other threads
+    ~ThreadCache() {
+        for (int i = 0; i < BUFPOOL_CLASSES; i++) {
+            while (this->counts[i] > 0) releaseShared(this->buffers[i][--this->counts[i]], i, classSizeOf(i));
+        }
+    }
+};
+
+static thread_local ThreadCache _cache;
+
+void* BufferPool::allocate(const size_t size) {
+    if (Memory::enabled) Memory::allocated(MEMORY_POOL, size);
+    MemoryUncounted uncounted;
+    size_t classSize;
+    int index = sizeClass(size, &classSize);
+    if (index < 0) return allocateBuffer(classSize);
+
+    if (_cache.counts[index] > 0) {
+        return _cache.buffers[index][--_cache.counts[index]];
+    }
+    {
+        std::lock_guard<std::mutex> guard(_sharedLock);
+        if (_sharedCounts[index] > 0) {
+            return _shared[index][--_sharedCounts[index]];
+        }
+    }
+    return allocateBuffer(classSize);
+}
+
+void BufferPool::release(void* p, const size_t size) {
+    if (p == NULL) return;
+    size_t classSize;
+    int index = sizeClass(size, &classSize);
+#ifdef __linux__
+    // Unmapped buffers go back to the kernel, which clears them
+    const bool unmapped = index < 0 && classSize >= BUFPOOL_HUGESIZE;
+#else
+    const bool unmapped = false;
+#endif
+    // Only the first 'size' bytes were handed out, so nothing else was
+    // written to
+    if (!unmapped) SecureMemory::zero(p, size);
+    if (index < 0) {
+        freeBuffer(p, classSize);
+        return;
+    }
+    if (_cache.counts[index] < BUFPOOL_THREADCACHED) {
+        _cache.buffers[index][_cache.counts[index]++] = p;
+        return;
+    }
+    releaseShared(p, index, classSize);
+}
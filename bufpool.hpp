@@ -0,0 +1,74 @@
+#ifndef _BUFPOOL_HPP_
+#define _BUFPOOL_HPP_
+
+#include <cstddef>
+#include <string>
+#include <vector>
+
+/*
+    Reusable buffers for message data: batches, pipeline output, whole
+    inputs and the ciphertext of authenticated messages.
+
+    Buffers are aligned to 64 bytes and rounded up to a size class (powers
+    of two from 4 KiB, with one step halfway between each). A released
+    buffer is kept by the thread that released it and handed out again for
+    the next message of its class, pages already faulted in. Each thread
+    keeps a few per class; the rest go to a shared list, so that buffers
+    released by the writing thread can be reused by workers and the other
+    way around. Smaller requests go to the regular heap, and buffers above
+    BUFPOOL_MAXCACHED are not kept.
+
+    On Linux, buffers of BUFPOOL_HUGESIZE and more are mapped on their own,
+    aligned to and marked for transparent huge pages (MADV_HUGEPAGE). They
+    get them if /sys/kernel/mm/transparent_hugepage/enabled is "always" or
+    "madvise".
+
+    Some of them hold plaintext: whole inputs, batches to encrypt and
+    decrypted output. So buffers are zeroed when they're released, before
+    they can be handed out again or freed. They aren't locked or guarded
+    like SecureMemory, though, so keys don't go in them, and neither does
+    the plaintext the encrypt processors collect.
+*/
+
+#define BUFPOOL_MINSIZE (4 << 10)
+#define BUFPOOL_HUGESIZE (2 << 20)
+#define BUFPOOL_MAXCACHED (16 << 20)
+
+class BufferPool
+{
+public:
+    // Returns at least 'size' bytes, aligned to 64 bytes.
+    // Exits the program if no memory is available.
+    static void* allocate(const size_t size);
+    // Returns a buffer from allocate() of the same 'size'. NULL is ignored.
+    static void release(void* p, const size_t size);
+};
+
+// Allocator for standard containers that hold message data
+template <typename T>
+struct PoolAllocator
+{
+    typedef T value_type;
+
+    PoolAllocator() = default;
+    template <typename U>
+    PoolAllocator(const PoolAllocator<U>&) {}
+
+    T* allocate(const size_t n) {
+        return (T*)BufferPool::allocate(n * sizeof(T));
+    }
+    void deallocate(T* p, const size_t n) {
+        BufferPool::release(p, n * sizeof(T));
+    }
+};
+
+template <typename T, typename U>
+bool operator==(const PoolAllocator<T>&, const PoolAllocator<U>&) { return true; }
+template <typename T, typename U>
+bool operator!=(const PoolAllocator<T>&, const PoolAllocator<U>&) { return false; }
+
+template <typename T>
+using PoolVector = std::vector<T, PoolAllocator<T>>;
+using PoolString = std::basic_string<char, std::char_traits<char>, PoolAllocator<char>>;
+
+#endif
@@ -0,0 +1,105 @@
+#include "cdc.hpp"
+
+#include <cstring>
+#include <algorithm>
+
+#include "stats.hpp"
+
+// Cut points need the masked bits of the hash to be zero. The top bits
+// depend on the most bytes, 64 for the top one. Before CDC_AVGLEN the
+// mask has two more bits than log2(CDC_AVGLEN), after it two fewer.
+#define CDC_MASK_SMALL 0xFFFFC00000000000ull
+#define CDC_MASK_LARGE 0xFFFC000000000000ull
+
+struct GearTable
+{
+    uint64_t values[256];
+};
+
+// splitmix64 from a fixed seed. The table decides where chunks are cut,
+// so it must never change.
+constexpr GearTable buildGearTable() {
+    GearTable table = {};
+    uint64_t state = 0x786d7367u;  // "xmsg"
+    for (unsigned i = 0; i < 256; i++) {
+        state += 0x9e3779b97f4a7c15ull;
+        uint64_t z = state;
+        z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ull;
+        z = (z ^ (z >> 27)) * 0x94d049bb133111ebull;
+        table.values[i] = z ^ (z >> 31);
+    }
+    return table;
+}
+
+static constexpr GearTable _gear = buildGearTable();
+
+size_t cdcChunkLength(const uint8_t* data, const size_t length) {
+    if (length <= CDC_MINLEN) return length;
+    const size_t end = std::min(length, (size_t)CDC_MAXLEN);
+    const size_t normal = std::min(end, (size_t)CDC_AVGLEN);
+
+    // Nothing before CDC_MINLEN can be a cut point, so it isn't hashed
+    uint64_t hash = 0;
+    size_t i = CDC_MINLEN;
+    for (; i < normal; i++) {
+        hash = (hash << 1) + _gear.values[data[i]];
+        if ((hash & CDC_MASK_SMALL) == 0) return i + 1;
+    }
+    for (; i < end; i++) {
+        hash = (hash << 1) + _gear.values[data[i]];
+        if ((hash & CDC_MASK_LARGE) == 0) return i + 1;
+    }
+    return end;
+}
+
+// Both keys are derived from the raw key, which is the start of its
+// AES-256 key schedule
+static void deriveKey(const AES_key* key, const char* label, uint8_t* out) {
+    HmacSha256 hmac(key->RoundKey, AES_KEYLEN);
+    hmac.update(label, strlen(label));
+    hmac.final(out);
+}
+
+ChunkCipher::ChunkCipher(const AES_key* key) {
+    StatsTimer timer(STATS_KEYEXPANSION);
+    SecureVector<uint8_t> derived(SHA256_DIGESTLEN);
+    deriveKey(key, "xmsg chunk id key", derived.data());
+    this->keys = makeSecure<Keys>(derived.data());
+    deriveKey(key, "xmsg chunk encryption key", derived.data());
+    AES_init_key(&this->keys->data, derived.data());
+}
+
+void ChunkCipher::chunkId(const uint8_t* data, const size_t length, uint8_t* id) const {
+    StatsTimer timer(STATS_MAC, length);
+    HmacSha256 hmac(this->keys->id);
+    hmac.update(data, length);
+    uint8_t tag[SHA256_DIGESTLEN];
+    hmac.final(tag);
+    memcpy(id, tag, CDC_IDLEN);
+}
+
+void ChunkCipher::seal(const uint8_t* id, const uint8_t* data, const size_t length, uint8_t* out) const {
+    size_t sealed = cdcSealedLength(length);
+    memcpy(out, data, length);
+    memset(out + length, 0, sealed - length);
+    StatsTimer timer(STATS_AES, sealed);
+    uint8_t iv[AES_BLOCKLEN];
+    memcpy(iv, id, AES_BLOCKLEN);
+    AES_CBC_encrypt_stream(&this->keys->data, iv, out, (uint32_t)sealed);
+}
+
+bool ChunkCipher::open(const uint8_t* id, uint8_t* data, const size_t length) const {
+    size_t sealed = cdcSealedLength(length);
+    {
+        StatsTimer timer(STATS_AES, sealed);
+        uint8_t iv[AES_BLOCKLEN];
+        memcpy(iv, id, AES_BLOCKLEN);
+        AES_CBC_decrypt_stream(&this->keys->data, iv, data, (uint32_t)sealed);
+    }
+    for (size_t i = length; i < sealed; i++) {
+        if (data[i] != 0) return false;
+    }
+    uint8_t expected[CDC_IDLEN];
+    this->chunkId(data, length, expected);
+    return tagsEqual(expected, id, CDC_IDLEN);
+}
@@ -0,0 +1,86 @@
+#ifndef _CDC_HPP_
+#define _CDC_HPP_
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+
+#include "aes.h"
+#include "secmem.hpp"
+#include "sha256.hpp"
+
+/*
+    Content-defined chunking and deterministic chunk encryption.
+
+    Chunk boundaries are picked by a rolling (gear) hash of the last bytes
+    seen, so an edit only moves the boundaries next to it and the chunks
+    before and after it stay the same. Chunks are between CDC_MINLEN and
+    CDC_MAXLEN bytes, CDC_AVGLEN on average (normalized chunking: cuts are
+    harder to find before CDC_AVGLEN and easier after it).
+
+    A chunk's id is a keyed hash of its plaintext (the start of an
+    HMAC-SHA256 under a key derived from the xmsg key), and the chunk is
+    AES-256-CBC encrypted with its id as the IV, under another derived key.
+    The same chunk always encrypts to the same ciphertext, so chunks that
+    are already stored don't have to be encrypted again. Decryption checks
+    that the plaintext hashes to the id again, which authenticates it.
+    What this gives away is which chunks are equal, and their sizes.
+*/
+
+#define CDC_MINLEN (16 << 10)
+#define CDC_AVGLEN (64 << 10)
+#define CDC_MAXLEN (256 << 10)
+#define CDC_IDLEN AES_BLOCKLEN
+
+// Returns the length of the chunk at the start of 'data'. Unless 'data'
+// is all that's left of the input, it must hold at least CDC_MAXLEN bytes.
+size_t cdcChunkLength(const uint8_t* data, const size_t length);
+
+// Length of a chunk's ciphertext, padded with zeros to the block size
+inline size_t cdcSealedLength(const size_t length) {
+    return (length + AES_BLOCKLEN - 1) / AES_BLOCKLEN * AES_BLOCKLEN;
+}
+
+// Chunks by id, for hash tables
+struct ChunkKey
+{
+    uint8_t id[CDC_IDLEN];
+
+    ChunkKey(const uint8_t* id) { memcpy(this->id, id, CDC_IDLEN); }
+    bool operator==(const ChunkKey& other) const { return memcmp(this->id, other.id, CDC_IDLEN) == 0; }
+};
+
+// Ids are keyed hashes already
+struct ChunkKeyHash
+{
+    size_t operator()(const ChunkKey& key) const {
+        size_t hash;
+        memcpy(&hash, key.id, sizeof(hash));
+        return hash;
+    }
+};
+
+class ChunkCipher
+{
+private:
+    struct Keys {
+        AES_key data;
+        HmacSha256 id;  // State after absorbing the id key
+        Keys(const uint8_t* idKey) : id(idKey, SHA256_DIGESTLEN) {}
+    };
+    SecurePtr<Keys> keys;
+public:
+    // Derives the chunk keys from 'key'. The keys are only read afterwards,
+    // so threads share one cipher.
+    ChunkCipher(const AES_key* key);
+
+    void chunkId(const uint8_t* data, const size_t length, uint8_t* id) const;
+    // Encrypts 'length' bytes of 'data' with 'id' as the IV into 'out',
+    // which has room for cdcSealedLength(length) bytes
+    void seal(const uint8_t* id, const uint8_t* data, const size_t length, uint8_t* out) const;
+    // Decrypts cdcSealedLength(length) bytes in place. Returns false if
+    // they aren't the chunk 'id' of 'length' bytes.
+    bool open(const uint8_t* id, uint8_t* data, const size_t length) const;
+};
+
+#endif
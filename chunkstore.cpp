@@ -0,0 +1,342 @@
+#include "chunkstore.hpp"
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cerrno>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#ifdef __linux__
+#include <fcntl.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#include "io.hpp"
+#include "stats.hpp"
+
+// Input is read, and new chunks are written, this many bytes at a time
+#define STORE_BLOCKLEN (1 << 20)
+// Smaller stores aren't worth compacting
+#define STORE_COMPACTMIN (1 << 20)
+
+#ifdef __linux__
+
+struct StoredChunk
+{
+    uint64_t offset;
+    bool live;  // Referenced by the new manifest
+};
+
+typedef std::unordered_map<ChunkKey, StoredChunk, ChunkKeyHash> ChunkIndex;
+
+static void damaged(const char* path) {
+    fprintf(stderr, "\"%s\" is damaged.\n", path);
+    exit(1);
+}
+
+static void syncFile(const int fd) {
+    StatsTimer timer(STATS_WRITE);
+    if (fdatasync(fd) == -1) {
+        perror("fdatasync");
+        exit(1);
+    }
+}
+
+// Opens and locks the store. A compaction may replace the file while we
+// wait for the lock, then the new one is opened.
+static int openStore(const char* path, const int flags, const int lock) {
+    while (true) {
+        int fd = open(path, flags | O_CLOEXEC, 0600);
+        if (fd == -1) {
+            if (errno == ENOENT) {
+                fprintf(stderr, "Could not open \"%s\"... Does it exist?\n", path);
+            } else {
+                perror(path);
+            }
+            exit(1);
+        }
+        while (flock(fd, lock) == -1) {
+            if (errno == EINTR) continue;
+            perror("flock");
+            exit(1);
+        }
+        struct stat opened, current;
+        if (fstat(fd, &opened) == 0 && stat(path, &current) == 0 &&
+            opened.st_dev == current.st_dev && opened.st_ino == current.st_ino) {
+            return fd;
+        }
+        close(fd);
+    }
+}
+
+static void readHeader(const int fd, const char* path, const AES_key* key, StoreHeader& header) {
+    if (!readAt(fd, &header, sizeof(header), 0) || memcmp(header.magic, STORE_MAGIC, 8) != 0) {
+        fprintf(stderr, "\"%s\" isn't an xmsg chunk store.\n", path);
+        exit(1);
+    }
+    if (header.version != STORE_VERSION) {
+        fprintf(stderr, "\"%s\" was written by a newer version of xmsg.\n", path);
+        exit(1);
+    }
+    uint8_t keyId[MESSAGE_KEYIDLEN];
+    getKeyId(key, keyId);
+    if (memcmp(header.keyId, keyId, MESSAGE_KEYIDLEN) != 0) {
+        fprintf(stderr, "\"%s\" was written with a different key.\n", path);
+        exit(1);
+    }
+}
+
+// Reads the current manifest. Every chunk must be before it.
+static void readManifest(const int fd, const char* path, const StoreHeader& header, const ChunkCipher& cipher,
+    ManifestHeader& manifest, std::vector<ManifestEntry>& entries)
+{
+    manifest.length = 0;
+    manifest.chunkCount = 0;
+    entries.clear();
+    if (header.manifestOffset == 0) return;
+
+    std::vector<uint8_t> data(cdcSealedLength(header.manifestLength));
+    if (header.manifestLength < sizeof(ManifestHeader) ||
+        !readAt(fd, data.data(), data.size(), header.manifestOffset) ||
+        !cipher.open(header.manifestId, data.data(), header.manifestLength)) {
+        damaged(path);
+    }
+    memcpy(&manifest, data.data(), sizeof(manifest));
+    if (manifest.chunkCount != (header.manifestLength - sizeof(manifest)) / sizeof(ManifestEntry) ||
+        header.manifestLength != sizeof(manifest) + manifest.chunkCount * sizeof(ManifestEntry)) {
+        damaged(path);
+    }
+    entries.resize(manifest.chunkCount);
+    memcpy(entries.data(), data.data() + sizeof(manifest), manifest.chunkCount * sizeof(ManifestEntry));
+
+    uint64_t length = 0;
+    for (const ManifestEntry& entry : entries) {
+        if (entry.offset < sizeof(StoreHeader) || entry.length == 0 || entry.length > CDC_MAXLEN ||
+            entry.offset + cdcSealedLength(entry.length) > header.manifestOffset) {
+            damaged(path);
+        }
+        length += entry.length;
+    }
+    if (length != manifest.length) damaged(path);
+}
+
+// Seals the manifest for 'entries' and points 'header' at it, to be
+// written at 'offset'. Returns the sealed manifest.
+static std::vector<uint8_t> sealManifest(const ChunkCipher& cipher, const std::vector<ManifestEntry>& entries,
+    const uint64_t length, const uint64_t offset, StoreHeader& header)
+{
+    ManifestHeader manifest;
+    manifest.length = length;
+    manifest.chunkCount = entries.size();
+    size_t plain = sizeof(manifest) + entries.size() * sizeof(ManifestEntry);
+    std::vector<uint8_t> data(plain);
+    memcpy(data.data(), &manifest, sizeof(manifest));
+    memcpy(data.data() + sizeof(manifest), entries.data(), entries.size() * sizeof(ManifestEntry));
+
+    std::vector<uint8_t> sealed(cdcSealedLength(plain));
+    cipher.chunkId(data.data(), plain, header.manifestId);
+    cipher.seal(header.manifestId, data.data(), plain, sealed.data());
+    header.manifestOffset = offset;
+    header.manifestLength = (uint32_t)plain;
+    return sealed;
+}
+
+// Copies the live chunks into a new store that replaces the one at 'path'.
+// 'entries' are updated with the new offsets.
+static void compactStore(const int fd, const char* path, const ChunkCipher& cipher, StoreHeader header,
+    std::vector<ManifestEntry>& entries, const uint64_t length)
+{
+    std::string tmpPath = std::string(path) + ".tmp." + std::to_string(getpid());
+    int out = open(tmpPath.c_str(), O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0600);
+    if (out == -1) {
+        fprintf(stderr, "Could not open %s for writing...\n", tmpPath.c_str());
+        exit(1);
+    }
+
+    std::unordered_map<ChunkKey, uint64_t, ChunkKeyHash> moved;
+    PoolString pending;
+    uint64_t end = sizeof(StoreHeader);
+    uint64_t pendingOffset = end;
+    for (ManifestEntry& entry : entries) {
+        auto it = moved.find(ChunkKey(entry.id));
+        if (it != moved.end()) {
+            entry.offset = it->second;
+            continue;
+        }
+        size_t sealed = cdcSealedLength(entry.length);
+        size_t at = pending.size();
+        pending.resize(at + sealed);
+        if (!readAt(fd, &pending[at], sealed, entry.offset)) damaged(path);
+        moved[ChunkKey(entry.id)] = end;
+        entry.offset = end;
+        end += sealed;
+        if (pending.size() >= STORE_BLOCKLEN) {
+            writeAt(out, pending.data(), pending.size(), pendingOffset);
+            pendingOffset = end;
+            pending.clear();
+        }
+    }
+    writeAt(out, pending.data(), pending.size(), pendingOffset);
+
+    std::vector<uint8_t> manifest = sealManifest(cipher, entries, length, end, header);
+    writeAt(out, manifest.data(), manifest.size(), end);
+    writeAt(out, &header, sizeof(header), 0);
+    if (fsync(out) == -1) {
+        perror("fsync");
+        close(out);
+        unlink(tmpPath.c_str());
+        exit(1);
+    }
+    close(out);
+    // Still holding the lock on the old store, so nobody else is using it
+    if (std::rename(tmpPath.c_str(), path) != 0) {
+        perror("rename");
+        unlink(tmpPath.c_str());
+        exit(1);
+    }
+    syncDirectory(path);
+}
+
+StoreSummary updateStore(const char* path, const AES_key* key, const int in) {
+    StoreSummary summary = {};
+    ChunkCipher cipher(key);
+    int fd = openStore(path, O_RDWR | O_CREAT, LOCK_EX);
+
+    StoreHeader header;
+    struct stat st;
+    if (fstat(fd, &st) == 0 && st.st_size == 0) {
+        memset(&header, 0, sizeof(header));
+        memcpy(header.magic, STORE_MAGIC, 8);
+        header.version = STORE_VERSION;
+        getKeyId(key, header.keyId);
+        writeAt(fd, &header, sizeof(header), 0);
+    } else {
+        readHeader(fd, path, key, header);
+    }
+
+    // What the store has now
+    ManifestHeader previous;
+    std::vector<ManifestEntry> entries;
+    readManifest(fd, path, header, cipher, previous, entries);
+    ChunkIndex stored;
+    for (const ManifestEntry& entry : entries) {
+        stored[ChunkKey(entry.id)] = { entry.offset, false };
+    }
+    entries.clear();
+
+    // New chunks go after the current manifest. Anything already there
+    // is left over from an update that didn't finish.
+    uint64_t end = (header.manifestOffset == 0) ? sizeof(StoreHeader) :
+        header.manifestOffset + cdcSealedLength(header.manifestLength);
+    uint64_t pendingOffset = end;
+    uint64_t live = sizeof(StoreHeader);
+    PoolString input, pending;
+    size_t start = 0;
+    bool eof = false;
+    while (true) {
+        // Chunk boundaries need CDC_MAXLEN bytes to look at, unless the input ends first
+        while (!eof && input.size() - start < CDC_MAXLEN) {
+            input.erase(0, start);
+            start = 0;
+            size_t offset = input.size();
+            input.resize(offset + STORE_BLOCKLEN);
+            size_t n = readSome(in, &input[offset], STORE_BLOCKLEN);
+            input.resize(offset + n);
+            eof = (n == 0);
+        }
+        if (input.size() == start) break;
+
+        const uint8_t* data = (const uint8_t*)input.data() + start;
+        ManifestEntry entry = {};
+        entry.length = (uint32_t)cdcChunkLength(data, input.size() - start);
+        cipher.chunkId(data, entry.length, entry.id);
+        StoredChunk& chunk = stored.emplace(ChunkKey(entry.id), StoredChunk{ 0, false }).first->second;
+        if (chunk.offset == 0) {
+            size_t sealed = cdcSealedLength(entry.length);
+            size_t at = pending.size();
+            pending.resize(at + sealed);
+            cipher.seal(entry.id, data, entry.length, (uint8_t*)&pending[at]);
+            chunk.offset = end;
+            end += sealed;
+            summary.newChunks++;
+            summary.newBytes += entry.length;
+            if (pending.size() >= STORE_BLOCKLEN) {
+                writeAt(fd, pending.data(), pending.size(), pendingOffset);
+                pendingOffset = end;
+                pending.clear();
+            }
+        }
+        if (!chunk.live) {
+            chunk.live = true;
+            live += cdcSealedLength(entry.length);
+        }
+        entry.offset = chunk.offset;
+        entries.push_back(entry);
+        summary.length += entry.length;
+        start += entry.length;
+    }
+    summary.chunks = entries.size();
+
+    // The header only points at the new manifest once everything before it is on disk
+    std::vector<uint8_t> manifest = sealManifest(cipher, entries, summary.length, end, header);
+    pending.append((const char*)manifest.data(), manifest.size());
+    writeAt(fd, pending.data(), pending.size(), pendingOffset);
+    end += manifest.size();
+    live += manifest.size();
+    syncFile(fd);
+    writeAt(fd, &header, sizeof(header), 0);
+    syncFile(fd);
+    if (fstat(fd, &st) == 0 && (uint64_t)st.st_size > end && ftruncate(fd, (off_t)end) == -1) {
+        perror("ftruncate");
+        exit(1);
+    }
+
+    if (end > STORE_COMPACTMIN && end > 2 * live) {
+        compactStore(fd, path, cipher, header, entries, summary.length);
+        summary.compacted = true;
+    }
+    close(fd);
+    return summary;
+}
+
+void extractStore(const char* path, const AES_key* key, const int out) {
+    ChunkCipher cipher(key);
+    int fd = openStore(path, O_RDONLY, LOCK_SH);
+    StoreHeader header;
+    readHeader(fd, path, key, header);
+    ManifestHeader manifest;
+    std::vector<ManifestEntry> entries;
+    readManifest(fd, path, header, cipher, manifest, entries);
+
+    PoolString data;
+    for (const ManifestEntry& entry : entries) {
+        size_t at = data.size();
+        data.resize(at + cdcSealedLength(entry.length));
+        if (!readAt(fd, &data[at], data.size() - at, entry.offset) ||
+            !cipher.open(entry.id, (uint8_t*)&data[at], entry.length)) {
+            damaged(path);
+        }
+        data.resize(at + entry.length);
+        if (data.size() >= STORE_BLOCKLEN) writeOutput(out, data);
+    }
+    writeOutput(out, data);
+    close(fd);
+}
+
+#else
+
+StoreSummary updateStore(const char* path, const AES_key* key, const int in) {
+    fprintf(stderr, "--incremental is only supported on Linux.\n");
+    exit(1);
+}
+
+void extractStore(const char* path, const AES_key* key, const int out) {
+    fprintf(stderr, "--incremental is only supported on Linux.\n");
+    exit(1);
+}
+
+#endif
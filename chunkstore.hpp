@@ -0,0 +1,83 @@
+#ifndef _CHUNKSTORE_HPP_
+#define _CHUNKSTORE_HPP_
+
+#include <cstddef>
+#include <cstdint>
+
+#include "aes.h"
+#include "cdc.hpp"
+#include "message.hpp"
+
+/*
+    Incremental encryption of a file into a chunk store (--incremental).
+
+    Store layout (all integers are stored in host byte order):
+
+    [StoreHeader]    fixed size, starts with STORE_MAGIC. Says where the
+                     current manifest is.
+    [chunk]...       sealed chunks (see cdc.hpp), in the order they were
+                     added
+    [manifest]       sealed like a chunk: a ManifestHeader, then one
+                     ManifestEntry per chunk of the file, in order
+
+    An update chunks the new plaintext and only seals and appends the
+    chunks the store doesn't have yet, followed by a new manifest. Once
+    those are on disk, the header is rewritten to point at the manifest.
+    Until then the previous manifest is the current one, so an update that
+    doesn't finish leaves the previous version of the file.
+
+    Chunks no longer referenced by the manifest stay in the store until
+    they take up more than half of it. Then the live chunks are copied,
+    as they are, into a new store that replaces the old one.
+
+    Writers hold an exclusive flock on the store, readers a shared one.
+*/
+
+#define STORE_MAGIC "XMSGCHNK"
+#define STORE_VERSION 1
+
+struct StoreHeader
+{
+    char magic[8];
+    uint32_t version;
+    uint32_t manifestLength;  // Without the padding
+    uint8_t keyId[MESSAGE_KEYIDLEN];
+    uint64_t manifestOffset;  // 0 until the first update is done
+    uint8_t manifestId[CDC_IDLEN];
+    uint8_t reserved[16];
+};
+
+struct ManifestHeader
+{
+    uint64_t length;  // Of the file
+    uint64_t chunkCount;
+};
+
+struct ManifestEntry
+{
+    uint8_t id[CDC_IDLEN];
+    uint64_t offset;
+    uint32_t length;  // Without the padding
+    uint32_t reserved;
+};
+
+static_assert(sizeof(StoreHeader) == 64, "StoreHeader must be 64 bytes");
+static_assert(sizeof(ManifestEntry) == 32, "ManifestEntry must be 32 bytes");
+
+struct StoreSummary
+{
+    uint64_t length;
+    uint64_t chunks;
+    // Chunks that weren't in the store, and had to be encrypted and written
+    uint64_t newChunks;
+    uint64_t newBytes;
+    bool compacted;
+};
+
+// Encrypts everything read from 'in' into the store at 'path', which is
+// created if it doesn't exist yet
+StoreSummary updateStore(const char* path, const AES_key* key, const int in);
+// Decrypts the current version of the file in the store to 'out'
+void extractStore(const char* path, const AES_key* key, const int out);
+
+#endif
@@ -0,0 +1,281 @@
+#include "compress.hpp"
+
+#include <cstring>
+
+#define MINMATCH 4
+// The LZ4 block format requires the last 5 bytes to be literals, and the
+// last match to start at least 12 bytes before the end.
+#define LASTLITERALS 5
+#define MFLIMIT 12
+#define HASHLOG 13
+
+static inline uint32_t read32(const uint8_t* p) {
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static inline uint64_t read64(const uint8_t* p) {
+    uint64_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static inline uint32_t hash32(const uint32_t v) {
+    return (v * 2654435761u) >> (32 - HASHLOG);
+}
+
+static inline void write32le(uint8_t* p, const uint32_t v) {
+    p[0] = (uint8_t)v;
+    p[1] = (uint8_t)(v >> 8);
+    p[2] = (uint8_t)(v >> 16);
+    p[3] = (uint8_t)(v >> 24);
+}
+
+static inline uint32_t read32le(const uint8_t* p) {
+    return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+// Index of the first differing byte in a non-zero XOR of two words
+static inline unsigned firstDifference(uint64_t diff) {
+#if defined(__GNUC__) && defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+    return __builtin_ctzll(diff) >> 3;
+#else
+    uint8_t bytes[8];
+    memcpy(bytes, &diff, sizeof(bytes));
+    unsigned i = 0;
+    while (bytes[i] == 0) i++;
+    return i;
+#endif
+}
+
+// Length of the common prefix of 'a' and 'b', up to 'limit'
+static inline size_t matchLength(const uint8_t* a, const uint8_t* b, const uint8_t* limit) {
+    const uint8_t* start = a;
+    while (a + 8 <= limit) {
+        uint64_t diff = read64(a) ^ read64(b);
+        if (diff != 0) {
+            return a - start + firstDifference(diff);
+        }
+        a += 8;
+        b += 8;
+    }
+    while (a < limit && *a == *b) {
+        a++;
+        b++;
+    }
+    return a - start;
+}
+
+// Writes a length that didn't fit in a token nibble
+static inline uint8_t* writeLength(uint8_t* op, size_t length) {
+    while (length >= 255) {
+        *op++ = 255;
+        length -= 255;
+    }
+    *op++ = (uint8_t)length;
+    return op;
+}
+
+// Compresses one block. Returns 0 if the result wouldn't be smaller than
+// 'limit' bytes.
+static size_t compressBlock(const uint8_t* in, const size_t length, uint8_t* out, const size_t limit) {
+    const uint8_t* ip = in;
+    const uint8_t* anchor = in;
+    const uint8_t* const end = in + length;
+    const uint8_t* const matchLimit = end - LASTLITERALS;
+    const uint8_t* const mfLimit = end - MFLIMIT;
+    uint8_t* op = out;
+    uint8_t* const opLimit = out + limit;
+    // Block positions fit in 16 bits
+    uint16_t table[1 << HASHLOG];
+    memset(table, 0, sizeof(table));
+
+    if (length >= MFLIMIT + 1) {
+        ip++;
+        while (ip < mfLimit) {
+            // Find a match, skipping ahead faster the longer we don't
+            const uint8_t* ref;
+            unsigned misses = 0;
+            while (true) {
+                uint32_t h = hash32(read32(ip));
+                ref = in + table[h];
+                table[h] = (uint16_t)(ip - in);
+                if (ref < ip && read32(ref) == read32(ip)) break;
+                ip += 1 + (misses++ >> 5);
+                if (ip >= mfLimit) goto lastLiterals;
+            }
+
+            // Extend it backwards
+            while (ip > anchor && ref > in && ip[-1] == ref[-1]) {
+                ip--;
+                ref--;
+            }
+
+            size_t literals = ip - anchor;
+            size_t match = MINMATCH + matchLength(ip + MINMATCH, ref + MINMATCH, matchLimit);
+            // Token, literals, offset and both length extensions
+            if (op + 1 + literals + literals / 255 + 2 + match / 255 + 2 > opLimit) return 0;
+
+            uint8_t* token = op++;
+            *token = (uint8_t)(((literals >= 15) ? 15 : literals) << 4);
+            if (literals >= 15) op = writeLength(op, literals - 15);
+            memcpy(op, anchor, literals);
+            op += literals;
+
+            uint16_t offset = (uint16_t)(ip - ref);
+            *op++ = (uint8_t)offset;
+            *op++ = (uint8_t)(offset >> 8);
+
+            size_t ml = match - MINMATCH;
+            *token |= (uint8_t)((ml >= 15) ? 15 : ml);
+            if (ml >= 15) op = writeLength(op, ml - 15);
+
+            ip += match;
+            anchor = ip;
+            if (ip < mfLimit) {
+                table[hash32(read32(ip - 2))] = (uint16_t)(ip - 2 - in);
+            }
+        }
+    }
+
+lastLiterals:
+    size_t literals = end - anchor;
+    if (op + 1 + literals + literals / 255 + 1 > opLimit) return 0;
+    *op++ = (uint8_t)(((literals >= 15) ? 15 : literals) << 4);
+    if (literals >= 15) op = writeLength(op, literals - 15);
+    memcpy(op, anchor, literals);
+    op += literals;
+    return op - out;
+}
+
+// Decompresses one block into 'out'. Returns the size, or -1 if the
+// block is corrupt or decompresses to more than 'capacity' bytes.
+static long decompressBlock(const uint8_t* in, const size_t length, uint8_t* out, const size_t capacity) {
+    const uint8_t* ip = in;
+    const uint8_t* const end = in + length;
+    uint8_t* op = out;
+    uint8_t* const opEnd = out + capacity;
+
+    while (ip < end) {
+        unsigned token = *ip++;
+
+        size_t literals = token >> 4;
+        if (literals == 15) {
+            uint8_t b;
+            do {
+                if (ip >= end) return -1;
+                b = *ip++;
+                literals += b;
+            } while (b == 255);
+        }
+        if (literals > (size_t)(end - ip) || literals > (size_t)(opEnd - op)) return -1;
+        memcpy(op, ip, literals);
+        ip += literals;
+        op += literals;
+
+        // The last sequence has no match
+        if (ip == end) break;
+
+        if (end - ip < 2) return -1;
+        size_t offset = ip[0] | (ip[1] << 8);
+        ip += 2;
+        if (offset == 0 || offset > (size_t)(op - out)) return -1;
+
+        size_t match = token & 15;
+        if (match == 15) {
+            uint8_t b;
+            do {
+                if (ip >= end) return -1;
+                b = *ip++;
+                match += b;
+            } while (b == 255);
+        }
+        match += MINMATCH;
+        if (match > (size_t)(opEnd - op)) return -1;
+
+        const uint8_t* ref = op - offset;
+        if (offset >= match) {
+            memcpy(op, ref, match);
+            op += match;
+        } else {
+            // Overlapping copy repeats the last 'offset' bytes
+            for (size_t i = 0; i < match; i++) {
+                *op++ = *ref++;
+            }
+        }
+    }
+    return (long)(op - out);
+}
+
+size_t compressBound(const size_t length) {
+    return length + (length + COMPRESS_BLOCKLEN - 1) / COMPRESS_BLOCKLEN * 4;
+}
+
+size_t compress(const uint8_t* in, const size_t length, uint8_t* out) {
+    uint8_t* op = out;
+    for (size_t offset = 0; offset < length; offset += COMPRESS_BLOCKLEN) {
+        size_t n = (length - offset < COMPRESS_BLOCKLEN) ? length - offset : COMPRESS_BLOCKLEN;
+        size_t packed = compressBlock(in + offset, n, op + 4, n - 1);
+        if (packed == 0) {
+            // Store blocks that don't compress
+            write32le(op, (uint32_t)n | COMPRESS_STORED);
+            memcpy(op + 4, in + offset, n);
+            packed = n;
+        } else {
+            write32le(op, (uint32_t)packed);
+        }
+        op += 4 + packed;
+    }
+    return op - out;
+}
+
+Decompressor::Decompressor() :
+    buffered(0),
+    blockSize(0)
+{
+}
+
+void Decompressor::reset() {
+    SecureMemory::zero(this->block.data(), this->block.size());
+    SecureMemory::zero(this->output.data(), this->output.size());
+    this->buffered = 0;
+    this->blockSize = 0;
+}
+
+bool Decompressor::feed(const uint8_t* in, size_t length, PoolString& out) {
+    if (this->block.empty()) {
+        // Only allocated once there's compressed input
+        this->block.resize(4 + COMPRESS_BLOCKLEN);
+        this->output.resize(COMPRESS_BLOCKLEN);
+    }
+
+    while (length > 0) {
+        size_t wanted = (this->blockSize == 0) ? 4 : this->blockSize;
+        size_t n = (length < wanted - this->buffered) ? length : wanted - this->buffered;
+        memcpy(this->block.data() + this->buffered, in, n);
+        this->buffered += n;
+        in += n;
+        length -= n;
+        if (this->buffered < wanted) break;
+
+        uint32_t size = read32le(this->block.data());
+        uint32_t packed = size & ~COMPRESS_STORED;
+        if (this->blockSize == 0) {
+            if (packed == 0 || packed > COMPRESS_BLOCKLEN) return false;
+            this->blockSize = 4 + packed;
+            continue;
+        }
+
+        if (size & COMPRESS_STORED) {
+            out.append((const char*)this->block.data() + 4, packed);
+        } else {
+            long produced = decompressBlock(this->block.data() + 4, packed, this->output.data(), COMPRESS_BLOCKLEN);
+            if (produced < 0) return false;
+            out.append((const char*)this->output.data(), produced);
+        }
+        this->buffered = 0;
+        this->blockSize = 0;
+    }
+    return true;
+}
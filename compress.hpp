@@ -0,0 +1,46 @@
+#ifndef _COMPRESS_HPP_
+#define _COMPRESS_HPP_
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+#include "bufpool.hpp"
+#include "secmem.hpp"
+
+/*
+    LZ77 compression for message payloads, using the LZ4 block format.
+
+    Input is split into independent blocks of up to COMPRESS_BLOCKLEN bytes.
+    Each block is preceded by a 32 bit little endian size, with
+    COMPRESS_STORED set if the block didn't compress and is stored as is.
+*/
+
+#define COMPRESS_BLOCKLEN (64 * 1024)
+#define COMPRESS_STORED 0x80000000u
+
+// Largest possible output of compress() for 'length' bytes of input
+size_t compressBound(const size_t length);
+// Compresses 'length' bytes into 'out', which must have room for
+// compressBound(length) bytes. Returns the compressed size.
+size_t compress(const uint8_t* in, const size_t length, uint8_t* out);
+
+// Decompresses a stream of blocks that arrives in arbitrary pieces. Holds
+// at most one block of input and output, in secure memory.
+class Decompressor
+{
+private:
+    SecureVector<uint8_t> block;
+    SecureVector<uint8_t> output;
+    size_t buffered;
+    size_t blockSize;  // Including the size field, 0 until it's known
+public:
+    Decompressor();
+    // Appends the decompressed data to 'out'. Returns false if the input is corrupt.
+    bool feed(const uint8_t* in, size_t length, PoolString& out);
+    // True if the input ended on a block boundary
+    bool complete() const { return this->buffered == 0; }
+    void reset();
+};
+
+#endif
@@ -6,11 +6,25 @@ CONFIG = $$HOME/.config/xmsg/xmsgkey.txt
 
 # includes and libs
 INCS = -I. -I/usr/include
-LIBS = -L/usr/lib
+LIBS = -L/usr/lib -lpthread
+
+# static linking, which saves the dynamic loader's work on every start
+#STATIC = -static
+
+# tracing (--trace), compiled out unless enabled
+#TRACEFLAGS = -DXMSG_TRACE
+
+# malloc() counting for --memory. Static glibc's malloc can't be replaced.
+MEMFLAGS = $(if ${STATIC},,-DXMSG_MALLOC_HOOKS)
+
+# link-time and profile-guided optimization, used by "make lto" and "make pgo"
+LTOFLAGS = -flto=auto
+PGOGENFLAGS = -fprofile-generate -fprofile-update=prefer-atomic
+PGOUSEFLAGS = -fprofile-use -fprofile-partial-training -Wno-missing-profile
 
 # flags
-CFLAGS = -std=c++14 -Wall -O3 ${INCS} -DKEYFILE_PATH=\"${CONFIG}\"
-LDFLAGS = -s ${LIBS}
+CFLAGS = -std=c++14 -Wall -O3 ${INCS} ${TRACEFLAGS} ${MEMFLAGS} ${OPTFLAGS} -DKEYFILE_PATH=\"${CONFIG}\"
+LDFLAGS = -s ${STATIC} ${OPTFLAGS} ${LIBS}
 
 # compiler and linker
 CC = c++
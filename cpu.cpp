@@ -0,0 +1,42 @@
+#include "cpu.hpp"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define CPU_X86
+#include <cpuid.h>
+#endif
+
+#ifdef CPU_X86
+// The register state the OS saves on context switches (XCR0)
+static unsigned long long xgetbv() {
+    unsigned eax, edx;
+    __asm__ volatile ("xgetbv" : "=a"(eax), "=d"(edx) : "c"(0));
+    return ((unsigned long long)edx << 32) | eax;
+}
+#endif
+
+static CpuFeatures detect() {
+    CpuFeatures features = {};
+#ifdef CPU_X86
+    unsigned eax, ebx, ecx, edx;
+    if (__get_cpuid(1, &eax, &ebx, &ecx, &edx)) {
+        features.ssse3 = (ecx & bit_SSSE3) != 0;
+        features.sse41 = (ecx & bit_SSE4_1) != 0;
+        features.aes = (ecx & bit_AES) != 0;
+        // SSE, AVX, opmask and both halves of the ZMM registers
+        features.avx512 = (ecx & bit_OSXSAVE) != 0 && (xgetbv() & 0xe6) == 0xe6;
+    }
+    if (__get_cpuid_count(7, 0, &eax, &ebx, &ecx, &edx)) {
+        features.sha = (ebx & (1u << 29)) != 0;
+        features.avx512 = features.avx512 && (ebx & bit_AVX512F) != 0;
+        features.vaes = features.avx512 && (ecx & bit_VAES) != 0;
+    } else {
+        features.avx512 = false;
+    }
+#endif
+    return features;
+}
+
+const CpuFeatures& cpuFeatures() {
+    static const CpuFeatures features = detect();
+    return features;
+}
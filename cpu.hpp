@@ -0,0 +1,22 @@
+#ifndef _CPU_HPP_
+#define _CPU_HPP_
+
+/*
+    Runtime CPU feature detection, used to pick accelerated code paths.
+    All features are false on CPUs and compilers we have no code for.
+*/
+
+struct CpuFeatures
+{
+    bool ssse3;
+    bool sse41;
+    bool sha;  // SHA-NI
+    bool aes;  // AES-NI
+    bool avx512;  // AVX-512F, with the OS saving the 512-bit registers
+    bool vaes;  // AES instructions on 512-bit vectors (needs avx512)
+};
+
+// Detected once, on first use
+const CpuFeatures& cpuFeatures();
+
+#endif
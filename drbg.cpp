@@ -0,0 +1,164 @@
+#include "drbg.hpp"
+
+#include <cstring>
+#include <cstdio>
+#include <cstdlib>
+#include <atomic>
+
+#include "secmem.hpp"
+
+#ifdef __linux__
+#include <cerrno>
+#include <pthread.h>
+#include <sys/random.h>
+#elif defined(_WIN32)
+#include <windows.h>
+#include <bcrypt.h>
+#endif
+
+// Bumped in the child after every fork(), forcing each thread's
+// generator to reseed before handing out more bytes.
+static std::atomic<unsigned> _forkGeneration(0);
+
+#ifdef __linux__
+static void onFork() {
+    _forkGeneration.fetch_add(1, std::memory_order_relaxed);
+}
+#endif
+
+static void getSystemEntropy(uint8_t* out, size_t count) {
+#ifdef __linux__
+    while (count > 0) {
+        ssize_t n = getrandom(out, count, 0);
+        if (n == -1) {
+            if (errno == EINTR) continue;
+            perror("getrandom");
+            exit(1);
+        }
+        out += n;
+        count -= n;
+    }
+#elif defined(_WIN32)
+    NTSTATUS status = BCryptGenRandom(NULL, out, (ULONG)count, BCRYPT_USE_SYSTEM_PREFERRED_RNG);
+    if (status != 0l) {
+        puts("BCryptGenRandom failed!");
+        printf("GetLastError() = %li\n", GetLastError());
+        exit(1);
+    }
+#endif
+}
+
+#define ROTL32(v, n) (((v) << (n)) | ((v) >> (32 - (n))))
+#define QUARTERROUND(a, b, c, d)                  \
+    a += b; d ^= a; d = ROTL32(d, 16);            \
+    c += d; b ^= c; b = ROTL32(b, 12);            \
+    a += b; d ^= a; d = ROTL32(d, 8);             \
+    c += d; b ^= c; b = ROTL32(b, 7);
+
+// Produces one 64 byte ChaCha20 block from 'in'
+static void chacha20Block(const uint32_t in[16], uint8_t out[64]) {
+    uint32_t x[16];
+    memcpy(x, in, sizeof(x));
+
+    for (int i = 0; i < 10; i++) {
+        // Column rounds
+        QUARTERROUND(x[0], x[4], x[8],  x[12]);
+        QUARTERROUND(x[1], x[5], x[9],  x[13]);
+        QUARTERROUND(x[2], x[6], x[10], x[14]);
+        QUARTERROUND(x[3], x[7], x[11], x[15]);
+        // Diagonal rounds
+        QUARTERROUND(x[0], x[5], x[10], x[15]);
+        QUARTERROUND(x[1], x[6], x[11], x[12]);
+        QUARTERROUND(x[2], x[7], x[8],  x[13]);
+        QUARTERROUND(x[3], x[4], x[9],  x[14]);
+    }
+
+    for (int i = 0; i < 16; i++) {
+        uint32_t v = x[i] + in[i];
+        out[i * 4 + 0] = (uint8_t)(v);
+        out[i * 4 + 1] = (uint8_t)(v >> 8);
+        out[i * 4 + 2] = (uint8_t)(v >> 16);
+        out[i * 4 + 3] = (uint8_t)(v >> 24);
+    }
+}
+
+Drbg::Drbg() :
+    available(0),
+    sinceReseed(0),
+    forkGeneration(0)
+{
+#ifdef __linux__
+    static const int registered = pthread_atfork(NULL, NULL, &onFork);
+    (void)registered;
+#endif
+    this->reseed();
+}
+
+Drbg::~Drbg() {
+    // Don't leave the key or unused output behind in memory
+    SecureMemory::zero(this->state, sizeof(this->state));
+    SecureMemory::zero(this->buffer, sizeof(this->buffer));
+}
+
+Drbg& Drbg::local() {
+    // The generator state is key material, so it lives in secure memory
+    static thread_local SecurePtr<Drbg> drbg = makeSecure<Drbg>();
+    return *drbg;
+}
+
+void Drbg::reseed() {
+    uint8_t seed[DRBG_KEYLEN + 8];
+    getSystemEntropy(seed, sizeof(seed));
+
+    // "expand 32-byte k"
+    this->state[0] = 0x61707865;
+    this->state[1] = 0x3320646e;
+    this->state[2] = 0x79622d32;
+    this->state[3] = 0x6b206574;
+    memcpy(&this->state[4], seed, DRBG_KEYLEN);
+    // Block counter
+    this->state[12] = 0;
+    this->state[13] = 0;
+    // Nonce
+    memcpy(&this->state[14], seed + DRBG_KEYLEN, 8);
+    SecureMemory::zero(seed, sizeof(seed));
+
+    this->forkGeneration = _forkGeneration.load(std::memory_order_relaxed);
+    this->sinceReseed = 0;
+    this->available = 0;
+    memset(this->buffer, 0, sizeof(this->buffer));
+}
+
+void Drbg::refill() {
+    for (size_t i = 0; i < DRBG_BUFLEN; i += 64) {
+        chacha20Block(this->state, this->buffer + i);
+        if (++this->state[12] == 0) this->state[13]++;
+    }
+    // Fast key erasure: the first bytes of the keystream become the new key
+    // and are never handed out.
+    memcpy(&this->state[4], this->buffer, DRBG_KEYLEN);
+    memset(this->buffer, 0, DRBG_KEYLEN);
+    this->available = DRBG_BUFLEN - DRBG_KEYLEN;
+}
+
+void Drbg::generate(uint8_t* out, size_t count) {
+    if (this->forkGeneration != _forkGeneration.load(std::memory_order_relaxed) ||
+        this->sinceReseed >= DRBG_RESEED_INTERVAL) {
+        this->reseed();
+    }
+    this->sinceReseed += count;
+
+    while (count > 0) {
+        if (this->available == 0) {
+            this->refill();
+        }
+        size_t n = (count < this->available) ? count : this->available;
+        uint8_t* src = this->buffer + DRBG_BUFLEN - this->available;
+        memcpy(out, src, n);
+        // Wipe what was handed out
+        memset(src, 0, n);
+        this->available -= n;
+        out += n;
+        count -= n;
+    }
+}
@@ -0,0 +1,47 @@
+#ifndef _DRBG_HPP_
+#define _DRBG_HPP_
+
+#include <cstddef>
+#include <cstdint>
+
+/*
+    Userspace CSPRNG used for IVs, padding and generated keys.
+
+    Each thread owns a ChaCha20 keystream generator that is seeded from the
+    operating system (getrandom / BCryptGenRandom). Output is served from a
+    buffered keystream, and the first block of every refill becomes the next
+    key ("fast key erasure"), so earlier output can't be recovered from the
+    current state.
+
+    The generator reseeds itself after DRBG_RESEED_INTERVAL bytes, and after
+    a fork() so that parent and child never share a stream.
+*/
+
+#define DRBG_KEYLEN 32
+#define DRBG_BUFLEN 1024
+#define DRBG_RESEED_INTERVAL (1u << 20)
+
+class Drbg
+{
+private:
+    uint32_t state[16];
+    uint8_t buffer[DRBG_BUFLEN];
+    size_t available;
+    size_t sinceReseed;
+    unsigned forkGeneration;
+public:
+    Drbg();
+    ~Drbg();
+    Drbg(const Drbg&) = delete;
+    Drbg& operator=(const Drbg&) = delete;
+
+    // Returns the calling thread's generator
+    static Drbg& local();
+
+    void generate(uint8_t* out, size_t count);
+    void reseed();
+private:
+    void refill();
+};
+
+#endif
@@ -0,0 +1,544 @@
+/*
+    End-to-end harness for the xmsg binary. Run with "make e2e".
+
+    Drives a copy of xmsg that was built against a temporary keychain
+    (KEYFILE_PATH is fixed at compile time) through all of its modes, on
+    synthetic corpora: random data, log-like text, many tiny messages and
+    one huge message. Everything is generated locally, nothing touches the
+    network.
+
+    For every scenario it reports wall time, MB/s of input, peak RSS and
+    the number of system calls (counted in a second, ptraced run), and
+    checks that decrypting gives back the original input. Bulk keychain
+    operations on 100k keys also run the way a normal user would run
+    them, without CAP_IPC_LOCK and with an 8 MiB RLIMIT_MEMLOCK, and fail
+    if xmsg can't keep its keys in locked memory. Per-message
+    latency (p50/p99/p999) is measured by running xmsg once per message,
+    so it includes process startup and keychain loading.
+
+    With --baseline, every scenario is also run with a second build of
+    xmsg (best of a few alternating runs each), and the speedup of XMSG
+    over it is reported. "make lto" and "make pgo" use this, and use the
+    harness itself as the training workload for the profile.
+
+    Results are written to stdout as JSON. Linux only.
+
+    Usage: xmsg-e2e XMSG WORKDIR [--huge-size BYTES] [--runs N] [--no-syscalls] [--baseline XMSG]
+*/
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <map>
+#include <string>
+#include <vector>
+
+#include <fcntl.h>
+#include <malloc.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/prctl.h>
+#include <sys/ptrace.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <sys/user.h>
+#include <sys/wait.h>
+#include <linux/capability.h>
+
+#include "drbg.hpp"
+
+// Alternating runs per binary when comparing against a baseline
+#define BASELINE_ROUNDS 3
+// Keys in the bulk keychain scenarios, and the usual RLIMIT_MEMLOCK of a
+// normal user they have to fit in
+#define BULK_KEYS 100000
+#define USER_MEMLOCK (8u << 20)
+
+static const char* _xmsg;
+static const char* _baseline = NULL;
+static std::string _dir;
+static size_t _hugeSize = 64u << 20;
+static unsigned _runs = 1000;
+static bool _countSyscalls = true;
+static bool _first = true;
+static bool _failed = false;
+// Sum of the log speedups over the baseline, for the geometric mean
+static double _logSpeedups = 0;
+static unsigned _speedups = 0;
+
+struct RunResult
+{
+    int status;
+    double seconds;
+    long maxRss;  // KiB
+};
+
+struct SyscallCounts
+{
+    unsigned long total;
+    std::map<std::string, unsigned long> byName;
+};
+
+static std::string path(const std::string& name) {
+    return _dir + "/" + name;
+}
+
+static size_t fileSize(const std::string& file) {
+    FILE* f = fopen(file.c_str(), "rb");
+    if (f == NULL) return 0;
+    fseek(f, 0, SEEK_END);
+    size_t size = ftell(f);
+    fclose(f);
+    return size;
+}
+
+static bool sameContents(const std::string& a, const std::string& b) {
+    FILE* fa = fopen(a.c_str(), "rb");
+    FILE* fb = fopen(b.c_str(), "rb");
+    bool same = fa != NULL && fb != NULL;
+    std::vector<char> ba(1 << 16), bb(1 << 16);
+    while (same) {
+        size_t na = fread(ba.data(), 1, ba.size(), fa);
+        size_t nb = fread(bb.data(), 1, bb.size(), fb);
+        same = na == nb && memcmp(ba.data(), bb.data(), na) == 0;
+        if (na == 0) break;
+    }
+    if (fa) fclose(fa);
+    if (fb) fclose(fb);
+    return same;
+}
+
+static bool fileContains(const std::string& file, const char* text) {
+    FILE* f = fopen(file.c_str(), "rb");
+    if (f == NULL) return false;
+    std::string data;
+    char buf[4096];
+    size_t n;
+    while ((n = fread(buf, 1, sizeof(buf), f)) > 0) data.append(buf, n);
+    fclose(f);
+    return data.find(text) != std::string::npos;
+}
+
+// Builds the argument vector for an xmsg binary
+static std::vector<char*> makeArgv(const char* xmsg, const std::vector<std::string>& args) {
+    std::vector<char*> argv;
+    argv.push_back((char*)xmsg);
+    for (const std::string& arg : args) argv.push_back((char*)arg.c_str());
+    argv.push_back(NULL);
+    return argv;
+}
+
+// In the child: connects stdin/stdout and runs xmsg
+static void execXmsg(const std::vector<char*>& argv, const std::string& in, const std::string& out) {
+    int inFd = open(in.c_str(), O_RDONLY);
+    int outFd = open(out.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0600);
+    int nullFd = open("/dev/null", O_WRONLY);
+    if (inFd == -1 || outFd == -1 || nullFd == -1) _exit(127);
+    dup2(inFd, 0);
+    dup2(outFd, 1);
+    dup2(nullFd, 2);
+    execv(argv[0], argv.data());
+    _exit(127);
+}
+
+static RunResult run(const char* xmsg, const std::vector<std::string>& args, const std::string& in, const std::string& out) {
+    std::vector<char*> argv = makeArgv(xmsg, args);
+    RunResult result;
+    auto start = std::chrono::steady_clock::now();
+    pid_t pid = fork();
+    if (pid == 0) execXmsg(argv, in, out);
+
+    struct rusage usage;
+    wait4(pid, &result.status, 0, &usage);
+    result.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    result.maxRss = usage.ru_maxrss;
+    return result;
+}
+
+static const char* syscallName(const long nr) {
+    switch (nr) {
+    case SYS_read: return "read";
+    case SYS_write: return "write";
+    case SYS_mmap: return "mmap";
+    case SYS_munmap: return "munmap";
+    case SYS_mprotect: return "mprotect";
+    case SYS_brk: return "brk";
+    case SYS_futex: return "futex";
+    case SYS_openat: return "openat";
+    case SYS_close: return "close";
+    case SYS_mlock: return "mlock";
+    case SYS_madvise: return "madvise";
+    case SYS_flock: return "flock";
+    case SYS_getrandom: return "getrandom";
+    default: return "other";
+    }
+}
+
+// Runs xmsg under ptrace and counts the system calls of all its threads
+static SyscallCounts countSyscalls(const std::vector<std::string>& args, const std::string& in, const std::string& out) {
+    SyscallCounts counts = { 0, {} };
+    std::vector<char*> argv = makeArgv(_xmsg, args);
+    pid_t pid = fork();
+    if (pid == 0) {
+        ptrace(PTRACE_TRACEME, 0, NULL, NULL);
+        raise(SIGSTOP);
+        execXmsg(argv, in, out);
+    }
+
+    int status;
+    waitpid(pid, &status, 0);
+    ptrace(PTRACE_SETOPTIONS, pid, NULL, (void*)(PTRACE_O_TRACESYSGOOD | PTRACE_O_TRACECLONE | PTRACE_O_EXITKILL));
+    ptrace(PTRACE_SYSCALL, pid, NULL, NULL);
+
+    // Every system call stops a thread twice, on entry and on exit
+    std::map<pid_t, bool> inSyscall;
+    while (true) {
+        pid_t tid = waitpid(-1, &status, __WALL);
+        if (tid == -1) break;
+        if (WIFEXITED(status) || WIFSIGNALED(status)) {
+            inSyscall.erase(tid);
+            if (tid == pid) break;
+            continue;
+        }
+        int signal = 0;
+        if (WIFSTOPPED(status)) {
+            int stop = WSTOPSIG(status);
+            if (stop == (SIGTRAP | 0x80)) {
+                bool& entering = inSyscall[tid];
+                entering = !entering;
+                if (entering) {
+                    counts.total++;
+#if defined(__x86_64__)
+                    struct user_regs_struct regs;
+                    ptrace(PTRACE_GETREGS, tid, NULL, &regs);
+                    counts.byName[syscallName((long)regs.orig_rax)]++;
+#endif
+                }
+            } else if (stop != SIGTRAP && stop != SIGSTOP) {
+                // Pass real signals on
+                signal = stop;
+            }
+        }
+        ptrace(PTRACE_SYSCALL, tid, NULL, (void*)(long)signal);
+    }
+    return counts;
+}
+
+static void printSpeedup(const char* field, const double baseline, const double value) {
+    double speedup = baseline / value;
+    printf(", \"%s\": %.4f, \"speedup\": %.3f", field, baseline, speedup);
+    _logSpeedups += log(speedup);
+    _speedups++;
+}
+
+static void printResult(const char* scenario, const std::vector<std::string>& args, const std::string& in,
+    const std::string& out, const std::string& expected)
+{
+    RunResult result = run(_xmsg, args, in, out);
+    double baseline = 0;
+    if (_baseline != NULL) {
+        // The baseline goes first, so that 'out' is left with our output
+        for (unsigned i = 0; i < BASELINE_ROUNDS; i++) {
+            RunResult other = run(_baseline, args, in, out);
+            baseline = (i == 0) ? other.seconds : std::min(baseline, other.seconds);
+            RunResult next = run(_xmsg, args, in, out);
+            result.seconds = std::min(result.seconds, next.seconds);
+            result.maxRss = std::max(result.maxRss, next.maxRss);
+            result.status = next.status;
+        }
+    }
+    bool ok = WIFEXITED(result.status) && WEXITSTATUS(result.status) == 0;
+    if (ok && !expected.empty()) {
+        ok = sameContents(out, expected);
+    }
+    if (!ok) _failed = true;
+
+    size_t bytes = fileSize(in);
+    std::string command;
+    for (const std::string& arg : args) command += (command.empty() ? "" : " ") + arg;
+    printf("%s\n    {\"scenario\": \"%s\", \"args\": \"%s\", \"ok\": %s, \"input_bytes\": %zu, \"output_bytes\": %zu, "
+        "\"seconds\": %.4f, \"mb_per_s\": %.2f, \"peak_rss_kb\": %ld",
+        _first ? "" : ",", scenario, command.c_str(), ok ? "true" : "false", bytes, fileSize(out),
+        result.seconds, bytes / result.seconds / 1e6, result.maxRss);
+    _first = false;
+    if (_baseline != NULL) printSpeedup("baseline_seconds", baseline, result.seconds);
+
+    if (_countSyscalls) {
+        SyscallCounts counts = countSyscalls(args, in, out);
+        printf(", \"syscalls\": %lu", counts.total);
+        if (!counts.byName.empty()) {
+            printf(", \"syscalls_by_name\": {");
+            bool first = true;
+            for (auto& entry : counts.byName) {
+                printf("%s\"%s\": %lu", first ? "" : ", ", entry.first.c_str(), entry.second);
+                first = false;
+            }
+            printf("}");
+        }
+    }
+    printf("}");
+    fflush(stdout);
+}
+
+static double percentile(std::vector<double>& samples, const double p) {
+    std::sort(samples.begin(), samples.end());
+    size_t i = (size_t)(p * samples.size());
+    return samples[std::min(i, samples.size() - 1)];
+}
+
+// Runs xmsg once per message and reports the latency distribution
+static void printLatency(const char* scenario, const std::vector<std::string>& args, const std::string& in) {
+    std::vector<double> samples, baseline;
+    long maxRss = 0;
+    bool ok = true;
+    for (unsigned i = 0; i < _runs; i++) {
+        if (_baseline != NULL) {
+            RunResult other = run(_baseline, args, in, path("latency.out"));
+            baseline.push_back(other.seconds * 1e6);
+        }
+        RunResult result = run(_xmsg, args, in, path("latency.out"));
+        ok = ok && WIFEXITED(result.status) && WEXITSTATUS(result.status) == 0;
+        samples.push_back(result.seconds * 1e6);
+        maxRss = std::max(maxRss, result.maxRss);
+    }
+    if (!ok) _failed = true;
+
+    std::string command;
+    for (const std::string& arg : args) command += (command.empty() ? "" : " ") + arg;
+    printf("%s\n    {\"scenario\": \"%s\", \"args\": \"%s\", \"ok\": %s, \"runs\": %u, "
+        "\"p50_us\": %.1f, \"p99_us\": %.1f, \"p999_us\": %.1f, \"peak_rss_kb\": %ld",
+        _first ? "" : ",", scenario, command.c_str(), ok ? "true" : "false", _runs,
+        percentile(samples, 0.5), percentile(samples, 0.99), percentile(samples, 0.999), maxRss);
+    _first = false;
+    if (_baseline != NULL) printSpeedup("baseline_p50_us", percentile(baseline, 0.5), percentile(samples, 0.5));
+    printf("}");
+    fflush(stdout);
+}
+
+// Runs xmsg as an unprivileged user would, with stderr going to 'err'.
+// Root keeps its uid, so that it can still write the keychain, but loses
+// CAP_IPC_LOCK, which would otherwise let it lock any amount of memory.
+static RunResult runUnprivileged(const std::vector<std::string>& args, const std::string& in,
+    const std::string& out, const std::string& err)
+{
+    std::vector<char*> argv = makeArgv(_xmsg, args);
+    RunResult result;
+    auto start = std::chrono::steady_clock::now();
+    pid_t pid = fork();
+    if (pid == 0) {
+        // Fails without CAP_SETPCAP, but then there's no CAP_IPC_LOCK either
+        prctl(PR_CAPBSET_DROP, CAP_IPC_LOCK, 0, 0, 0);
+        struct rlimit limit;
+        getrlimit(RLIMIT_MEMLOCK, &limit);
+        limit.rlim_cur = std::min(limit.rlim_cur, (rlim_t)USER_MEMLOCK);
+        setrlimit(RLIMIT_MEMLOCK, &limit);
+        int errFd = open(err.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0600);
+        if (errFd == -1) _exit(127);
+        int inFd = open(in.c_str(), O_RDONLY);
+        int outFd = open(out.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0600);
+        if (inFd == -1 || outFd == -1) _exit(127);
+        dup2(inFd, 0);
+        dup2(outFd, 1);
+        dup2(errFd, 2);
+        execv(argv[0], argv.data());
+        _exit(127);
+    }
+
+    struct rusage usage;
+    wait4(pid, &result.status, 0, &usage);
+    result.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    result.maxRss = usage.ru_maxrss;
+    return result;
+}
+
+// Runs a keychain operation unprivileged, and checks that xmsg didn't have
+// to fall back to memory that isn't locked
+static void printUnprivileged(const char* scenario, const std::vector<std::string>& args, const std::string& in) {
+    RunResult result = runUnprivileged(args, in, path("bulk.out"), path("bulk.err"));
+    bool ok = WIFEXITED(result.status) && WEXITSTATUS(result.status) == 0;
+    ok = ok && !fileContains(path("bulk.err"), "could not lock memory");
+    if (!ok) _failed = true;
+
+    std::string command;
+    for (const std::string& arg : args) command += (command.empty() ? "" : " ") + arg;
+    printf("%s\n    {\"scenario\": \"%s\", \"args\": \"%s\", \"ok\": %s, \"input_bytes\": %zu, "
+        "\"seconds\": %.4f, \"peak_rss_kb\": %ld}",
+        _first ? "" : ",", scenario, command.c_str(), ok ? "true" : "false", fileSize(in),
+        result.seconds, result.maxRss);
+    _first = false;
+    fflush(stdout);
+}
+
+static void writeFile(const std::string& file, const std::string& data) {
+    FILE* f = fopen(file.c_str(), "wb");
+    if (f == NULL || fwrite(data.data(), 1, data.size(), f) != data.size()) {
+        perror(file.c_str());
+        exit(1);
+    }
+    fclose(f);
+}
+
+static std::string randomBytes(const size_t size) {
+    std::string data(size, '\0');
+    Drbg::local().generate((uint8_t*)&data[0], size);
+    return data;
+}
+
+static uint32_t randomBelow(const uint32_t n) {
+    uint32_t v;
+    Drbg::local().generate((uint8_t*)&v, sizeof(v));
+    return v % n;
+}
+
+static std::string logLine(const unsigned i) {
+    static const char* levels[] = { "info", "warn", "error" };
+    static const char* services[] = { "api", "db", "auth" };
+    char line[256];
+    snprintf(line, sizeof(line), "{\"ts\":%u,\"level\":\"%s\",\"svc\":\"%s\",\"msg\":\"request handled\",\"latency_ms\":%u,\"path\":\"/v1/items/%u\"}\n",
+        1700000000 + i, levels[randomBelow(3)], services[randomBelow(3)], randomBelow(1000), randomBelow(5000));
+    return line;
+}
+
+// A "<name> <hex key>" line for --importkeys
+static std::string keyLine(const std::string& name) {
+    std::string line = name + " ";
+    for (unsigned char c : randomBytes(32)) {
+        char hex[3];
+        snprintf(hex, sizeof(hex), "%02x", c);
+        line += hex;
+    }
+    return line + "\n";
+}
+
+static void generateCorpora() {
+    // Random binary data, as one message that fits the legacy format
+    writeFile(path("random.bin"), randomBytes(48 * 1024));
+
+    // Log-like text, one message per line
+    std::string text;
+    for (unsigned i = 0; text.size() < (16u << 20); i++) text += logLine(i);
+    writeFile(path("text.txt"), text);
+
+    // Many tiny messages
+    std::string tiny;
+    for (unsigned i = 0; i < 200000; i++) {
+        std::string line = randomBytes(8 + randomBelow(24));
+        for (char& c : line) c = 'a' + (uint8_t)c % 26;
+        tiny += line + "\n";
+    }
+    writeFile(path("tiny.txt"), tiny);
+
+    // One huge message
+    std::string huge;
+    huge.reserve(_hugeSize);
+    for (unsigned i = 0; huge.size() < _hugeSize; i++) {
+        std::string line = logLine(i);
+        line.pop_back();
+        huge += line;
+    }
+    huge.resize(_hugeSize);
+    writeFile(path("huge.txt"), huge);
+
+    writeFile(path("hello.txt"), "Hello World!");
+
+    // Keys for the bulk keychain operations, and their names
+    std::string bulk, names;
+    for (unsigned i = 0; i < BULK_KEYS; i++) {
+        std::string name = "bulk" + std::to_string(i);
+        bulk += keyLine(name);
+        names += name + "\n";
+    }
+    writeFile(path("bulk.txt"), bulk);
+    writeFile(path("bulk.names"), names);
+
+    // Forked children start out with our memory, and it counts towards
+    // their peak RSS
+    malloc_trim(0);
+}
+
+static void createKeychain() {
+    std::string keys;
+    for (const char* name : { "k0", "k1", "k2" }) keys += keyLine(name);
+    writeFile(path("keys.txt"), keys);
+    RunResult result = run(_xmsg, { "--importkeys" }, path("keys.txt"), path("import.out"));
+    if (!WIFEXITED(result.status) || WEXITSTATUS(result.status) != 0) {
+        fprintf(stderr, "Couldn't create the keychain.\n");
+        exit(1);
+    }
+}
+
+static void parseArguments(int argc, char* argv[]) {
+    if (argc < 3) {
+        fprintf(stderr, "Usage: %s XMSG WORKDIR [--huge-size BYTES] [--runs N] [--no-syscalls] [--baseline XMSG]\n", argv[0]);
+        exit(1);
+    }
+    _xmsg = argv[1];
+    _dir = argv[2];
+    for (int i = 3; i < argc; i++) {
+        if (strcmp(argv[i], "--huge-size") == 0 && i + 1 < argc) {
+            _hugeSize = strtoull(argv[++i], NULL, 10);
+        } else if (strcmp(argv[i], "--runs") == 0 && i + 1 < argc) {
+            _runs = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--no-syscalls") == 0) {
+            _countSyscalls = false;
+        } else if (strcmp(argv[i], "--baseline") == 0 && i + 1 < argc) {
+            _baseline = argv[++i];
+        } else {
+            fprintf(stderr, "Unknown argument \"%s\".\n", argv[i]);
+            exit(1);
+        }
+    }
+}
+
+int main(int argc, char* argv[]) {
+    parseArguments(argc, argv);
+    createKeychain();
+    generateCorpora();
+
+    printf("{\n  \"results\": [");
+
+    // Single messages
+    printResult("random.encrypt", { "-e", "-k0" }, path("random.bin"), path("random.enc"), "");
+    printResult("random.decrypt", { "-d", "-k0" }, path("random.enc"), path("random.dec"), path("random.bin"));
+    printResult("huge.encrypt", { "-e", "-m", "-k0" }, path("huge.txt"), path("huge.enc"), "");
+    printResult("huge.decrypt", { "-d", "-k0" }, path("huge.enc"), path("huge.dec"), path("huge.txt"));
+    printResult("huge.encrypt.compress", { "-e", "-c", "-k0" }, path("huge.txt"), path("huge.cenc"), "");
+    printResult("huge.decrypt.compress", { "-d", "-k0" }, path("huge.cenc"), path("huge.cdec"), path("huge.txt"));
+
+    // One message per line
+    printResult("text.batch.encrypt", { "-e", "-b", "-k0" }, path("text.txt"), path("text.enc"), "");
+    printResult("text.batch.decrypt", { "-d", "-b", "-k0" }, path("text.enc"), path("text.dec"), path("text.txt"));
+    printResult("text.batch.encrypt.j4", { "-e", "-b", "-j4", "-k0" }, path("text.txt"), path("text.enc"), "");
+    printResult("text.batch.decrypt.j4", { "-d", "-b", "-j4", "-k0" }, path("text.enc"), path("text.dec"), path("text.txt"));
+    printResult("text.batch.encrypt.mac", { "-e", "-b", "-m", "-k0" }, path("text.txt"), path("text.menc"), "");
+    printResult("text.batch.decrypt.mac", { "-d", "-b", "-k0" }, path("text.menc"), path("text.mdec"), path("text.txt"));
+    printResult("text.batch.encrypt.envelope", { "-e", "-b", "--envelope", "k0", "k1", "k2" }, path("text.txt"), path("text.eenc"), "");
+    printResult("text.batch.decrypt.envelope", { "-d", "-b", "--key-name", "k2" }, path("text.eenc"), path("text.edec"), path("text.txt"));
+    printResult("text.rekey", { "--rekey", "k0", "k1" }, path("text.enc"), path("text.renc"), "");
+    printResult("text.rekey.decrypt", { "-d", "-b", "-k1" }, path("text.renc"), path("text.rdec"), path("text.txt"));
+    printResult("tiny.batch.encrypt", { "-e", "-b", "-k0" }, path("tiny.txt"), path("tiny.enc"), "");
+    printResult("tiny.batch.decrypt", { "-d", "-b", "-k0" }, path("tiny.enc"), path("tiny.dec"), path("tiny.txt"));
+
+    // Process per message
+    printResult("hello.encrypt", { "-e", "-k0" }, path("hello.txt"), path("hello.enc"), "");
+    printLatency("latency.encrypt", { "-e", "-k0" }, path("hello.txt"));
+    printLatency("latency.decrypt", { "-d", "-k0" }, path("hello.enc"));
+
+    // Bulk keychain operations. They go last, and leave the keychain as
+    // they found it.
+    printUnprivileged("keys.import.bulk", { "--importkeys" }, path("bulk.txt"));
+    printUnprivileged("keys.delete.bulk", { "--deletekeys" }, path("bulk.names"));
+    printUnprivileged("keys.compact", { "--compactkeys" }, path("hello.txt"));
+
+    printf("\n  ],\n");
+    if (_speedups > 0) {
+        double speedup = exp(_logSpeedups / _speedups);
+        printf("  \"speedup\": %.3f,\n", speedup);
+        fprintf(stderr, "speedup over the baseline: %.3fx (geometric mean of %u scenarios)\n", speedup, _speedups);
+    }
+    printf("  \"ok\": %s\n}\n", _failed ? "false" : "true");
+    return _failed ? 1 : 0;
+}
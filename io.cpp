@@ -0,0 +1,202 @@
+#include "io.hpp"
+
+#include <cstdio>
+#include <cstdint>
+#include <cstdlib>
+#include <cerrno>
+#include <string>
+
+#include <sys/stat.h>
+#ifdef __linux__
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include <unistd.h>
+#elif defined(_WIN32)
+#include <io.h>
+#endif
+
+#include "stats.hpp"
+
+#define IO_BLOCKLEN (1 << 16)
+// Outputs with fewer whole pages than this are just written
+#define IO_SPLICEMIN (1 << 16)
+// Asked for as the pipe's capacity, so that each vmsplice() moves more
+#define IO_PIPELEN (1 << 20)
+
+size_t readSome(const int fd, char* data, const size_t length) {
+    StatsTimer timer(STATS_READ);
+    while (true) {
+#ifdef __linux__
+        ssize_t n = read(fd, data, length);
+#elif defined(_WIN32)
+        int n = _read(fd, data, (unsigned)length);
+#endif
+        if (n == -1) {
+            if (errno == EINTR) continue;
+            perror("read");
+            exit(1);
+        }
+        timer.addBytes(n);
+        return (size_t)n;
+    }
+}
+
+void readAll(const int fd, PoolString& out) {
+    size_t offset = out.size();
+    // Files say how big they are, so 'out' only has to grow once
+    struct stat st;
+    if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0) {
+        out.reserve(offset + (size_t)st.st_size + IO_BLOCKLEN);
+    }
+    while (true) {
+        out.resize(offset + IO_BLOCKLEN);
+        size_t n = readSome(fd, &out[offset], IO_BLOCKLEN);
+        offset += n;
+        if (n == 0) break;
+    }
+    out.resize(offset);
+}
+
+void writeAll(const int fd, const char* data, size_t length) {
+    StatsTimer timer(STATS_WRITE, length);
+    while (length > 0) {
+#ifdef __linux__
+        ssize_t n = write(fd, data, length);
+#elif defined(_WIN32)
+        int n = _write(fd, data, (unsigned)length);
+#endif
+        if (n == -1) {
+            if (errno == EINTR) continue;
+            perror("write");
+            exit(1);
+        }
+        data += n;
+        length -= n;
+    }
+}
+
+bool readAt(const int fd, void* data, const size_t length, const uint64_t offset) {
+    StatsTimer timer(STATS_READ, length);
+#ifdef __linux__
+    for (size_t done = 0; done < length; ) {
+        ssize_t n = pread(fd, (char*)data + done, length - done, (off_t)(offset + done));
+#elif defined(_WIN32)
+    if (_lseeki64(fd, (__int64)offset, SEEK_SET) == -1) {
+        perror("lseek");
+        exit(1);
+    }
+    for (size_t done = 0; done < length; ) {
+        int n = _read(fd, (char*)data + done, (unsigned)(length - done));
+#endif
+        if (n == -1) {
+            if (errno == EINTR) continue;
+            perror("read");
+            exit(1);
+        }
+        if (n == 0) return false;
+        done += n;
+    }
+    return true;
+}
+
+void writeAt(const int fd, const void* data, const size_t length, const uint64_t offset) {
+    StatsTimer timer(STATS_WRITE, length);
+#ifdef __linux__
+    for (size_t done = 0; done < length; ) {
+        ssize_t n = pwrite(fd, (const char*)data + done, length - done, (off_t)(offset + done));
+#elif defined(_WIN32)
+    if (_lseeki64(fd, (__int64)offset, SEEK_SET) == -1) {
+        perror("lseek");
+        exit(1);
+    }
+    for (size_t done = 0; done < length; ) {
+        int n = _write(fd, (const char*)data + done, (unsigned)(length - done));
+#endif
+        if (n == -1) {
+            if (errno == EINTR) continue;
+            perror("write");
+            exit(1);
+        }
+        done += n;
+    }
+}
+
+void syncDirectory(const char* path) {
+#ifdef __linux__
+    std::string dir(path);
+    size_t sep = dir.find_last_of('/');
+    dir = (sep == std::string::npos) ? "." : dir.substr(0, sep + 1);
+    int fd = open(dir.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd != -1) {
+        fsync(fd);
+        close(fd);
+    }
+#endif
+}
+
+#ifdef __linux__
+static bool _spliceUnsupported = false;
+
+// Whether output to 'fd' goes through vmsplice(), decided on first use
+static bool splicing(const int fd) {
+    static int checked = -1;
+    static bool pipe = false;
+    if (_spliceUnsupported) return false;
+    if (fd != checked) {
+        struct stat st;
+        pipe = fstat(fd, &st) == 0 && S_ISFIFO(st.st_mode);
+        // Failing is fine, the pipe keeps its capacity
+        if (pipe) fcntl(fd, F_SETPIPE_SZ, IO_PIPELEN);
+        checked = fd;
+    }
+    return pipe;
+}
+
+// Hands the pages from 'data' to the pipe. Returns the number of bytes,
+// which is less than 'length' if vmsplice() isn't supported. The pipe
+// takes whole pages, so that's always a multiple of the page size.
+static size_t splicePages(const int fd, char* data, const size_t length) {
+    StatsTimer timer(STATS_WRITE);
+    size_t done = 0;
+    while (done < length) {
+        struct iovec iov = { data + done, length - done };
+        ssize_t n = vmsplice(fd, &iov, 1, 0);
+        if (n == -1) {
+            if (errno == EINTR) continue;
+            if (errno == EINVAL || errno == ENOSYS) {
+                _spliceUnsupported = true;
+                break;
+            }
+            perror("vmsplice");
+            exit(1);
+        }
+        done += n;
+    }
+    // The pipe holds on to the pages until they are read. Dropping them
+    // leaves zero pages behind for whoever uses the buffer next.
+    const size_t page = (size_t)sysconf(_SC_PAGESIZE);
+    madvise(data, done / page * page, MADV_DONTNEED);
+    timer.addBytes(done);
+    return done;
+}
+#endif
+
+void writeOutput(const int fd, PoolString& data) {
+#ifdef __linux__
+    const uintptr_t page = (uintptr_t)sysconf(_SC_PAGESIZE);
+    char* start = &data[0];
+    char* end = start + data.size();
+    char* first = (char*)(((uintptr_t)start + page - 1) & ~(page - 1));
+    char* last = (char*)((uintptr_t)end & ~(page - 1));
+    if (last > first && (size_t)(last - first) >= IO_SPLICEMIN && splicing(fd)) {
+        writeAll(fd, start, first - start);
+        size_t n = splicePages(fd, first, last - first);
+        writeAll(fd, first + n, end - (first + n));
+        data.clear();
+        return;
+    }
+#endif
+    writeAll(fd, data.data(), data.size());
+    data.clear();
+}
@@ -0,0 +1,38 @@
+#ifndef _IO_HPP_
+#define _IO_HPP_
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+#include "bufpool.hpp"
+
+/*
+    Unbuffered reads and writes on file descriptors, for message data.
+
+    All of them retry on EINTR and exit the program on any other error.
+    They are counted as the "input read" and "output write" stages of
+    --stats.
+
+    When the output is a pipe (Linux), writeOutput() doesn't copy whole
+    pages of the data into it: they are handed to the pipe with vmsplice()
+    and replaced in our address space by fresh zero pages, so that reusing
+    the buffer can't change what the reader gets. The rest is written.
+*/
+
+// Reads at most 'length' bytes. Returns 0 at the end of the input.
+size_t readSome(const int fd, char* data, const size_t length);
+// Appends everything up to the end of the input to 'out'
+void readAll(const int fd, PoolString& out);
+void writeAll(const int fd, const char* data, size_t length);
+// Reads exactly 'length' bytes at 'offset' of a file. Returns false if the
+// file ends first. Both are thread safe on Linux.
+bool readAt(const int fd, void* data, const size_t length, const uint64_t offset);
+void writeAt(const int fd, const void* data, const size_t length, const uint64_t offset);
+// Makes a rename() to 'path' durable, by syncing its directory
+void syncDirectory(const char* path);
+// Writes all of 'data' and clears it. Not thread safe, output is written
+// by one thread.
+void writeOutput(const int fd, PoolString& data);
+
+#endif
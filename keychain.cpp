@@ -1,12 +1,14 @@
 #include "keychain.hpp"
 
 #include <string>
-#include <iostream>
 #include <fstream>
-#include <limits>
 #include <cstring>
 #include <algorithm>
+#include <deque>
+#include <functional>
+#include <unordered_set>
 #include <cstdio>
+#include <cerrno>
 
 #include "xmsg.hpp"
 #include "config.hpp"
@@ -14,25 +16,488 @@
 #ifdef __linux__
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/file.h>
+#include <fcntl.h>
 #include <unistd.h>
 #elif defined(_WIN32)
 #include <windows.h>
 #endif
 
+/*
+    Locking protocol:
+
+    The key file is never modified in place. Writers build a complete new
+    image in a temporary file, fsync it and rename() it over KEYFILE_PATH,
+    so a reader always sees either the old or the new keychain, and a
+    mapping stays valid after the file is replaced.
+
+    Writers serialize their read-modify-write cycles with an exclusive flock
+    on KEYFILE_PATH.lock. Readers never take that lock. They hold a shared
+    flock on the key file itself only while opening and mapping it, and a
+    writer takes an exclusive flock on the current key file just for the
+    rename, so readers wait at most for a rename, never for a slow writer.
+*/
+
+#define KEYFILE_LOCK_PATH KEYFILE_PATH ".lock"
+#define KEYFILE_BACKUP_PATH KEYFILE_PATH ".bak"
+// Slots copied into locked memory at a time when writing the key file
+#define KEYFILE_WRITE_SLOTS 256
+
+#ifdef __linux__
+static int _writerLock = -1;
+static unsigned _writerLockDepth = 0;
+#endif
+
+// Acquires the writer lock. Nested calls from the same process are allowed.
+static void lockWriters() {
+#ifdef __linux__
+    if (_writerLockDepth++ > 0) return;
+    _writerLock = open(KEYFILE_LOCK_PATH, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+    if (_writerLock == -1) {
+        perror("open " KEYFILE_LOCK_PATH);
+        exit(1);
+    }
+    while (flock(_writerLock, LOCK_EX) == -1) {
+        if (errno == EINTR) continue;
+        perror("flock");
+        exit(1);
+    }
+#endif
+}
+
+static void unlockWriters() {
+#ifdef __linux__
+    if (--_writerLockDepth > 0) return;
+    close(_writerLock);
+    _writerLock = -1;
+#endif
+}
+
+#ifdef __linux__
+static void flockRetry(int fd, int operation) {
+    while (flock(fd, operation) == -1) {
+        if (errno == EINTR) continue;
+        perror("flock");
+        exit(1);
+    }
+}
+
+// Makes a rename in the key file's directory durable
+static void syncKeyFileDirectory() {
+    std::string dir(KEYFILE_PATH);
+    size_t sep = dir.find_last_of('/');
+    dir = (sep == std::string::npos) ? "." : dir.substr(0, sep + 1);
+    int fd = open(dir.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd != -1) {
+        fsync(fd);
+        close(fd);
+    }
+}
+#endif
+
+// FNV-1a over the zero padded key name
+static uint32_t hashKeyName(const char* name) {
+    uint32_t hash = 2166136261u;
+    for (unsigned i = 0; i < KEYCHAIN_NAMELEN; i++) {
+        hash ^= (uint8_t)name[i];
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+// Checks that the header and everything it points to lies within the image
+static bool validateImage(const uint8_t* image, const size_t size) {
+    const KeychainHeader* hdr = (const KeychainHeader*)image;
+    if (size < sizeof(KeychainHeader)) return false;
+    if (hdr->version != KEYCHAIN_VERSION) return false;
+    if (hdr->headerSize != sizeof(KeychainHeader)) return false;
+    if (hdr->slotSize != sizeof(KeychainSlot)) return false;
+    if (hdr->indexSize == 0 || (hdr->indexSize & (hdr->indexSize - 1)) != 0) return false;
+    if (hdr->indexSize < hdr->keyCount) return false;
+    if (hdr->indexOffset % sizeof(uint32_t) != 0) return false;
+    if (hdr->indexOffset > size || (size - hdr->indexOffset) / sizeof(uint32_t) < hdr->indexSize) return false;
+    if (hdr->slotsOffset > size || (size - hdr->slotsOffset) / sizeof(KeychainSlot) < hdr->keyCount) return false;
+    return true;
+}
+
+static std::vector<const KeychainSlot*> readSlots(const uint8_t* image) {
+    std::vector<const KeychainSlot*> slots;
+    if (image == NULL) return slots;
+    const KeychainHeader* hdr = (const KeychainHeader*)image;
+    const KeychainSlot* first = (const KeychainSlot*)(image + hdr->slotsOffset);
+    slots.reserve(hdr->keyCount);
+    for (uint32_t i = 0; i < hdr->keyCount; i++) slots.push_back(first + i);
+    return slots;
+}
+
+// Written in place of deleted keys
+static const KeychainSlot _deletedSlot = { {}, {}, KEYSLOT_DELETED, {} };
+
+static std::string slotName(const KeychainSlot* slot) {
+    size_t len = 0;
+    while (len < KEYCHAIN_NAMELEN && slot->name[len] != '\0') len++;
+    return std::string(slot->name, len);
+}
+
 Keychain::Keychain(const int keyid) :
-    currentKeyIndex(keyid)
+    currentKeyIndex(keyid),
+    image(NULL),
+    imageSize(0)
+{
+    this->open();
+    this->selectKey(keyid);
+}
+
+Keychain::Keychain(const char* keyName) :
+    currentKeyIndex(-1),
+    image(NULL),
+    imageSize(0)
 {
-    this->loadKeyNames();
+    this->open();
+    int keyid = this->findKey(keyName);
+    if (keyid < 0) {
+        printf("No key named \"%s\".\n", keyName);
+    }
+    this->selectKey(keyid);
+}
+
+Keychain::~Keychain() {
+    this->close();
+}
+
+void Keychain::selectKey(const int keyid) {
+    this->currentKeyIndex = keyid;
     // Invalid key was selected.
-    if (keyid < 0 || (unsigned)keyid >= this->keyNames.size()) {
+    if (keyid < 0 || (unsigned)keyid >= this->getKeyCount() ||
+        (this->slot(keyid)->flags & KEYSLOT_DELETED) != 0) {
         puts("Which encryption key do you want to use?");
-        for (unsigned i = 0; i < this->keyNames.size(); i++) {
-            printf("[%i]: \"%s\"\n", i, this->keyNames.at(i).c_str());
+        this->printKeys();
+        exit(0);
+    }
+}
+
+void Keychain::printKeys() const {
+    for (unsigned i = 0; i < this->getKeyCount(); i++) {
+        const KeychainSlot* s = this->slot(i);
+        if (s->flags & KEYSLOT_DELETED) continue;
+        printf("[%i]: \"%s\"\n", i, slotName(s).c_str());
+    }
+}
+
+unsigned Keychain::getKeyCount() const {
+    return (this->image != NULL) ? this->header()->keyCount : 0;
+}
+
+const KeychainSlot* Keychain::slot(const unsigned i) const {
+    return (const KeychainSlot*)(this->image + this->header()->slotsOffset) + i;
+}
+
+int Keychain::findKey(const char* keyName) const {
+    char name[KEYCHAIN_NAMELEN];
+    size_t len = strlen(keyName);
+
+    if (this->image == NULL || len > KEYCHAIN_NAMELEN) {
+        return -1;
+    }
+    memset(name, 0, sizeof(name));
+    memcpy(name, keyName, len);
+
+    const KeychainHeader* hdr = this->header();
+    const uint32_t* index = (const uint32_t*)(this->image + hdr->indexOffset);
+    const uint32_t mask = hdr->indexSize - 1;
+    for (uint32_t i = hashKeyName(name) & mask, n = 0; n < hdr->indexSize; i = (i + 1) & mask, n++) {
+        if (index[i] == 0 || index[i] > hdr->keyCount) {
+            break;
         }
+        if (memcmp(this->slot(index[i] - 1)->name, name, KEYCHAIN_NAMELEN) == 0) {
+            return (int)index[i] - 1;
+        }
+    }
+    return -1;
+}
+
+void Keychain::open() {
+    if (!Keychain::mapKeyFile(&this->image, &this->imageSize)) {
+        printf("Could not open \"%s\"... Does it exist?\n", KEYFILE_PATH);
         exit(0);
     }
 }
 
+void Keychain::close() {
+    Keychain::unmapKeyFile(this->image, this->imageSize);
+    this->image = NULL;
+    this->imageSize = 0;
+}
+
+// Maps the key file as it is on disk, without migrating or validating it
+static bool mapRawKeyFile(uint8_t** image, size_t* imageSize) {
+    uint8_t* data = NULL;
+    size_t size = 0;
+
+    *image = NULL;
+    *imageSize = 0;
+#ifdef __linux__
+    int fd = ::open(KEYFILE_PATH, O_RDONLY | O_CLOEXEC);
+    if (fd == -1) {
+        return false;
+    }
+    flockRetry(fd, LOCK_SH);
+    struct stat s;
+    if (fstat(fd, &s) == -1) {
+        perror("fstat");
+        ::close(fd);
+        return false;
+    }
+    size = s.st_size;
+    if (size > 0) {
+        void* p = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+        if (p == MAP_FAILED) {
+            perror("mmap");
+            ::close(fd);
+            return false;
+        }
+        data = (uint8_t*)p;
+    }
+    // The mapping stays valid, since writers replace the file instead of
+    // modifying it. It also keeps the open file and its lock alive after
+    // close(), so the lock has to be dropped explicitly.
+    flockRetry(fd, LOCK_UN);
+    ::close(fd);
+#elif defined(_WIN32)
+    std::ifstream file(KEYFILE_PATH, std::ios::in | std::ios::binary | std::ios::ate);
+    if (!file.is_open()) {
+        return false;
+    }
+    size = (size_t)file.tellg();
+    if (size > 0) {
+        data = new uint8_t[size];
+        file.seekg(0);
+        file.read((char*)data, size);
+    }
+    file.close();
+#endif
+
+    *image = data;
+    *imageSize = size;
+    return true;
+}
+
+static bool isLegacyImage(const uint8_t* image, const size_t size) {
+    return size > 0 && (size < sizeof(KeychainHeader) || memcmp(image, KEYCHAIN_MAGIC, 8) != 0);
+}
+
+// Maps the key file into memory. Older key files are migrated first.
+// An empty key file yields a NULL image.
+bool Keychain::mapKeyFile(const uint8_t** image, size_t* imageSize) {
+    uint8_t* data;
+    size_t size;
+
+    *image = NULL;
+    *imageSize = 0;
+    if (!mapRawKeyFile(&data, &size)) {
+        return false;
+    }
+
+    if (size == 0) {
+        return true;
+    }
+
+    if (isLegacyImage(data, size)) {
+        Keychain::unmapKeyFile(data, size);
+        Keychain::migrateLegacyKeyFile();
+        return Keychain::mapKeyFile(image, imageSize);
+    }
+
+    if (!validateImage(data, size)) {
+        printf("\"%s\" is corrupted or was written by a newer version of xmsg.\n", KEYFILE_PATH);
+        exit(1);
+    }
+
+    *image = data;
+    *imageSize = size;
+    return true;
+}
+
+void Keychain::unmapKeyFile(const uint8_t* image, const size_t imageSize) {
+    if (image == NULL) return;
+#ifdef __linux__
+    munmap((void*)image, imageSize);
+#elif defined(_WIN32)
+    delete[] image;
+#endif
+}
+
+// Older key files are a sequence of 16 byte names followed by 32 byte keys,
+// each record terminated by '\n'. Records are read at a fixed stride, so keys
+// that contain a newline byte are migrated intact.
+void Keychain::migrateLegacyKeyFile() {
+    constexpr size_t recordSize = KEYCHAIN_NAMELEN + AES_KEYLEN + 1;
+    SecureVector<KeychainSlot> slots;
+    uint8_t* data;
+    size_t size;
+
+    lockWriters();
+    // Another process may have migrated the file while we waited
+    if (!mapRawKeyFile(&data, &size) || !isLegacyImage(data, size)) {
+        Keychain::unmapKeyFile(data, size);
+        unlockWriters();
+        return;
+    }
+
+    if (size % recordSize != 0) {
+        printf("Warning: \"%s\" has %zu trailing bytes which were not migrated.\n",
+            KEYFILE_PATH, size % recordSize);
+    }
+
+    slots.resize(size / recordSize);
+    for (size_t i = 0; i < slots.size(); i++) {
+        memcpy(slots[i].name, data + i * recordSize, KEYCHAIN_NAMELEN);
+        memcpy(slots[i].key, data + i * recordSize + KEYCHAIN_NAMELEN, AES_KEYLEN);
+    }
+    Keychain::unmapKeyFile(data, size);
+    std::vector<const KeychainSlot*> slotList;
+    for (const KeychainSlot& slot : slots) slotList.push_back(&slot);
+
+    printf("Migrating %zu keys in \"%s\" to keychain format version %i...\n",
+        slots.size(), KEYFILE_PATH, KEYCHAIN_VERSION);
+    // Keep the old file around as a backup
+#ifdef __linux__
+    unlink(KEYFILE_BACKUP_PATH);
+    if (link(KEYFILE_PATH, KEYFILE_BACKUP_PATH) != 0) {
+        perror("link " KEYFILE_BACKUP_PATH);
+        exit(1);
+    }
+#elif defined(_WIN32)
+    CopyFileA(KEYFILE_PATH, KEYFILE_BACKUP_PATH, FALSE);
+#endif
+    Keychain::writeKeyFile(slotList);
+    unlockWriters();
+}
+
+void Keychain::updateKeyFile(const std::function<void(std::vector<const KeychainSlot*>&)>& update) {
+    const uint8_t* image = NULL;
+    size_t imageSize = 0;
+    std::vector<const KeychainSlot*> slots;
+
+    lockWriters();
+    if (Keychain::mapKeyFile(&image, &imageSize)) {
+        slots = readSlots(image);
+    }
+    update(slots);
+    // The old image stays mapped until its slots have been written out
+    Keychain::writeKeyFile(slots);
+    Keychain::unmapKeyFile(image, imageSize);
+    unlockWriters();
+}
+
+void Keychain::writeKeyFile(const std::vector<const KeychainSlot*>& slots) {
+    uint32_t indexSize = 8;
+    while (indexSize < slots.size() * 2) indexSize <<= 1;
+
+    const size_t indexOffset = sizeof(KeychainHeader);
+    // Key slots start on a cache line boundary
+    const size_t slotsOffset = (indexOffset + indexSize * sizeof(uint32_t) + 63) & ~(size_t)63;
+
+    // The header and the name index hold no key material. Only the slots
+    // go through locked memory, a few at a time.
+    std::vector<uint8_t> head(slotsOffset, 0);
+    KeychainHeader* hdr = (KeychainHeader*)head.data();
+    memcpy(hdr->magic, KEYCHAIN_MAGIC, 8);
+    hdr->version = KEYCHAIN_VERSION;
+    hdr->headerSize = sizeof(KeychainHeader);
+    hdr->slotSize = sizeof(KeychainSlot);
+    hdr->keyCount = (uint32_t)slots.size();
+    hdr->indexSize = indexSize;
+    hdr->indexOffset = indexOffset;
+    hdr->slotsOffset = slotsOffset;
+
+    uint32_t* index = (uint32_t*)(head.data() + indexOffset);
+    for (uint32_t s = 0; s < slots.size(); s++) {
+        if (slots[s]->flags & KEYSLOT_DELETED) continue;
+        const uint32_t mask = indexSize - 1;
+        uint32_t i = hashKeyName(slots[s]->name) & mask;
+        // If several keys share a name, the first one wins
+        while (index[i] != 0 && memcmp(slots[index[i] - 1]->name, slots[s]->name, KEYCHAIN_NAMELEN) != 0) {
+            i = (i + 1) & mask;
+        }
+        if (index[i] == 0) index[i] = s + 1;
+    }
+
+    SecureVector<KeychainSlot> chunk(std::min(slots.size(), (size_t)KEYFILE_WRITE_SLOTS));
+    auto writeImage = [&](const std::function<bool(const void*, size_t)>& write) {
+        if (!write(head.data(), head.size())) return false;
+        for (size_t s = 0; s < slots.size(); s += chunk.size()) {
+            size_t n = std::min(chunk.size(), slots.size() - s);
+            for (size_t i = 0; i < n; i++) chunk[i] = *slots[s + i];
+            if (!write(chunk.data(), n * sizeof(KeychainSlot))) return false;
+        }
+        return true;
+    };
+
+    // Write the new image next to the key file, then swap it in
+    std::string tmpPath = std::string(KEYFILE_PATH) + ".tmp";
+#ifdef __linux__
+    tmpPath += "." + std::to_string(getpid());
+    int fd = ::open(tmpPath.c_str(), O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0600);
+    if (fd == -1) {
+        printf("Could not open %s for writing...\n", tmpPath.c_str());
+        exit(1);
+    }
+    bool written = writeImage([fd](const void* data, size_t size) {
+        for (size_t off = 0; off < size; ) {
+            ssize_t n = write(fd, (const uint8_t*)data + off, size - off);
+            if (n == -1) {
+                if (errno == EINTR) continue;
+                return false;
+            }
+            off += n;
+        }
+        return true;
+    });
+    if (!written) {
+        perror("write");
+        ::close(fd);
+        unlink(tmpPath.c_str());
+        exit(1);
+    }
+    if (fsync(fd) == -1) {
+        perror("fsync");
+        ::close(fd);
+        unlink(tmpPath.c_str());
+        exit(1);
+    }
+    ::close(fd);
+
+    // Wait for readers that are mapping the current file
+    int current = ::open(KEYFILE_PATH, O_RDONLY | O_CLOEXEC);
+    if (current != -1) {
+        flockRetry(current, LOCK_EX);
+    }
+    if (std::rename(tmpPath.c_str(), KEYFILE_PATH) != 0) {
+        perror("rename");
+        unlink(tmpPath.c_str());
+        exit(1);
+    }
+    if (current != -1) {
+        ::close(current);
+    }
+    syncKeyFileDirectory();
+#elif defined(_WIN32)
+    std::ofstream file(tmpPath, std::ios::out | std::ios::binary | std::ios::trunc);
+    if (!file.is_open()) {
+        printf("Could not open %s for writing...\n", tmpPath.c_str());
+        exit(1);
+    }
+    writeImage([&file](const void* data, size_t size) {
+        file.write((const char*)data, size);
+        return file.good();
+    });
+    file.close();
+    MoveFileExA(tmpPath.c_str(), KEYFILE_PATH, MOVEFILE_REPLACE_EXISTING | MOVEFILE_WRITE_THROUGH);
+#endif
+}
+
 #ifdef __linux__
 int mkdir_parents(const char* dir, const mode_t mode) {
 #elif defined(_WIN32)
@@ -94,79 +559,71 @@ void Keychain::createKeyFile() {
 #endif
 }
 
-std::array<uint8_t, AES_KEYLEN> Keychain::getKey()
-{
-    std::ifstream file(KEYFILE_PATH);
-    std::string line;
-    std::array<uint8_t, AES_KEYLEN> key;
-    key.fill(0);
-
-    if (!file.is_open()) {
-        printf("Could not open %s... Does it exist?\n", KEYFILE_PATH);
-        file.close();
-        exit(0);
-        return key;
-    }
-
-    int i = 0;
-    while (std::getline(file, line, '\n')) {
-        if (i == this->currentKeyIndex) {
-            std::string keyStr = line.substr(16);
-            for (unsigned j = 0; j < keyStr.length(); j++) {
-                key.at(j) = keyStr[j];
-            }
-            break;
-        }
-        i++;
+// Reads a line from stdin, without the '\n'. Returns false at the end of
+// the input. Uses stdio, as iostreams cost a static initializer in every
+// invocation.
+template <typename String>
+static bool readLine(String& line) {
+    line.clear();
+    int c;
+#ifdef __linux__
+    while ((c = getchar_unlocked()) != EOF) {
+#else
+    while ((c = getchar()) != EOF) {
+#endif
+        if (c == '\n') return true;
+        line.push_back((char)c);
     }
+    return !line.empty();
+}
 
-    file.close();
-    return key;
+void Keychain::getKey(uint8_t* key) const
+{
+    memcpy(key, this->slot(this->currentKeyIndex)->key, AES_KEYLEN);
 }
 
 void Keychain::createKey() {
     std::string keyName, choice;
     puts("What do you want to call the key? (MAX 16 CHARS)");
-    std::cout << "Name: " << std::flush;
-    std::getline(std::cin, keyName);
+    printf("Name: ");
+    fflush(stdout);
+    readLine(keyName);
     keyName.resize(16, '\0');
     while (true) {
         puts("Do you want to randomize the key? (y/n)");
-        std::cout << '\"' << keyName << "\": ";
-        std::getline(std::cin, choice);
+        printf("\"%s\": ", keyName.c_str());
+        fflush(stdout);
+        if (!readLine(choice)) return;
         if (choice.compare("y") == 0) {
-            std::array<uint8_t, AES_KEYLEN> key;
-            key.fill(0);
+            SecureVector<uint8_t> key(AES_KEYLEN);
 
             constexpr char alphabet[] = "abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789!@#$%^&*()_+-=`~\\\"\';:?/>.<,[]{}|";
-            {
-                std::vector<uint8_t> keyVector = Application::generateRandomBytes(AES_KEYLEN);
-                std::copy_n(keyVector.begin(), AES_KEYLEN, key.begin());
-            }
+            Application::generateRandomBytes(key.data(), AES_KEYLEN);
 
-            std::cout << "Generated random key: ";
+            printf("Generated random key: ");
             for (int i = 0; i < AES_KEYLEN; i++) {
-                key.at(i) = alphabet[key[i] * strlen(alphabet) / UINT8_MAX];
-                std::cout << (char)key[i];
+                key.at(i) = alphabet[key[i] * (sizeof(alphabet) - 1) / (UINT8_MAX + 1)];
+                putchar(key[i]);
             }
-            std::cout << '\n';
+            putchar('\n');
 
-            Keychain::createKey(keyName, key);
+            Keychain::createKey(keyName, key.data());
             puts("Randomized key generated.");
             break;
         } else if (choice.compare("n") == 0) {
             puts("Please enter what you want the key to be (MAX 32 CHARS)");
-            std::cout << '\"' << keyName << "\": ";
-            std::array<uint8_t, AES_KEYLEN> key;
-            std::string input;
-            std::getline(std::cin, input);
+            printf("\"%s\": ", keyName.c_str());
+            fflush(stdout);
+            SecureVector<uint8_t> key(AES_KEYLEN);
+            SecureString input;
+            readLine(input);
             input.resize(32, '\0');
 
             for (unsigned i = 0; i < input.length(); i++) {
                 key.at(i) = input[i];
             }
 
-            Keychain::createKey(keyName, key);
+            Keychain::createKey(keyName, key.data());
             break;
         }
     }
@@ -175,104 +632,232 @@ void Keychain::createKey() {
 void Keychain::deleteKey() {
     while (true) {
         std::vector<std::string> keyNames = this->getKeyNames();
-        for (unsigned i = 0; i < keyNames.size(); i++) {
-            printf("[%i]: \"%s\"\n", i, keyNames.at(i).c_str());
-        }
+        this->printKeys();
         puts("Which key would you like to delete?");
 
         unsigned choice;
-        std::cout << "xmsg > " << std::flush;
-        std::cin >> choice;
-        // Clear the input stream
-        std::cin.clear();
-        std::cin.ignore(std::numeric_limits<std::streamsize>::max(), '\n');
-
-        if (choice <= keyNames.size() - 1) {
-            if (std::rename("xmsgkey.txt", "xmsgkey.bak") == 0) {
-                std::ifstream in("xmsgkey.bak");
-                std::ofstream out("xmsgkey.txt");
-                if (in.is_open() && out.is_open()) {
-                    if (keyNames.size() == 1) {
-                        out.clear();
-                        out.close();
-                        in.close();
-                    }
-                    std::string line;
-                    unsigned int i = 0;
-                    while (std::getline(in, line)) {
-                        if (i != choice) {
-                            out << line;
-                            out.put('\n');
-                        }
-                        i++;
+        std::string input;
+        printf("xmsg > ");
+        fflush(stdout);
+        if (!readLine(input)) return;
+        if (sscanf(input.c_str(), "%u", &choice) != 1) {
+            choice = keyNames.size();
+        }
+
+        if (choice < keyNames.size() && (this->slot(choice)->flags & KEYSLOT_DELETED) == 0) {
+            // Another process may have changed the keychain since it was
+            // listed, so the key is looked up by content rather than index.
+            SecurePtr<KeychainSlot> target = makeSecure<KeychainSlot>(*this->slot(choice));
+            bool found = false;
+            Keychain::updateKeyFile([&](std::vector<const KeychainSlot*>& slots) {
+                for (const KeychainSlot*& slot : slots) {
+                    if (memcmp(slot, target.get(), sizeof(KeychainSlot)) == 0) {
+                        slot = &_deletedSlot;
+                        found = true;
+                        break;
                     }
-                    in.close();
-                    out.close();
-                } else {
-                    std::cout << "Could not open files...\n";
                 }
-            } else {
-                perror("rename");
-                return;
+            });
+            if (!found) {
+                puts("The key was already deleted.");
             }
+            // Pick up the new file
+            this->close();
+            this->open();
         } else {
             puts("Invalid option.");
         }
     }
 }
 
-void Keychain::createKey(std::string keyName, std::array<uint8_t, AES_KEYLEN> key)
+void Keychain::createKey(const std::string& keyName, const uint8_t* key)
 {
     // Checks if the key file exists, and creates one if it doesn't
     Keychain::createKeyFile();
 
-    std::cout << "Creating a key named " << keyName << "...\n";
-    std::cout << "Key data: ";
-    for (int i = 0; i < AES_KEYLEN; i++) {
-        std::cout << key[i];
-    }
-    std::cout << '\n';
+    printf("Creating a key named %s...\n", keyName.c_str());
+    printf("Key data: ");
+    fwrite(key, 1, AES_KEYLEN, stdout);
+    putchar('\n');
 
-    std::ofstream file(KEYFILE_PATH, std::ios::app | std::ios::out);
-    if (!file.is_open()) {
-        printf("Could not open %s for writing...\n", KEYFILE_PATH);
-        file.close();
-        return;
+    SecurePtr<KeychainSlot> slot = makeSecure<KeychainSlot>();
+    memcpy(slot->name, keyName.data(), std::min(keyName.length(), (size_t)KEYCHAIN_NAMELEN));
+    memcpy(slot->key,  key,            AES_KEYLEN);
+
+    Keychain::updateKeyFile([&](std::vector<const KeychainSlot*>& slots) {
+        slots.push_back(slot.get());
+    });
+}
+
+void Keychain::loadKeyNames()
+{
+    this->keyNames.clear();
+    for (unsigned i = 0; i < this->getKeyCount(); i++) {
+        this->keyNames.push_back(slotName(this->slot(i)));
     }
+}
 
-    struct KeyData_t
-    {
-        char name[16];
-        char key[32];
-    } keydata;
+static int hexValue(const char c) {
+    if (c >= '0' && c <= '9') return c - '0';
+    if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+    if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+    return -1;
+}
 
-    memset(&keydata, 0,  sizeof(KeyData_t));
-    memcpy(keydata.name, keyName.data(), keyName.length());
-    memcpy(keydata.key,  key.data(),     AES_KEYLEN);
+// Parses a text import line: the key name, whitespace, then the key as
+// 64 hex digits. The name may itself contain spaces.
+static bool parseKeyLine(const SecureString& line, KeychainSlot* slot) {
+    size_t end = line.find_last_not_of(" \t\r");
+    if (end == SecureString::npos) return false;
+    size_t sep = line.find_last_of(" \t", end);
+    if (sep == SecureString::npos || end - sep != AES_KEYLEN * 2) return false;
+    size_t nameEnd = line.find_last_not_of(" \t", sep);
+    if (nameEnd == SecureString::npos || nameEnd + 1 > KEYCHAIN_NAMELEN) return false;
+
+    memset(slot, 0, sizeof(KeychainSlot));
+    memcpy(slot->name, line.data(), nameEnd + 1);
+    for (unsigned i = 0; i < AES_KEYLEN; i++) {
+        int hi = hexValue(line[sep + 1 + i * 2]);
+        int lo = hexValue(line[sep + 2 + i * 2]);
+        if (hi < 0 || lo < 0) return false;
+        slot->key[i] = (uint8_t)(hi << 4 | lo);
+    }
+    return true;
+}
 
-    file.write((const char*)&keydata, sizeof(KeyData_t));
-    file.put('\n');
+void Keychain::importKeys(const bool binary) {
+    // A deque grows without copying, so a large import never needs twice
+    // its size in locked memory
+    std::deque<KeychainSlot, SecureAllocator<KeychainSlot>> imported;
+
+    if (binary) {
+        // 48 byte records: 16 byte name followed by the 32 byte key
+        while (true) {
+            imported.emplace_back();
+            KeychainSlot& slot = imported.back();
+            size_t n = fread(slot.name, 1, KEYCHAIN_NAMELEN, stdin);
+            if (n == 0 && feof(stdin)) {
+                imported.pop_back();
+                break;
+            }
+            if (n != KEYCHAIN_NAMELEN || fread(slot.key, 1, AES_KEYLEN, stdin) != AES_KEYLEN) {
+                printf("Truncated record %zu in input, nothing was imported.\n", imported.size() - 1);
+                exit(1);
+            }
+        }
+    } else {
+        SecureString line;
+        unsigned lineNumber = 0;
+        while (readLine(line)) {
+            lineNumber++;
+            if (line.find_first_not_of(" \t\r") == SecureString::npos) continue;
+            imported.emplace_back();
+            if (!parseKeyLine(line, &imported.back())) {
+                printf("Invalid key on line %u (expected \"<name> <64 hex digits>\"), nothing was imported.\n", lineNumber);
+                exit(1);
+            }
+        }
+    }
 
-    file.close();
+    Keychain::createKeyFile();
+    size_t added = 0, skipped = 0;
+    Keychain::updateKeyFile([&](std::vector<const KeychainSlot*>& slots) {
+        std::unordered_set<std::string> names;
+        names.reserve(slots.size() + imported.size());
+        for (const KeychainSlot* slot : slots) {
+            if (slot->flags & KEYSLOT_DELETED) continue;
+            names.insert(std::string(slot->name, KEYCHAIN_NAMELEN));
+        }
+        slots.reserve(slots.size() + imported.size());
+        for (const KeychainSlot& slot : imported) {
+            // Names have to stay unique for --key-name lookups
+            if (!names.insert(std::string(slot.name, KEYCHAIN_NAMELEN)).second) {
+                skipped++;
+                continue;
+            }
+            slots.push_back(&slot);
+            added++;
+        }
+    });
+    printf("Imported %zu keys, skipped %zu with names already in use.\n", added, skipped);
 }
 
-void Keychain::loadKeyNames()
-{
-    std::ifstream file(KEYFILE_PATH);
-    std::string line;
+void Keychain::exportKeys(const bool binary) {
+    const uint8_t* image;
+    size_t imageSize;
 
-    if (!file.is_open()) {
-        printf("Could not open \"%s\"... Does it exist?\n", KEYFILE_PATH);
-        file.close();
-        exit(0);
+    if (!Keychain::mapKeyFile(&image, &imageSize)) {
+        fprintf(stderr, "Could not open \"%s\"... Does it exist?\n", KEYFILE_PATH);
+        exit(1);
+    }
+    if (image == NULL) {
         return;
     }
 
-    this->keyNames.clear();
-    while (std::getline(file, line)) {
-        this->keyNames.push_back(line.substr(0, 15));
+    static const char digits[] = "0123456789abcdef";
+    const KeychainHeader* hdr = (const KeychainHeader*)image;
+    const KeychainSlot* slots = (const KeychainSlot*)(image + hdr->slotsOffset);
+    SecureVector<char> line(KEYCHAIN_NAMELEN + 1 + AES_KEYLEN * 2 + 1);
+    for (uint32_t i = 0; i < hdr->keyCount; i++) {
+        const KeychainSlot* slot = &slots[i];
+        if (slot->flags & KEYSLOT_DELETED) continue;
+        if (binary) {
+            fwrite(slot->name, 1, KEYCHAIN_NAMELEN, stdout);
+            fwrite(slot->key, 1, AES_KEYLEN, stdout);
+            continue;
+        }
+        std::string name = slotName(slot);
+        char* p = line.data();
+        memcpy(p, name.data(), name.length());
+        p += name.length();
+        *p++ = ' ';
+        for (unsigned j = 0; j < AES_KEYLEN; j++) {
+            *p++ = digits[slot->key[j] >> 4];
+            *p++ = digits[slot->key[j] & 0xf];
+        }
+        *p++ = '\n';
+        fwrite(line.data(), 1, p - line.data(), stdout);
     }
+    fflush(stdout);
+    Keychain::unmapKeyFile(image, imageSize);
+}
 
-    file.close();
+void Keychain::deleteKeys() {
+    // Names of the keys to delete, one per line
+    std::unordered_set<std::string> names;
+    std::string line;
+    while (readLine(line)) {
+        if (!line.empty() && line.back() == '\r') line.pop_back();
+        if (line.empty()) continue;
+        if (line.length() > KEYCHAIN_NAMELEN) {
+            printf("Key name \"%s\" is longer than %i characters.\n", line.c_str(), KEYCHAIN_NAMELEN);
+            continue;
+        }
+        line.resize(KEYCHAIN_NAMELEN, '\0');
+        names.insert(line);
+    }
+
+    size_t deleted = 0;
+    Keychain::updateKeyFile([&](std::vector<const KeychainSlot*>& slots) {
+        for (const KeychainSlot*& slot : slots) {
+            if (slot->flags & KEYSLOT_DELETED) continue;
+            if (names.count(std::string(slot->name, KEYCHAIN_NAMELEN)) == 0) continue;
+            slot = &_deletedSlot;
+            deleted++;
+        }
+    });
+    printf("Deleted %zu of %zu keys.\n", deleted, names.size());
 }
 
+void Keychain::compactKeys() {
+    size_t removed = 0, remaining = 0;
+    Keychain::updateKeyFile([&](std::vector<const KeychainSlot*>& slots) {
+        auto end = std::remove_if(slots.begin(), slots.end(), [](const KeychainSlot* slot) {
+            return (slot->flags & KEYSLOT_DELETED) != 0;
+        });
+        removed = slots.end() - end;
+        slots.erase(end, slots.end());
+        remaining = slots.size();
+    });
+    printf("Removed %zu deleted slots, %zu keys remain. Key indices may have changed.\n", removed, remaining);
+}
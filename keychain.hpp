@@ -1,10 +1,62 @@
 #ifndef _KEYCHAIN_HPP_
 #define _KEYCHAIN_HPP_
 
+#include <string>
 #include <vector>
-#include <array>
+#include <functional>
+#include <cstddef>
+#include <cstdint>
 
 #include "aes.h"
+#include "secmem.hpp"
+
+/*
+    Keychain file layout (all integers are stored in host byte order):
+
+    [KeychainHeader]  fixed size, starts with KEYCHAIN_MAGIC
+    [name index]      'indexSize' uint32_t buckets, open addressing on the
+                      FNV-1a hash of the key name. A bucket holds slot + 1,
+                      or 0 if it is empty.
+    [KeychainSlot]... 'keyCount' fixed stride key slots
+
+    Deleting a key only marks its slot KEYSLOT_DELETED and wipes it, so the
+    indices of the remaining keys stay the same. Compacting the keychain
+    drops deleted slots and renumbers the keys.
+
+    Older keychains (16 byte name, 32 byte key, '\n' per record) are
+    migrated to this format the first time they are opened.
+*/
+
+#define KEYCHAIN_MAGIC "XMSGKEYS"
+#define KEYCHAIN_VERSION 1
+#define KEYCHAIN_NAMELEN 16
+
+#define KEYSLOT_DELETED 0x1
+
+struct KeychainHeader
+{
+    char magic[8];
+    uint32_t version;
+    uint32_t headerSize;
+    uint32_t slotSize;
+    uint32_t keyCount;
+    uint32_t indexSize; // Always a power of two
+    uint32_t reserved0;
+    uint64_t indexOffset;
+    uint64_t slotsOffset;
+    uint8_t reserved1[16];
+};
+
+struct KeychainSlot
+{
+    char name[KEYCHAIN_NAMELEN];
+    uint8_t key[AES_KEYLEN];
+    uint32_t flags;
+    uint8_t reserved[12];
+};
+
+static_assert(sizeof(KeychainHeader) == 64, "KeychainHeader must be 64 bytes");
+static_assert(sizeof(KeychainSlot) == 64, "KeychainSlot must be 64 bytes");
 
 // Class that manages the xmsg encryption key file
 class Keychain
@@ -12,19 +64,51 @@ class Keychain
 private:
     int currentKeyIndex;
     std::vector<std::string> keyNames;
+    // The key file, mapped read-only
+    const uint8_t* image;
+    size_t imageSize;
 public:
     int getKeyIndex() const { return this->currentKeyIndex; }
     std::vector<std::string> getKeyNames() { this->loadKeyNames(); return this->keyNames; }
+    unsigned getKeyCount() const;
 public:
     Keychain(const int keyid);
-    std::array<uint8_t, AES_KEYLEN> getKey();
+    Keychain(const char* keyName);
+    ~Keychain();
+    Keychain(const Keychain&) = delete;
+    Keychain& operator=(const Keychain&) = delete;
+
+    // Copies the selected key into 'key', which should be secure memory
+    void getKey(uint8_t* key) const;
+    int findKey(const char* keyName) const;
     static void createKey();
     void deleteKey();
-    static void createKey(std::string keyName, std::array<uint8_t, AES_KEYLEN> key);
+    static void createKey(const std::string& keyName, const uint8_t* key);
+
+    // Bulk operations. Each one reads stdin and/or writes stdout, and makes
+    // a single pass over the keychain.
+    static void importKeys(const bool binary);
+    static void exportKeys(const bool binary);
+    static void deleteKeys();
+    static void compactKeys();
 private:
+    void open();
+    void close();
+    void selectKey(const int keyid);
+    const KeychainHeader* header() const { return (const KeychainHeader*)this->image; }
+    const KeychainSlot* slot(const unsigned i) const;
     void loadKeyNames();
+    void printKeys() const;
     static void createKeyFile();
+    static bool mapKeyFile(const uint8_t** image, size_t* imageSize);
+    static void unmapKeyFile(const uint8_t* image, const size_t imageSize);
+    static void migrateLegacyKeyFile();
+    // Applies 'update' to the current key slots and atomically replaces
+    // the key file with the result, holding the writer lock throughout.
+    // The slots are pointers into the mapped key file, so 'update' can
+    // drop, replace or append slots without copying any keys.
+    static void updateKeyFile(const std::function<void(std::vector<const KeychainSlot*>&)>& update);
+    static void writeKeyFile(const std::vector<const KeychainSlot*>& slots);
 };
 
 #endif
-
@@ -0,0 +1,178 @@
+#include "memory.hpp"
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cerrno>
+#include <atomic>
+#include <new>
+
+#ifdef __linux__
+#include <sys/resource.h>
+#endif
+
+static const char* _sourceNames[MEMORY_SOURCES] = {
+    "operator new",
+    "malloc",
+    "buffer pool",
+    "secure memory"
+};
+
+static std::atomic<uint64_t> _allocations[MEMORY_NOSTAGE + 1];
+static std::atomic<uint64_t> _bytes[MEMORY_NOSTAGE + 1];
+static std::atomic<uint64_t> _sourceAllocations[MEMORY_SOURCES];
+static std::atomic<uint64_t> _sourceBytes[MEMORY_SOURCES];
+static std::atomic<uint64_t> _rssGrowth[MEMORY_NOSTAGE + 1];
+static std::atomic<uint64_t> _lastPeak(0);
+static thread_local int _stage = MEMORY_NOSTAGE;
+
+bool Memory::enabled = false;
+thread_local unsigned MemoryUncounted::depth = 0;
+
+// Peak RSS in kB
+static uint64_t peakRss() {
+#ifdef __linux__
+    struct rusage usage;
+    if (getrusage(RUSAGE_SELF, &usage) == 0) return (uint64_t)usage.ru_maxrss;
+#endif
+    return 0;
+}
+
+void Memory::enable() {
+    _lastPeak = peakRss();
+    Memory::enabled = true;
+}
+
+void Memory::allocated(const MemorySource source, const size_t size) {
+    if (MemoryUncounted::depth > 0) return;
+    _allocations[_stage].fetch_add(1, std::memory_order_relaxed);
+    _bytes[_stage].fetch_add(size, std::memory_order_relaxed);
+    _sourceAllocations[source].fetch_add(1, std::memory_order_relaxed);
+    _sourceBytes[source].fetch_add(size, std::memory_order_relaxed);
+}
+
+int Memory::enterStage(const int stage) {
+    int previous = _stage;
+    _stage = stage;
+    return previous;
+}
+
+void Memory::leaveStage(const int stage, const int previous) {
+    _stage = previous;
+    uint64_t peak = peakRss();
+    uint64_t last = _lastPeak.load(std::memory_order_relaxed);
+    while (peak > last) {
+        if (_lastPeak.compare_exchange_weak(last, peak)) {
+            _rssGrowth[stage].fetch_add(peak - last, std::memory_order_relaxed);
+            break;
+        }
+    }
+}
+
+MemoryCounts Memory::stageCounts(const int stage) {
+    return { _allocations[stage].load(), _bytes[stage].load() };
+}
+
+MemoryCounts Memory::sourceCounts(const MemorySource source) {
+    return { _sourceAllocations[source].load(), _sourceBytes[source].load() };
+}
+
+const char* Memory::sourceName(const MemorySource source) {
+    return _sourceNames[source];
+}
+
+uint64_t Memory::stageRssGrowth(const int stage) {
+    return _rssGrowth[stage].load();
+}
+
+void Memory::readRss(uint64_t* peak, uint64_t* current) {
+    *peak = 0;
+    *current = 0;
+    FILE* f = fopen("/proc/self/status", "r");
+    if (f == NULL) return;
+    char line[128];
+    unsigned long long kb;
+    while (fgets(line, sizeof(line), f) != NULL) {
+        if (sscanf(line, "VmHWM: %llu kB", &kb) == 1) *peak = kb;
+        if (sscanf(line, "VmRSS: %llu kB", &kb) == 1) *current = kb;
+    }
+    fclose(f);
+}
+
+// malloc() hooks. glibc's own entry points do the work.
+#if defined(XMSG_MALLOC_HOOKS) && defined(__GLIBC__)
+extern "C" {
+void* __libc_malloc(size_t size);
+void* __libc_calloc(size_t count, size_t size);
+void* __libc_realloc(void* p, size_t size);
+void* __libc_memalign(size_t alignment, size_t size);
+
+void* malloc(size_t size) {
+    if (Memory::enabled) Memory::allocated(MEMORY_MALLOC, size);
+    return __libc_malloc(size);
+}
+
+void* calloc(size_t count, size_t size) {
+    if (Memory::enabled) Memory::allocated(MEMORY_MALLOC, count * size);
+    return __libc_calloc(count, size);
+}
+
+void* realloc(void* p, size_t size) {
+    if (Memory::enabled) Memory::allocated(MEMORY_MALLOC, size);
+    return __libc_realloc(p, size);
+}
+
+void* memalign(size_t alignment, size_t size) {
+    if (Memory::enabled) Memory::allocated(MEMORY_MALLOC, size);
+    return __libc_memalign(alignment, size);
+}
+
+void* aligned_alloc(size_t alignment, size_t size) {
+    return memalign(alignment, size);
+}
+
+int posix_memalign(void** p, size_t alignment, size_t size) {
+    if (alignment < sizeof(void*) || (alignment & (alignment - 1)) != 0) return EINVAL;
+    void* q = memalign(alignment, size);
+    if (q == NULL) return ENOMEM;
+    *p = q;
+    return 0;
+}
+}
+
+#define MEMORY_MALLOC_RAW __libc_malloc
+#else
+#define MEMORY_MALLOC_RAW malloc
+#endif
+
+// operator new, counted once. With the hooks, malloc() would count it again.
+static void* allocate(const size_t size, const bool nothrow) {
+    if (Memory::enabled) Memory::allocated(MEMORY_NEW, size);
+    while (true) {
+        void* p = MEMORY_MALLOC_RAW((size > 0) ? size : 1);
+        if (p != NULL) return p;
+        std::new_handler handler = std::get_new_handler();
+        if (handler == NULL) {
+            if (nothrow) return NULL;
+            throw std::bad_alloc();
+        }
+        handler();
+    }
+}
+
+void* operator new(size_t size) { return allocate(size, false); }
+void* operator new[](size_t size) { return allocate(size, false); }
+void* operator new(size_t size, const std::nothrow_t&) noexcept {
+    try {
+        return allocate(size, true);
+    } catch (...) {
+        return NULL;
+    }
+}
+void* operator new[](size_t size, const std::nothrow_t& nothrow) noexcept { return operator new(size, nothrow); }
+void operator delete(void* p) noexcept { free(p); }
+void operator delete[](void* p) noexcept { free(p); }
+void operator delete(void* p, size_t) noexcept { free(p); }
+void operator delete[](void* p, size_t) noexcept { free(p); }
+void operator delete(void* p, const std::nothrow_t&) noexcept { free(p); }
+void operator delete[](void* p, const std::nothrow_t&) noexcept { free(p); }
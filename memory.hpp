@@ -0,0 +1,81 @@
+#ifndef _MEMORY_HPP_
+#define _MEMORY_HPP_
+
+#include <cstddef>
+#include <cstdint>
+
+#include "stats.hpp"
+
+/*
+    Allocation accounting for --memory.
+
+    Every allocation is counted, with its size, against the --stats stage
+    the thread is in ("other" outside of any stage) and against where it
+    came from: operator new, malloc() and friends, the buffer pool (see
+    bufpool.hpp) or secure memory (see secmem.hpp). Pool and secure memory
+    allocations are counted as they are asked for, whether or not they
+    have to go to the system for it, and what they allocate underneath
+    isn't counted again.
+
+    malloc() is hooked by defining it on top of glibc's __libc_malloc(),
+    which static glibc doesn't allow (see MEMFLAGS in config.mk). Without
+    the hooks only operator new and the allocators above are counted.
+
+    Whenever a stage ends, the growth of the peak RSS since the last
+    sample (getrusage) is put down to that stage. With several threads,
+    that's whichever stage ended first. The report also has the peak and
+    current RSS from /proc/self/status.
+*/
+
+enum MemorySource {
+    MEMORY_NEW,
+    MEMORY_MALLOC,
+    MEMORY_POOL,
+    MEMORY_SECURE,
+    MEMORY_SOURCES
+};
+
+// Not a stage, for allocations outside of any
+#define MEMORY_NOSTAGE STATS_STAGES
+
+struct MemoryCounts
+{
+    uint64_t allocations;
+    uint64_t bytes;
+};
+
+class Memory
+{
+public:
+    static bool enabled;
+
+    static void enable();
+    static void allocated(const MemorySource source, const size_t size);
+    // Allocations are counted against 'stage' on this thread until
+    // leaveStage() is called with what this returns
+    static int enterStage(const int stage);
+    static void leaveStage(const int stage, const int previous);
+
+    static MemoryCounts stageCounts(const int stage);
+    static MemoryCounts sourceCounts(const MemorySource source);
+    static const char* sourceName(const MemorySource source);
+    // Growth of the peak RSS while 'stage' ran, in kB
+    static uint64_t stageRssGrowth(const int stage);
+    // VmHWM and VmRSS in kB, 0 if they aren't known
+    static void readRss(uint64_t* peak, uint64_t* current);
+};
+
+// Allocations made on this thread while one of these exists aren't
+// counted, for allocators that count themselves
+class MemoryUncounted
+{
+public:
+    static thread_local unsigned depth;
+
+    MemoryUncounted() { depth++; }
+    ~MemoryUncounted() { depth--; }
+    MemoryUncounted(const MemoryUncounted&) = delete;
+    MemoryUncounted& operator=(const MemoryUncounted&) = delete;
+};
+
+#endif
@@ -0,0 +1,985 @@
+#include "message.hpp"
+
+#include <cstdio>
+#include <cstring>
+#include <algorithm>
+
+#include "base64.hpp"
+#include "compress.hpp"
+#include "sha256.hpp"
+#include "secmem.hpp"
+#include "stats.hpp"
+#include "xmsg.hpp"
+
+static bool isBase64Space(const char c) {
+    return c == '\n' || c == '\r' || c == ' ' || c == '\t';
+}
+
+// Incremental base64 decoder for input that is split at arbitrary points
+class Base64StreamDecoder
+{
+private:
+    char carry[4];
+    unsigned carryLength;
+    bool padded;
+public:
+    Base64StreamDecoder() { this->reset(); }
+    void reset() { this->carryLength = 0; this->padded = false; }
+    bool complete() const { return this->carryLength == 0; }
+
+    // Decodes 'length' characters into 'out', which must have room for
+    // length / 4 * 3 + 3 bytes. Returns the number of bytes, or -1.
+    long decode(const char* in, const size_t length, uint8_t* out) {
+        size_t produced = 0, i = 0;
+        while (i < length) {
+            if (isBase64Space(in[i])) {
+                i++;
+                continue;
+            }
+            // Nothing may follow the padding
+            if (this->padded) return -1;
+
+            if (this->carryLength > 0 || length - i < 4) {
+                this->carry[this->carryLength++] = in[i++];
+                if (this->carryLength == 4) {
+                    size_t n = base64_decode_block(this->carry, 4, out + produced);
+                    if (n == (size_t)-1) return -1;
+                    this->padded = n < 3;
+                    produced += n;
+                    this->carryLength = 0;
+                }
+                continue;
+            }
+
+            size_t run = i;
+            while (run < length && !isBase64Space(in[run])) run++;
+            size_t bulk = (run - i) & ~(size_t)3;
+            if (bulk == 0) {
+                this->carry[this->carryLength++] = in[i++];
+                continue;
+            }
+            size_t n = base64_decode_block(in + i, bulk, out + produced);
+            if (n == (size_t)-1) return -1;
+            this->padded = n < bulk / 4 * 3;
+            produced += n;
+            i += bulk;
+        }
+        return (long)produced;
+    }
+};
+
+// Incremental base64 encoder
+class Base64StreamEncoder
+{
+private:
+    uint8_t carry[2];
+    unsigned carryLength;
+public:
+    Base64StreamEncoder() : carryLength(0) {}
+
+    void encode(const uint8_t* in, size_t length, PoolString& out) {
+        char group[4];
+        while (this->carryLength > 0 && length > 0) {
+            if (this->carryLength == 2) {
+                uint8_t block[3] = { this->carry[0], this->carry[1], *in };
+                base64_encode_block(block, 3, group);
+                out.append(group, 4);
+                this->carryLength = 0;
+            } else {
+                this->carry[1] = *in;
+                this->carryLength = 2;
+            }
+            in++;
+            length--;
+        }
+        size_t bulk = length / 3 * 3;
+        if (bulk > 0) {
+            size_t offset = out.size();
+            out.resize(offset + bulk / 3 * 4);
+            base64_encode_block(in, bulk, &out[offset]);
+        }
+        if (length > bulk) {
+            // Only reached with an empty carry
+            memcpy(this->carry, in + bulk, length - bulk);
+            this->carryLength = (unsigned)(length - bulk);
+        }
+    }
+
+    void finish(PoolString& out) {
+        char group[4];
+        if (this->carryLength > 0) {
+            base64_encode_block(this->carry, this->carryLength, group);
+            out.append(group, 4);
+        }
+        this->carryLength = 0;
+    }
+};
+
+// Key material of a message, kept in secure memory
+struct EnvelopeKeys {
+    AES_key data;
+    uint8_t dataKey[AES_KEYLEN];
+    uint8_t macKey[SHA256_DIGESTLEN];
+};
+
+// Secure memory for encrypting messages. Processors keep one for all the
+// messages they encrypt, instead of allocating it for each of them.
+struct MessageScratch {
+    // Tiles are encrypted in place, so nothing is left in them in the clear
+    SecureVector<uint8_t> tile;
+    SecurePtr<EnvelopeKeys> keys;
+    SecurePtr<HmacSha256> hmac;
+};
+
+// The first AES_KEYLEN bytes of an AES-256 key schedule are the key itself
+static const uint8_t* rawKey(const AES_key* key) {
+    return key->RoundKey;
+}
+
+// The MAC key is derived from the key the payload is encrypted with, the
+// keychain key or the data key of envelope messages
+static void deriveMacKey(const uint8_t* key, uint8_t* macKey) {
+    static const char label[] = "xmsg HMAC-SHA256 key";
+    StatsTimer timer(STATS_MAC);
+    HmacSha256 hmac(key, AES_KEYLEN);
+    hmac.update(label, sizeof(label) - 1);
+    hmac.final(macKey);
+}
+
+static void computeTag(const uint8_t* macKey, const uint8_t* data, const size_t length, uint8_t* tag) {
+    StatsTimer timer(STATS_MAC, length);
+    HmacSha256 hmac(macKey, SHA256_DIGESTLEN);
+    hmac.update(data, length);
+    hmac.final(tag);
+}
+
+void getKeyId(const AES_key* key, uint8_t* keyId) {
+    // The start of E(0)
+    StatsTimer timer(STATS_KEYEXPANSION);
+    uint8_t iv[AES_BLOCKLEN] = { 0 };
+    uint8_t block[AES_BLOCKLEN] = { 0 };
+    AES_CBC_encrypt_stream(key, iv, block, AES_BLOCKLEN);
+    memcpy(keyId, block, MESSAGE_KEYIDLEN);
+}
+
+// Encrypts ('encrypt' == true) or decrypts the data key of an envelope
+// message with 'key', using the message IV.
+static void wrapDataKey(const AES_key* key, const uint8_t* IV, const uint8_t* in, uint8_t* out, const bool encrypt) {
+    StatsTimer timer(STATS_AES, AES_KEYLEN);
+    uint8_t iv[AES_BLOCKLEN];
+    memcpy(iv, IV, AES_BLOCKLEN);
+    memcpy(out, in, AES_KEYLEN);
+    if (encrypt) {
+        AES_CBC_encrypt_stream(key, iv, out, AES_KEYLEN);
+    } else {
+        AES_CBC_decrypt_stream(key, iv, out, AES_KEYLEN);
+    }
+}
+
+// Tag character of a compact message with the given flags
+static char compactTag(const unsigned flags) {
+    return MESSAGE_COMPACT_TAGS[((flags & MESSAGE_COMPRESSED) ? 1 : 0) | ((flags & MESSAGE_MAC) ? 2 : 0)];
+}
+
+// Flags of a compact message that starts with 'c', or -1 if it isn't a tag.
+// The MAC covers the tag character, so the options of a MESSAGE_MAC message
+// can't be changed while it keeps its MAC. Changing the tag to one without
+// MESSAGE_MAC, and cutting off the MAC, is only caught when the reader
+// requires MESSAGE_MAC.
+static int compactFlags(const char c) {
+    const char* tag = (c != '\0') ? strchr(MESSAGE_COMPACT_TAGS, c) : NULL;
+    if (tag == NULL) return -1;
+    int suite = (int)(tag - MESSAGE_COMPACT_TAGS);
+    return ((suite & 1) ? MESSAGE_COMPRESSED : 0) | ((suite & 2) ? MESSAGE_MAC : 0);
+}
+
+// Length of the encrypted payload
+static size_t cipherLength(const MessageHeader& header) {
+    if (header.version == MESSAGE_COMPACT_VERSION) return std::max((size_t)header.length, (size_t)AES_BLOCKLEN);
+    return (header.length + AES_BLOCKLEN - 1) / AES_BLOCKLEN * AES_BLOCKLEN;
+}
+
+// Length of the end of the payload that ciphertext stealing encrypts, the
+// last whole block and the partial one after it. 0 if nothing is stolen.
+static size_t stolenLength(const MessageHeader& header) {
+    if (header.version != MESSAGE_COMPACT_VERSION || header.length < AES_BLOCKLEN || header.length % AES_BLOCKLEN == 0) {
+        return 0;
+    }
+    return AES_BLOCKLEN + header.length % AES_BLOCKLEN;
+}
+
+static size_t macLength(const MessageHeader& header) {
+    if (!(header.flags & MESSAGE_MAC)) return 0;
+    return (header.version == MESSAGE_COMPACT_VERSION) ? MESSAGE_COMPACT_TAGLEN : SHA256_DIGESTLEN;
+}
+
+// Ciphertext stealing (CBC-CS2) of the stolenLength() bytes at the end of
+// a payload, in place. The partial block is padded with zeros and
+// encrypted like any other, then the last two blocks swap places and the
+// padding is dropped.
+static void encryptStolen(const AES_key* key, uint8_t* iv, uint8_t* data, const size_t length) {
+    uint8_t blocks[2 * AES_BLOCKLEN] = { 0 };
+    memcpy(blocks, data, length);
+    AES_CBC_encrypt_stream(key, iv, blocks, sizeof(blocks));
+    memcpy(data, blocks + AES_BLOCKLEN, AES_BLOCKLEN);
+    memcpy(data + AES_BLOCKLEN, blocks, length - AES_BLOCKLEN);
+}
+
+static void decryptStolen(const AES_key* key, uint8_t* iv, uint8_t* data, const size_t length) {
+    const size_t partial = length - AES_BLOCKLEN;
+    uint8_t blocks[2 * AES_BLOCKLEN];
+    // The last block decrypts to the partial block and its zero padding,
+    // XORed with the ciphertext of the block before. The padding gives
+    // back the end of that ciphertext.
+    uint8_t zero[AES_BLOCKLEN] = { 0 };
+    memcpy(blocks + AES_BLOCKLEN, data, AES_BLOCKLEN);
+    AES_CBC_decrypt_stream(key, zero, blocks + AES_BLOCKLEN, AES_BLOCKLEN);
+    memcpy(blocks, data + AES_BLOCKLEN, partial);
+    memcpy(blocks + partial, blocks + AES_BLOCKLEN + partial, AES_BLOCKLEN - partial);
+    for (size_t i = 0; i < partial; i++) {
+        blocks[AES_BLOCKLEN + i] ^= blocks[i];
+    }
+    AES_CBC_decrypt_stream(key, iv, blocks, AES_BLOCKLEN);
+    memcpy(data, blocks, length);
+    SecureMemory::zero(blocks, sizeof(blocks));
+}
+
+// Writes the header of a message, including the recipient count of
+// envelope messages. Returns its size.
+static size_t writeHeader(const MessageHeader& header, const unsigned recipients, uint8_t* out) {
+    if (header.version == MESSAGE_COMPACT_VERSION) {
+        size_t n = 0;
+        uint32_t length = header.length;
+        do {
+            out[n++] = (uint8_t)((length & 0x7F) | ((length > 0x7F) ? 0x80 : 0));
+            length >>= 7;
+        } while (length > 0);
+        memcpy(out + n, header.IV, AES_BLOCKLEN);
+        return n + AES_BLOCKLEN;
+    }
+    if (header.version == MESSAGE_LEGACY_VERSION) {
+        AESMetadata* md = (AESMetadata*)out;
+        md->messageLength = (uint16_t)header.length;
+        memcpy(md->IV, header.IV, AES_BLOCKLEN);
+        return sizeof(AESMetadata);
+    }
+    memcpy(out, &header, sizeof(MessageHeader));
+    if (header.flags & MESSAGE_ENVELOPE) {
+        out[sizeof(MessageHeader)] = (uint8_t)recipients;
+        return sizeof(MessageHeader) + 1;
+    }
+    return sizeof(MessageHeader);
+}
+
+static void encodeHeader(const uint8_t* head, const size_t length, HmacSha256* hmac, Base64StreamEncoder& encoder, PoolString& out) {
+    if (hmac != NULL) {
+        StatsTimer timer(STATS_MAC, length);
+        hmac->update(head, length);
+    }
+    StatsTimer timer(STATS_BASE64, length);
+    encoder.encode(head, length, out);
+}
+
+// Encrypts the payload and pads it to 'msgLen'. Each tile is encrypted,
+// authenticated and encoded while it's in cache.
+static void encryptTiles(const AES_key* key, uint8_t* iv, const uint8_t* payload, const size_t payloadLen, const size_t msgLen,
+    SecureVector<uint8_t>& tile, HmacSha256* hmac, Base64StreamEncoder& encoder, PoolString& out)
+{
+    if (msgLen == 0) return;
+    const size_t tileLen = std::min(msgLen, (size_t)MESSAGE_TILELEN);
+    if (tile.size() < tileLen) tile.resize(tileLen);
+    for (size_t done = 0; done < msgLen; done += tileLen) {
+        size_t n = std::min(msgLen - done, tileLen);
+        size_t plain = std::min(n, payloadLen - std::min(payloadLen, done));
+        memcpy(tile.data(), payload + done, plain);
+        // Random bytes fill in the extra space at the end of the message
+        if (plain < n) Application::generateRandomBytes(tile.data() + plain, n - plain);
+        {
+            StatsTimer timer(STATS_AES, n);
+            AES_CBC_encrypt_stream(key, iv, tile.data(), (uint32_t)n);
+        }
+        if (hmac != NULL) {
+            StatsTimer timer(STATS_MAC, n);
+            hmac->update(tile.data(), n);
+        }
+        StatsTimer timer(STATS_BASE64, n);
+        encoder.encode(tile.data(), n, out);
+    }
+}
+
+// Encrypts the payload, with ciphertext stealing at the end if the header
+// asks for it
+static void encryptPayload(const AES_key* key, uint8_t* iv, const MessageHeader& header, const uint8_t* payload,
+    SecureVector<uint8_t>& tile, HmacSha256* hmac, Base64StreamEncoder& encoder, PoolString& out)
+{
+    const size_t stolen = stolenLength(header);
+    const size_t head = cipherLength(header) - stolen;
+    encryptTiles(key, iv, payload, std::min((size_t)header.length, head), head, tile, hmac, encoder, out);
+    if (stolen == 0) return;
+
+    uint8_t tail[2 * AES_BLOCKLEN];
+    memcpy(tail, payload + head, stolen);
+    {
+        StatsTimer timer(STATS_AES, stolen);
+        encryptStolen(key, iv, tail, stolen);
+    }
+    if (hmac != NULL) {
+        StatsTimer timer(STATS_MAC, stolen);
+        hmac->update(tail, stolen);
+    }
+    StatsTimer timer(STATS_BASE64, stolen);
+    encoder.encode(tail, stolen, out);
+}
+
+static void encryptMessage(const AES_key* key, const MessageOptions& options, const uint8_t* msg, const size_t length,
+    MessageScratch& scratch, PoolString& out)
+{
+    const bool envelope = (options.flags & MESSAGE_ENVELOPE) != 0;
+    const bool compact = (options.flags & MESSAGE_COMPACT) != 0;
+    MessageHeader header;
+    header.marker = MESSAGE_EXTENDED;
+    if (compact) {
+        header.version = MESSAGE_COMPACT_VERSION;
+    } else {
+        header.version = (options.flags == 0) ? MESSAGE_LEGACY_VERSION : MESSAGE_VERSION;
+    }
+    header.flags = (uint8_t)(options.flags & MESSAGE_FLAGS);
+    Application::generateRandomBytes(header.IV, AES_BLOCKLEN);
+    const bool mac = (options.flags & MESSAGE_MAC) != 0;
+
+    // Compression needs the whole message, everything else goes tile by tile
+    const uint8_t* payload = msg;
+    size_t payloadLen = length;
+    SecureVector<uint8_t> compressed;
+    if (options.flags & MESSAGE_COMPRESSED) {
+        StatsTimer timer(STATS_COMPRESSION, length);
+        compressed.resize(compressBound(length));
+        payloadLen = compress(msg, length, compressed.data());
+        payload = compressed.data();
+    }
+    header.length = (uint32_t)payloadLen;
+
+    // Compact headers only have their length once the payload's is known
+    std::vector<uint8_t> head(sizeof(MessageHeader) + 1 + options.recipients.size() * sizeof(EnvelopeRecipient));
+    size_t offset = writeHeader(header, (unsigned)options.recipients.size(), head.data());
+    const size_t headerLen = offset + options.recipients.size() * sizeof(EnvelopeRecipient);
+    const size_t total = headerLen + cipherLength(header) + macLength(header);
+    out.reserve(out.size() + (compact ? 1 : 0) + (total + 2) / 3 * 4);
+
+    const AES_key* payloadKey = key;
+    uint8_t iv[AES_BLOCKLEN];
+    memcpy(iv, header.IV, AES_BLOCKLEN);
+    EnvelopeKeys* keys = NULL;
+    if (envelope || mac) {
+        if (!scratch.keys) scratch.keys = makeSecure<EnvelopeKeys>();
+        keys = scratch.keys.get();
+    }
+    if (envelope) {
+        // Encrypt the payload once, under a new data key that each
+        // recipient can decrypt
+        Application::generateRandomBytes(keys->dataKey, AES_KEYLEN);
+        for (const MessageRecipient& recipient : options.recipients) {
+            EnvelopeRecipient* entry = (EnvelopeRecipient*)(head.data() + offset);
+            memcpy(entry->keyId, recipient.keyId, MESSAGE_KEYIDLEN);
+            wrapDataKey(recipient.key, header.IV, keys->dataKey, entry->dataKey, true);
+            offset += sizeof(EnvelopeRecipient);
+        }
+        StatsTimer timer(STATS_KEYEXPANSION, AES_KEYLEN);
+        AES_init_key(&keys->data, keys->dataKey);
+        payloadKey = &keys->data;
+    }
+
+    Base64StreamEncoder encoder;
+    const char tag = compactTag(header.flags);
+    if (compact) out.push_back(tag);
+    if (!mac) {
+        encodeHeader(head.data(), headerLen, NULL, encoder, out);
+        encryptPayload(payloadKey, iv, header, payload, scratch.tile, NULL, encoder, out);
+    } else {
+        // Encrypt-then-MAC: the tag covers the header and the ciphertext
+        deriveMacKey(envelope ? keys->dataKey : rawKey(key), keys->macKey);
+        if (!scratch.hmac) scratch.hmac = makeSecure<HmacSha256>();
+        HmacSha256* hmac = scratch.hmac.get();
+        hmac->init(keys->macKey, SHA256_DIGESTLEN);
+        if (compact) hmac->update(&tag, 1);
+        encodeHeader(head.data(), headerLen, hmac, encoder, out);
+        encryptPayload(payloadKey, iv, header, payload, scratch.tile, hmac, encoder, out);
+        uint8_t digest[SHA256_DIGESTLEN];
+        {
+            StatsTimer timer(STATS_MAC);
+            hmac->final(digest);
+        }
+        SecureMemory::zero(hmac, sizeof(HmacSha256));
+        StatsTimer timer(STATS_BASE64, macLength(header));
+        encoder.encode(digest, macLength(header), out);
+    }
+    if (keys != NULL) SecureMemory::zero(keys, sizeof(EnvelopeKeys));
+    StatsTimer timer(STATS_BASE64);
+    encoder.finish(out);
+}
+
+void encryptMessage(const AES_key* key, const MessageOptions& options, const uint8_t* msg, const size_t length, PoolString& out) {
+    MessageScratch scratch;
+    encryptMessage(key, options, msg, length, scratch, out);
+}
+
+class EncryptProcessor : public RecordProcessor
+{
+private:
+    const AES_key* key;  // NULL when only encrypting for recipients
+    MessageOptions options;
+    SecureVector<uint8_t> plaintext;
+    MessageScratch scratch;
+public:
+    EncryptProcessor(const AES_key* key, const MessageOptions& options) :
+        key(key),
+        options(options)
+    {}
+
+    bool feed(const char* data, size_t length, PoolString& out) override {
+        if (this->plaintext.size() + length > this->options.maxLength()) {
+            fprintf(stderr, "Messages are limited to %zu bytes.\n", this->options.maxLength());
+            return false;
+        }
+        this->plaintext.insert(this->plaintext.end(), (const uint8_t*)data, (const uint8_t*)data + length);
+        return true;
+    }
+
+    bool finish(PoolString& out) override {
+        encryptMessage(this->key, this->options, this->plaintext.data(), this->plaintext.size(), this->scratch, out);
+        out.push_back('\n');
+        SecureMemory::zero(this->plaintext.data(), this->plaintext.size());
+        this->plaintext.clear();
+        return true;
+    }
+};
+
+// Decodes and decrypts a message chunk by chunk. Subclasses decide what
+// happens to the header and to the decrypted blocks.
+class MessageStreamProcessor : public RecordProcessor
+{
+protected:
+    const AES_key* key;
+    MessageHeader header;
+    char compactTag;  // '\0' unless it's a compact message
+    unsigned recipients;
+    // Set by subclasses to get the payload through onCiphertext, undecrypted
+    bool passthrough;
+private:
+    enum State { STATE_HEADER, STATE_RECIPIENTS, STATE_PAYLOAD };
+    // Whether messages without MESSAGE_MAC are invalid. Otherwise a MAC'd
+    // message can have its tag cut off and be relabelled unauthenticated.
+    bool requireMac;
+    bool started;  // Past the tag character, if there is one
+    Base64StreamDecoder decoder;
+    SecureVector<uint8_t> buffer;
+    size_t buffered;
+    size_t touched;  // How much of 'buffer' has been used since it was zeroed
+    State state;
+    uint8_t keyId[MESSAGE_KEYIDLEN];
+    unsigned recipientsLeft;
+    SecurePtr<EnvelopeKeys> keys;
+    const AES_key* payloadKey;
+    uint8_t iv[AES_BLOCKLEN];
+    size_t decrypted;
+    // MESSAGE_MAC messages are held back until their tag is checked. The
+    // tag is computed as they come in.
+    PoolVector<uint8_t> sealed;
+    SecurePtr<HmacSha256> hmac;  // Reused for every message
+    bool authenticating;  // Whether 'hmac' has been started on this message
+    size_t payloadOffset;
+    uint8_t tag[SHA256_DIGESTLEN];
+    size_t tagLength;
+public:
+    MessageStreamProcessor(const AES_key* key, const bool requireMac) :
+        key(key),
+        compactTag('\0'),
+        recipients(0),
+        passthrough(false),
+        requireMac(requireMac),
+        started(false),
+        buffer(MESSAGE_CHUNKLEN + sizeof(MessageHeader) + sizeof(EnvelopeRecipient)),
+        buffered(0),
+        touched(0),
+        state(STATE_HEADER),
+        recipientsLeft(0),
+        keys(makeSecure<EnvelopeKeys>()),
+        payloadKey(NULL),
+        decrypted(0),
+        hmac(makeSecure<HmacSha256>()),
+        authenticating(false),
+        payloadOffset(0),
+        tagLength(0)
+    {
+        getKeyId(key, this->keyId);
+    }
+
+    bool feed(const char* data, size_t length, PoolString& out) override {
+        if (!this->started) {
+            while (length > 0 && isBase64Space(*data)) {
+                data++;
+                length--;
+            }
+            if (length == 0) return true;
+            this->started = true;
+            if (compactFlags(*data) >= 0) {
+                this->compactTag = *data;
+                data++;
+                length--;
+            }
+        }
+        while (length > 0) {
+            size_t n = (length < MESSAGE_CHUNKLEN) ? length : MESSAGE_CHUNKLEN;
+            long decoded;
+            {
+                StatsTimer timer(STATS_BASE64, n);
+                decoded = this->decoder.decode(data, n, this->buffer.data() + this->buffered);
+            }
+            if (decoded < 0) return false;
+            this->buffered += decoded;
+            this->touched = std::max(this->touched, this->buffered);
+            data += n;
+            length -= n;
+            if (!this->process(out)) return false;
+        }
+        return true;
+    }
+
+    bool finish(PoolString& out) override {
+        // Nothing but whitespace was fed, so nothing needs resetting
+        if (!this->started) return this->onEmpty(out);
+        bool valid = this->state == STATE_PAYLOAD && this->buffered == 0 && this->decoder.complete();
+        if (valid && (this->header.flags & MESSAGE_MAC)) {
+            valid = this->openSealed(out);
+        }
+        if (valid) {
+            valid = this->decrypted >= this->header.length && this->onFinish(out);
+        }
+        SecureMemory::zero(this->buffer.data(), this->touched);
+        this->touched = 0;
+        SecureMemory::zero(this->keys.get(), sizeof(EnvelopeKeys));
+        this->decoder.reset();
+        this->started = false;
+        this->compactTag = '\0';
+        this->buffered = 0;
+        this->state = STATE_HEADER;
+        this->passthrough = false;
+        this->payloadKey = NULL;
+        this->decrypted = 0;
+        this->sealed.clear();
+        if (this->authenticating) SecureMemory::zero(this->hmac.get(), sizeof(HmacSha256));
+        this->authenticating = false;
+        this->tagLength = 0;
+        return valid;
+    }
+protected:
+    size_t remaining() const { return this->header.length - std::min(this->decrypted, (size_t)this->header.length); }
+    virtual void onHeader(PoolString& out) = 0;
+    // 'dataKey' is the decrypted data key if 'entry' is for our key, else NULL
+    virtual void onRecipient(const EnvelopeRecipient* entry, const uint8_t* dataKey, PoolString& out) {}
+    // Both return false if the message turns out to be invalid
+    virtual bool onPlaintext(uint8_t* data, size_t length, PoolString& out) = 0;
+    virtual void onCiphertext(const uint8_t* data, size_t length, PoolString& out) {}
+    virtual bool onFinish(PoolString& out) = 0;
+    // For a record without a message in it. Returns false if that's invalid.
+    virtual bool onEmpty(PoolString& out) { return false; }
+private:
+    // Parses the header at the start of 'p'. Returns its size, 0 if more
+    // input is needed or -1 if it's invalid.
+    long parseHeader(const uint8_t* p, const size_t available) {
+        if (this->compactTag != '\0') return this->parseCompactHeader(p, available);
+        if (available < sizeof(uint16_t)) return 0;
+        const AESMetadata* md = (const AESMetadata*)p;
+        if (md->messageLength == MESSAGE_EXTENDED) {
+            if (available < sizeof(MessageHeader)) return 0;
+            memcpy(&this->header, p, sizeof(MessageHeader));
+        }
+        // Legacy messages could be 65535 bytes long, before that length
+        // became MESSAGE_EXTENDED. Those are told apart by the rest of the
+        // header, which isn't a valid MessageHeader.
+        if (md->messageLength != MESSAGE_EXTENDED || this->header.version != MESSAGE_VERSION ||
+            (this->header.flags & ~MESSAGE_FLAGS) != 0 || this->header.length > MESSAGE_MAXLEN_EXTENDED) {
+            if (available < sizeof(AESMetadata)) return 0;
+            this->header.marker = MESSAGE_EXTENDED;
+            this->header.version = MESSAGE_LEGACY_VERSION;
+            this->header.flags = 0;
+            this->header.length = md->messageLength;
+            memcpy(this->header.IV, md->IV, AES_BLOCKLEN);
+            this->recipients = 0;
+            return sizeof(AESMetadata);
+        }
+
+        if (!(this->header.flags & MESSAGE_ENVELOPE)) {
+            this->recipients = 0;
+            return sizeof(MessageHeader);
+        }
+        if (available < sizeof(MessageHeader) + 1) return 0;
+        this->recipients = p[sizeof(MessageHeader)];
+        return (this->recipients > 0) ? (long)sizeof(MessageHeader) + 1 : -1;
+    }
+
+    long parseCompactHeader(const uint8_t* p, const size_t available) {
+        uint64_t length = 0;
+        size_t n = 0;
+        while (true) {
+            if (n == available) return 0;
+            if (n == MESSAGE_VARINTLEN) return -1;
+            uint8_t b = p[n];
+            length |= (uint64_t)(b & 0x7F) << (7 * n);
+            n++;
+            if (!(b & 0x80)) {
+                // Only the shortest encoding is valid
+                if (b == 0 && n > 1) return -1;
+                break;
+            }
+        }
+        if (length > MESSAGE_MAXLEN_EXTENDED) return -1;
+        if (available < n + AES_BLOCKLEN) return 0;
+        this->header.marker = MESSAGE_EXTENDED;
+        this->header.version = MESSAGE_COMPACT_VERSION;
+        this->header.flags = (uint8_t)compactFlags(this->compactTag);
+        this->header.length = (uint32_t)length;
+        memcpy(this->header.IV, p + n, AES_BLOCKLEN);
+        this->recipients = 0;
+        return (long)(n + AES_BLOCKLEN);
+    }
+
+    // Consumes as much of the buffered input as possible
+    bool process(PoolString& out) {
+        uint8_t* p = this->buffer.data();
+        size_t available = this->buffered;
+
+        if (this->state == STATE_HEADER) {
+            long used = this->parseHeader(p, available);
+            if (used < 0) return false;
+            if (used == 0) return true;
+            if (this->requireMac && !(this->header.flags & MESSAGE_MAC)) {
+                fprintf(stderr, "The message isn't authenticated.\n");
+                return false;
+            }
+            if (this->compactTag != '\0') this->seal((const uint8_t*)&this->compactTag, 1);
+            this->seal(p, used);
+            p += used;
+            available -= used;
+            this->onHeader(out);
+            if (this->recipients > 0) {
+                this->state = STATE_RECIPIENTS;
+                this->recipientsLeft = this->recipients;
+            } else {
+                this->payloadKey = this->key;
+                memcpy(this->iv, this->header.IV, AES_BLOCKLEN);
+                this->startPayload(rawKey(this->key));
+            }
+        }
+
+        while (this->state == STATE_RECIPIENTS && available >= sizeof(EnvelopeRecipient)) {
+            const EnvelopeRecipient* entry = (const EnvelopeRecipient*)p;
+            const uint8_t* dataKey = NULL;
+            // The first entry for our key wins
+            if (this->payloadKey == NULL && memcmp(entry->keyId, this->keyId, MESSAGE_KEYIDLEN) == 0) {
+                wrapDataKey(this->key, this->header.IV, entry->dataKey, this->keys->dataKey, false);
+                StatsTimer timer(STATS_KEYEXPANSION, AES_KEYLEN);
+                AES_init_key(&this->keys->data, this->keys->dataKey);
+                memcpy(this->iv, this->header.IV, AES_BLOCKLEN);
+                this->payloadKey = &this->keys->data;
+                dataKey = this->keys->dataKey;
+            }
+            this->onRecipient(entry, dataKey, out);
+            this->seal(p, sizeof(EnvelopeRecipient));
+            p += sizeof(EnvelopeRecipient);
+            available -= sizeof(EnvelopeRecipient);
+
+            if (--this->recipientsLeft == 0) {
+                if (this->payloadKey == NULL) {
+                    fprintf(stderr, "The message wasn't encrypted for this key.\n");
+                    return false;
+                }
+                this->startPayload(this->keys->dataKey);
+            }
+        }
+
+        if (this->state == STATE_PAYLOAD && (this->header.flags & MESSAGE_MAC)) {
+            // Keep the ciphertext, then the tag, without decrypting anything
+            size_t n = std::min(available, this->payloadOffset + cipherLength(this->header) - this->sealed.size());
+            this->seal(p, n);
+            p += n;
+            available -= n;
+            n = std::min(available, macLength(this->header) - this->tagLength);
+            memcpy(this->tag + this->tagLength, p, n);
+            this->tagLength += n;
+            p += n;
+            available -= n;
+            // Nothing comes after the tag
+            if (available > 0) return false;
+        } else if (this->state == STATE_PAYLOAD) {
+            size_t n = available / AES_BLOCKLEN * AES_BLOCKLEN;
+            if (this->header.version == MESSAGE_COMPACT_VERSION) {
+                // Nothing comes after the payload, and the blocks that
+                // ciphertext stealing swapped are decrypted together
+                size_t left = cipherLength(this->header) - this->decrypted;
+                n = (available >= left) ? left : std::min(n, left - stolenLength(this->header));
+            }
+            if (!this->decryptPayload(p, n, out)) return false;
+            p += n;
+            available -= n;
+        }
+
+        memmove(this->buffer.data(), p, available);
+        this->buffered = available;
+        return true;
+    }
+
+    void seal(const uint8_t* data, const size_t length) {
+        if (this->header.flags & MESSAGE_MAC) {
+            this->sealed.insert(this->sealed.end(), data, data + length);
+            if (this->authenticating) {
+                StatsTimer timer(STATS_MAC, length);
+                this->hmac->update(data, length);
+            }
+        }
+    }
+
+    // 'key' is the key the payload is encrypted with
+    void startPayload(const uint8_t* key) {
+        this->state = STATE_PAYLOAD;
+        if (this->header.flags & MESSAGE_MAC) {
+            deriveMacKey(key, this->keys->macKey);
+            this->payloadOffset = this->sealed.size();
+            // Catch up on the header, the payload is added as it's sealed
+            StatsTimer timer(STATS_MAC, this->sealed.size());
+            this->hmac->init(this->keys->macKey, SHA256_DIGESTLEN);
+            this->authenticating = true;
+            this->hmac->update(this->sealed.data(), this->sealed.size());
+        }
+    }
+
+    // Decrypts 'n' bytes of the payload and hands them on. That's whole
+    // blocks, and the stolen end of the payload only all at once.
+    bool decryptPayload(uint8_t* p, const size_t n, PoolString& out) {
+        if (this->passthrough) {
+            this->onCiphertext(p, n, out);
+            this->decrypted += n;
+            return true;
+        }
+        size_t stolen = stolenLength(this->header);
+        if (this->decrypted + n != cipherLength(this->header)) stolen = 0;
+        size_t blocks = n - stolen;
+        if (blocks > 0) {
+            {
+                StatsTimer timer(STATS_AES, blocks);
+                AES_CBC_decrypt_stream(this->payloadKey, this->iv, p, blocks);
+            }
+            if (!this->onPlaintext(p, blocks, out)) return false;
+            this->decrypted += blocks;
+        }
+        if (stolen > 0) {
+            {
+                StatsTimer timer(STATS_AES, stolen);
+                decryptStolen(this->payloadKey, this->iv, p + blocks, stolen);
+            }
+            if (!this->onPlaintext(p + blocks, stolen, out)) return false;
+            this->decrypted += stolen;
+        }
+        return true;
+    }
+
+    // Checks the tag of a MESSAGE_MAC message, and only then decrypts it
+    bool openSealed(PoolString& out) {
+        if (this->tagLength != macLength(this->header) ||
+            this->sealed.size() != this->payloadOffset + cipherLength(this->header)) {
+            return false;
+        }
+        uint8_t expected[SHA256_DIGESTLEN];
+        {
+            StatsTimer timer(STATS_MAC);
+            this->hmac->final(expected);
+        }
+        if (!tagsEqual(expected, this->tag, macLength(this->header))) {
+            fprintf(stderr, "Message authentication failed.\n");
+            return false;
+        }
+
+        const size_t stolen = stolenLength(this->header);
+        for (size_t offset = this->payloadOffset, n; offset < this->sealed.size(); offset += n) {
+            size_t left = this->sealed.size() - offset;
+            n = std::min(left, (size_t)MESSAGE_CHUNKLEN);
+            // The stolen end goes in one piece
+            if (n < left && left - n < stolen) n = left - stolen;
+            uint8_t* p = this->sealed.data() + offset;
+            if (!this->passthrough) {
+                memcpy(this->buffer.data(), p, n);
+                this->touched = std::max(this->touched, n);
+                p = this->buffer.data();
+            }
+            if (!this->decryptPayload(p, n, out)) return false;
+        }
+        return true;
+    }
+};
+
+class DecryptProcessor : public MessageStreamProcessor
+{
+private:
+    bool newline;
+    Decompressor decompressor;
+public:
+    DecryptProcessor(const AES_key* key, const bool requireMac, const bool newline) :
+        MessageStreamProcessor(key, requireMac),
+        newline(newline)
+    {}
+protected:
+    void onHeader(PoolString& out) override {}
+    bool onPlaintext(uint8_t* data, size_t length, PoolString& out) override {
+        // Drop the padding
+        length = std::min(length, this->remaining());
+        if (this->header.flags & MESSAGE_COMPRESSED) {
+            StatsTimer timer(STATS_COMPRESSION, length);
+            return this->decompressor.feed(data, length, out);
+        }
+        out.append((const char*)data, length);
+        return true;
+    }
+    bool onFinish(PoolString& out) override {
+        if (this->header.flags & MESSAGE_COMPRESSED) {
+            bool complete = this->decompressor.complete();
+            this->decompressor.reset();
+            if (!complete) return false;
+        }
+        if (this->newline) out.push_back('\n');
+        return true;
+    }
+    bool onEmpty(PoolString& out) override {
+        // Empty lines in --batch input stay empty lines
+        if (!this->newline) return false;
+        out.push_back('\n');
+        return true;
+    }
+};
+
+class RekeyProcessor : public MessageStreamProcessor
+{
+private:
+    const AES_key* to;
+    uint8_t toIv[AES_BLOCKLEN];
+    uint8_t toKeyId[MESSAGE_KEYIDLEN];
+    SecurePtr<EnvelopeKeys> scratch;
+    Base64StreamEncoder encoder;
+    // Output of MESSAGE_MAC messages, for the new tag
+    PoolVector<uint8_t> sealed;
+    // Encoded output of a MESSAGE_MAC message, held back until the old
+    // tag has been checked
+    PoolString held;
+public:
+    RekeyProcessor(const AES_key* from, const AES_key* to, const bool requireMac) :
+        MessageStreamProcessor(from, requireMac),
+        to(to),
+        scratch(makeSecure<EnvelopeKeys>())
+    {
+        getKeyId(to, this->toKeyId);
+    }
+protected:
+    void onHeader(PoolString& out) override {
+        uint8_t buf[sizeof(MessageHeader) + 1];
+        MessageHeader header = this->header;
+        // Left over from a message that failed its check
+        this->held.clear();
+        if (header.flags & MESSAGE_ENVELOPE) {
+            // The payload stays as it is, only our recipient entry changes
+            this->passthrough = true;
+        } else {
+            // Same length, new IV
+            Application::generateRandomBytes(header.IV, AES_BLOCKLEN);
+            memcpy(this->toIv, header.IV, AES_BLOCKLEN);
+            if (header.flags & MESSAGE_MAC) deriveMacKey(rawKey(this->to), this->scratch->macKey);
+        }
+        if (this->compactTag != '\0') {
+            this->sink(out).push_back(this->compactTag);
+            if (header.flags & MESSAGE_MAC) this->sealed.push_back((uint8_t)this->compactTag);
+        }
+        size_t n = writeHeader(header, this->recipients, buf);
+        this->emit(buf, n, this->sink(out));
+    }
+    // Header and recipients are rewritten as they come in, but the payload
+    // of a MESSAGE_MAC message only once its tag checks out. Until then,
+    // what comes before the payload is held back as well.
+    PoolString& sink(PoolString& out) {
+        return (this->header.flags & MESSAGE_MAC) ? this->held : out;
+    }
+    void release(PoolString& out) {
+        if (this->held.empty()) return;
+        out.append(this->held);
+        this->held.clear();
+    }
+    void emit(const uint8_t* data, const size_t length, PoolString& out) {
+        if (this->header.flags & MESSAGE_MAC) {
+            this->sealed.insert(this->sealed.end(), data, data + length);
+        }
+        StatsTimer timer(STATS_BASE64, length);
+        this->encoder.encode(data, length, out);
+    }
+    void onRecipient(const EnvelopeRecipient* entry, const uint8_t* dataKey, PoolString& out) override {
+        if (dataKey == NULL) {
+            this->emit((const uint8_t*)entry, sizeof(EnvelopeRecipient), this->sink(out));
+            return;
+        }
+        EnvelopeRecipient rewrapped;
+        memcpy(rewrapped.keyId, this->toKeyId, MESSAGE_KEYIDLEN);
+        wrapDataKey(this->to, this->header.IV, dataKey, rewrapped.dataKey, true);
+        this->emit((const uint8_t*)&rewrapped, sizeof(EnvelopeRecipient), this->sink(out));
+        // The data key doesn't change, but the header does
+        if (this->header.flags & MESSAGE_MAC) deriveMacKey(dataKey, this->scratch->macKey);
+    }
+    bool onPlaintext(uint8_t* data, size_t length, PoolString& out) override {
+        this->release(out);
+        {
+            StatsTimer timer(STATS_AES, length);
+            // Only the stolen end isn't whole blocks
+            if (length % AES_BLOCKLEN != 0) {
+                encryptStolen(this->to, this->toIv, data, length);
+            } else {
+                AES_CBC_encrypt_stream(this->to, this->toIv, data, length);
+            }
+        }
+        this->emit(data, length, out);
+        return true;
+    }
+    void onCiphertext(const uint8_t* data, size_t length, PoolString& out) override {
+        this->release(out);
+        this->emit(data, length, out);
+    }
+    bool onFinish(PoolString& out) override {
+        this->release(out);
+        if (this->header.flags & MESSAGE_MAC) {
+            uint8_t tag[SHA256_DIGESTLEN];
+            computeTag(this->scratch->macKey, this->sealed.data(), this->sealed.size(), tag);
+            this->sealed.clear();
+            StatsTimer timer(STATS_BASE64, macLength(this->header));
+            this->encoder.encode(tag, macLength(this->header), out);
+        }
+        StatsTimer timer(STATS_BASE64);
+        this->encoder.finish(out);
+        out.push_back('\n');
+        return true;
+    }
+    bool onEmpty(PoolString& out) override {
+        out.push_back('\n');
+        return true;
+    }
+};
+
+bool decryptMessage(const AES_key* key, const PoolString& msg, const bool requireMac, PoolString& out) {
+    DecryptProcessor processor(key, requireMac, false);
+    return processor.feed(msg.data(), msg.size(), out) && processor.finish(out);
+}
+
+std::unique_ptr<RecordProcessor> createEncryptProcessor(const AES_key* key, const MessageOptions& options) {
+    return std::unique_ptr<RecordProcessor>(new EncryptProcessor(key, options));
+}
+
+std::unique_ptr<RecordProcessor> createDecryptProcessor(const AES_key* key, const bool requireMac) {
+    return std::unique_ptr<RecordProcessor>(new DecryptProcessor(key, requireMac, true));
+}
+
+std::unique_ptr<RecordProcessor> createRekeyProcessor(const AES_key* from, const AES_key* to, const bool requireMac) {
+    return std::unique_ptr<RecordProcessor>(new RekeyProcessor(from, to, requireMac));
+}
@@ -0,0 +1,145 @@
+#ifndef _MESSAGE_HPP_
+#define _MESSAGE_HPP_
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "aes.h"
+#include "bufpool.hpp"
+#include "pipeline.hpp"
+
+/*
+    Message format.
+
+    Legacy messages start with an AESMetadata: the 16 bit message length
+    followed by the IV. Messages that use any of the options below start
+    with a MessageHeader instead, which is told apart by MESSAGE_EXTENDED
+    in place of the legacy length. Legacy messages of 65535 bytes, written
+    before there were MessageHeaders, are read as legacy messages if the
+    rest of their header isn't a valid MessageHeader. The AES-256-CBC encrypted payload
+    follows, padded with random bytes to a multiple of the block size.
+
+    Envelope messages (MESSAGE_ENVELOPE) are encrypted under a random data
+    key. The header is followed by a count and one EnvelopeRecipient per
+    key the message is for, holding that key's id and the data key
+    encrypted under it.
+
+    Compressed messages (MESSAGE_COMPRESSED) have their plaintext
+    compressed before it's encrypted, see compress.hpp.
+
+    Authenticated messages (MESSAGE_MAC) end with an HMAC-SHA256 tag over
+    everything before it (encrypt-then-MAC). The MAC key is derived from
+    the key the payload is encrypted with. The tag is checked before
+    anything is decrypted, so these messages' ciphertext is held in
+    memory until the end of the message. Nothing stops the tag from being
+    cut off and the flag cleared, though, which leaves a valid message
+    that isn't authenticated. Readers that expect MESSAGE_MAC must
+    require it (--mac with --decrypt or --rekey).
+
+    Compact messages (MESSAGE_COMPACT) are for the many short messages
+    whose header and padding would be most of the output. They start with
+    a tag character outside the base64 alphabet, told apart from the other
+    formats before anything is decoded. It gives the version and the
+    options (MESSAGE_COMPACT_TAGS, indexed by compressed | mac << 1). The
+    base64 after it holds the payload length as a varint (7 bits a byte,
+    least significant first, as short as possible), the IV and the payload
+    encrypted with ciphertext stealing (CBC-CS2), so it isn't padded unless
+    it's shorter than a block. The MAC tag is cut to MESSAGE_COMPACT_TAGLEN
+    bytes and also covers the tag character, which keeps the other options
+    from being changed. Like MESSAGE_MAC above, the tag character can
+    still be changed to one without MAC, along with cutting off the tag,
+    unless the reader requires MESSAGE_MAC. Compact messages can't be
+    envelope messages.
+*/
+
+// Metadata that comes BEFORE the encrypted data
+struct AESMetadata {
+    uint16_t messageLength;
+    uint8_t IV[AES_BLOCKLEN];
+};
+
+#define MESSAGE_EXTENDED 0xFFFF
+#define MESSAGE_LEGACY_VERSION 1
+#define MESSAGE_VERSION 2
+#define MESSAGE_COMPACT_VERSION 3  // Only in memory, see MESSAGE_COMPACT_TAGS
+
+// MessageHeader flags
+#define MESSAGE_ENVELOPE 0x1
+#define MESSAGE_COMPRESSED 0x2
+#define MESSAGE_MAC 0x4
+#define MESSAGE_FLAGS (MESSAGE_ENVELOPE | MESSAGE_COMPRESSED | MESSAGE_MAC)
+// MessageOptions only, the format is in the tag character
+#define MESSAGE_COMPACT 0x8
+
+// The URL-safe characters that aren't base64
+#define MESSAGE_COMPACT_TAGS ".-_~"
+#define MESSAGE_COMPACT_TAGLEN 16
+// Longest varint of a length up to MESSAGE_MAXLEN_EXTENDED
+#define MESSAGE_VARINTLEN 5
+
+struct MessageHeader {
+    uint16_t marker;  // MESSAGE_EXTENDED
+    uint8_t version;
+    uint8_t flags;
+    uint32_t length;  // Payload length, after compression and without the padding
+    uint8_t IV[AES_BLOCKLEN];
+};
+
+#define MESSAGE_KEYIDLEN 8
+#define MESSAGE_MAXRECIPIENTS UINT8_MAX
+
+struct EnvelopeRecipient {
+    uint8_t keyId[MESSAGE_KEYIDLEN];
+    uint8_t dataKey[AES_KEYLEN];  // Encrypted under the recipient's key
+};
+
+// Longest message for each header. New legacy messages can't have
+// MESSAGE_EXTENDED as their length.
+#define MESSAGE_MAXLEN (UINT16_MAX - 1)
+// The padded and compressed payload must still fit tiny-AES' 32 bit lengths
+#define MESSAGE_MAXLEN_EXTENDED INT32_MAX
+// Streaming processors decode and decrypt at most this many base64
+// characters at a time, so that's all the plaintext they ever hold.
+// Encryption works on tiles of MESSAGE_TILELEN bytes. Both are sized so
+// that a tile is still in the L2 cache when its next pass runs.
+#define MESSAGE_CHUNKLEN (64 << 10)
+#define MESSAGE_TILELEN (48 << 10)
+
+struct MessageRecipient {
+    const AES_key* key;
+    uint8_t keyId[MESSAGE_KEYIDLEN];
+};
+
+// How new messages are written. No flags means a legacy message.
+struct MessageOptions {
+    unsigned flags;
+    std::vector<MessageRecipient> recipients;  // For MESSAGE_ENVELOPE
+
+    MessageOptions() : flags(0) {}
+    size_t maxLength() const { return (this->flags == 0) ? MESSAGE_MAXLEN : MESSAGE_MAXLEN_EXTENDED; }
+};
+
+// Identifies a key in envelope messages without giving it away
+void getKeyId(const AES_key* key, uint8_t* keyId);
+
+// Encrypts 'length' bytes of 'msg' under a fresh IV and appends the base64
+// encoded message to 'out'. 'key' isn't used for envelope messages.
+void encryptMessage(const AES_key* key, const MessageOptions& options, const uint8_t* msg, const size_t length, PoolString& out);
+// Decodes and decrypts 'msg' and appends the plaintext to 'out'.
+// Returns false if 'msg' isn't a valid message, or if 'requireMac' is set
+// and it isn't a MESSAGE_MAC message.
+bool decryptMessage(const AES_key* key, const PoolString& msg, const bool requireMac, PoolString& out);
+
+// Record processors for the pipeline. Keys are only read, so processors on
+// several threads share them; they must outlive the processors.
+std::unique_ptr<RecordProcessor> createEncryptProcessor(const AES_key* key, const MessageOptions& options);
+// With 'requireMac', messages without MESSAGE_MAC are invalid.
+std::unique_ptr<RecordProcessor> createDecryptProcessor(const AES_key* key, const bool requireMac);
+// Decrypts messages under 'from' and encrypts them again under 'to', one
+// chunk at a time. Envelope messages only get their data key rewrapped.
+std::unique_ptr<RecordProcessor> createRekeyProcessor(const AES_key* from, const AES_key* to, const bool requireMac);
+
+#endif
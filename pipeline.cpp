@@ -0,0 +1,211 @@
+#include "pipeline.hpp"
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <condition_variable>
+#include <algorithm>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "io.hpp"
+#include "trace.hpp"
+
+struct Batch
+{
+    PoolString input;  // Complete records, each terminated by '\n'
+    PoolString output;
+    size_t firstLine;
+    size_t failedLine;  // Line of the first invalid record, 0 if there is none
+    bool done;
+};
+
+static void failRecord(const size_t line) {
+    fprintf(stderr, "Invalid message on line %zu.\n", line);
+    exit(1);
+}
+
+static void processBatch(RecordProcessor* processor, Batch* batch) {
+    TRACE_SPAN("batch");
+    const char* data = batch->input.data();
+    const char* end = data + batch->input.size();
+    size_t line = batch->firstLine;
+
+    while (data < end) {
+        const char* nl = (const char*)memchr(data, '\n', end - data);
+        size_t length = nl - data;
+        if (length > 0 && data[length - 1] == '\r') length--;
+        if (!processor->feed(data, length, batch->output) || !processor->finish(batch->output)) {
+            batch->failedLine = line;
+            return;
+        }
+        data = nl + 1;
+        line++;
+    }
+}
+
+Pipeline::Pipeline(const unsigned jobs, RecordProcessorFactory factory) :
+    jobs(jobs > 0 ? jobs : 1),
+    factory(factory)
+{
+}
+
+void Pipeline::run(const int inFd, const int outFd) {
+    std::unique_ptr<RecordProcessor> processor = this->factory();
+
+    std::mutex lock;
+    std::condition_variable workAvailable, batchDone;
+    std::deque<Batch*> queue;
+    std::deque<std::unique_ptr<Batch>> inflight;
+    std::vector<std::thread> workers;
+    bool stopping = false;
+
+    if (this->jobs > 1) {
+        for (unsigned i = 0; i < this->jobs; i++) {
+            workers.emplace_back([&, i]() {
+                TRACE_THREAD("worker", i + 1);
+                std::unique_ptr<RecordProcessor> processor = this->factory();
+                std::unique_lock<std::mutex> guard(lock);
+                while (true) {
+                    {
+                        TRACE_SPAN("wait for work");
+                        workAvailable.wait(guard, [&]() { return stopping || !queue.empty(); });
+                    }
+                    if (queue.empty()) return;
+                    Batch* batch = queue.front();
+                    queue.pop_front();
+                    TRACE_COUNTER("queued batches", queue.size());
+
+                    guard.unlock();
+                    processBatch(processor.get(), batch);
+                    guard.lock();
+                    batch->done = true;
+                    batchDone.notify_all();
+                }
+            });
+        }
+    }
+
+    // Writes out the oldest batch once it is done
+    auto writeFront = [&]() {
+        Batch* batch = inflight.front().get();
+        {
+            // Batches finish out of order, but are written in order
+            TRACE_SPAN("wait for batch");
+            std::unique_lock<std::mutex> guard(lock);
+            batchDone.wait(guard, [&]() { return batch->done; });
+        }
+        if (batch->failedLine != 0) failRecord(batch->failedLine);
+        writeOutput(outFd, batch->output);
+        inflight.pop_front();
+        TRACE_COUNTER("batches in flight", inflight.size());
+    };
+
+    size_t line = 1;
+    auto submit = [&](PoolString& input) {
+        std::unique_ptr<Batch> batch(new Batch);
+        batch->input.swap(input);
+        batch->firstLine = line;
+        batch->failedLine = 0;
+        batch->done = false;
+        line += std::count(batch->input.begin(), batch->input.end(), '\n');
+
+        if (this->jobs == 1) {
+            processBatch(processor.get(), batch.get());
+            if (batch->failedLine != 0) failRecord(batch->failedLine);
+            writeOutput(outFd, batch->output);
+            return;
+        }
+        {
+            std::lock_guard<std::mutex> guard(lock);
+            queue.push_back(batch.get());
+            inflight.push_back(std::move(batch));
+            TRACE_COUNTER("queued batches", queue.size());
+            TRACE_COUNTER("batches in flight", inflight.size());
+        }
+        workAvailable.notify_one();
+        // Keep a bounded number of batches in flight
+        while (inflight.size() > this->jobs * 2) writeFront();
+    };
+
+    PoolVector<char> buffer(PIPELINE_BLOCKLEN);
+    PoolString pending, output;
+    bool streaming = false;
+    // Set when the streamed record so far ends with '\r', which has been
+    // held back in case the record ends right after it
+    bool heldCR = false;
+    // Feeds the next piece of the record that is being streamed, and
+    // finishes it if 'last' is set. Drops a '\r' at the end like batches do.
+    auto stream = [&](const char* data, size_t length, const bool last) {
+        output.clear();
+        bool held = heldCR;
+        heldCR = length > 0 && data[length - 1] == '\r';
+        if (heldCR) length--;
+        if (held && (length > 0 || heldCR) && !processor->feed("\r", 1, output)) failRecord(line);
+        if (!processor->feed(data, length, output)) failRecord(line);
+        if (last) {
+            heldCR = false;
+            if (!processor->finish(output)) failRecord(line);
+        }
+        writeOutput(outFd, output);
+    };
+    size_t n;
+    while ((n = readSome(inFd, buffer.data(), buffer.size())) > 0) {
+        const char* data = buffer.data();
+        const char* end = data + n;
+
+        if (streaming) {
+            // Continue the record that is being streamed
+            const char* nl = (const char*)memchr(data, '\n', end - data);
+            const char* stop = (nl != NULL) ? nl : end;
+            stream(data, stop - data, nl != NULL);
+            if (nl == NULL) continue;
+            streaming = false;
+            line++;
+            data = nl + 1;
+        }
+
+        const char* last = data;
+        for (const char* p = end; p > data; p--) {
+            if (p[-1] == '\n') {
+                last = p;
+                break;
+            }
+        }
+        if (last > data) {
+            pending.append(data, last - data);
+            submit(pending);
+            pending.clear();
+        }
+        pending.append(last, end - last);
+
+        // A record that doesn't fit in a block is streamed, once every
+        // batch before it has been written.
+        if (pending.size() >= PIPELINE_BLOCKLEN) {
+            while (!inflight.empty()) writeFront();
+            stream(pending.data(), pending.size(), false);
+            pending.clear();
+            streaming = true;
+        }
+    }
+
+    if (streaming) {
+        stream("", 0, true);
+    } else if (!pending.empty()) {
+        // The last record wasn't terminated by a newline
+        pending.push_back('\n');
+        submit(pending);
+    }
+
+    while (!inflight.empty()) writeFront();
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        stopping = true;
+    }
+    workAvailable.notify_all();
+    for (std::thread& worker : workers) {
+        worker.join();
+    }
+}
@@ -0,0 +1,49 @@
+#ifndef _PIPELINE_HPP_
+#define _PIPELINE_HPP_
+
+#include <cstddef>
+#include <functional>
+#include <memory>
+#include <string>
+
+#include "bufpool.hpp"
+
+/*
+    Record pipeline used by --batch and --rekey.
+
+    Input is a stream of records separated by '\n' or "\r\n". Empty lines
+    are records too, so every input line gives one output record. Records
+    are grouped into batches which are processed by 'jobs' worker threads,
+    and the results are written in input order.
+
+    Each worker owns a RecordProcessor. A record is handed to it as one or
+    more consecutive pieces followed by finish(). Records that are longer
+    than PIPELINE_BLOCKLEN are streamed through the calling thread piece by
+    piece, so no record ever has to fit in memory.
+*/
+
+#define PIPELINE_BLOCKLEN (1 << 20)
+
+class RecordProcessor
+{
+public:
+    virtual ~RecordProcessor() {}
+    // Both return false if the record is invalid
+    virtual bool feed(const char* data, size_t length, PoolString& out) = 0;
+    virtual bool finish(PoolString& out) = 0;
+};
+
+typedef std::function<std::unique_ptr<RecordProcessor>()> RecordProcessorFactory;
+
+class Pipeline
+{
+private:
+    unsigned jobs;
+    RecordProcessorFactory factory;
+public:
+    Pipeline(const unsigned jobs, RecordProcessorFactory factory);
+    // Processes everything from 'inFd' and writes the results to 'outFd'
+    void run(const int inFd, const int outFd);
+};
+
+#endif
@@ -0,0 +1,141 @@
+#include "profile.hpp"
+
+#include <cstdio>
+#include <cstring>
+#include <cerrno>
+
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+static const char* _names[PROFILE_COUNTERS] = {
+    "cycles",
+    "instructions",
+    "cache_references",
+    "cache_misses",
+    "branch_misses",
+    "l1d_read_misses"
+};
+
+#ifdef __linux__
+static const struct {
+    uint32_t type;
+    uint64_t config;
+} _events[PROFILE_COUNTERS] = {
+    { PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES },
+    { PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS },
+    { PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_REFERENCES },
+    { PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES },
+    { PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES },
+    { PERF_TYPE_HW_CACHE, PERF_COUNT_HW_CACHE_L1D | (PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16) }
+};
+
+struct CounterGroup
+{
+    int fds[PROFILE_COUNTERS];
+    // The counter behind each value of a group read, in the order they were added
+    int order[PROFILE_COUNTERS];
+    unsigned count;
+    bool opened;
+
+    CounterGroup() : count(0), opened(false) {
+        for (int i = 0; i < PROFILE_COUNTERS; i++) this->fds[i] = -1;
+    }
+    ~CounterGroup() {
+        for (int i = 0; i < PROFILE_COUNTERS; i++) {
+            if (this->fds[i] != -1) close(this->fds[i]);
+        }
+    }
+    int leader() const { return this->fds[PROFILE_CYCLES]; }
+};
+
+static thread_local CounterGroup _group;
+// Why the first group couldn't be opened
+static int _error = 0;
+
+static int openCounter(const int counter, const int group) {
+    struct perf_event_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = _events[counter].type;
+    attr.config = _events[counter].config;
+    attr.read_format = PERF_FORMAT_GROUP;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    return (int)syscall(SYS_perf_event_open, &attr, 0, -1, group, PERF_FLAG_FD_CLOEXEC);
+}
+
+// The group is led by the cycle counter, without it there is nothing
+static bool openGroup(CounterGroup& group) {
+    group.opened = true;
+    for (int i = 0; i < PROFILE_COUNTERS; i++) {
+        int fd = openCounter(i, group.leader());
+        if (fd == -1) {
+            if (i == PROFILE_CYCLES) {
+                if (_error == 0) _error = errno;
+                return false;
+            }
+            continue;
+        }
+        group.fds[i] = fd;
+        group.order[group.count++] = i;
+    }
+    return true;
+}
+
+static int readParanoid() {
+    int level = -1;
+    FILE* f = fopen("/proc/sys/kernel/perf_event_paranoid", "r");
+    if (f != NULL) {
+        if (fscanf(f, "%d", &level) != 1) level = -1;
+        fclose(f);
+    }
+    return level;
+}
+#endif
+
+bool Profiler::start() {
+#ifdef __linux__
+    if (!_group.opened && openGroup(_group)) return true;
+    if (_group.leader() != -1) return true;
+
+    fprintf(stderr, "--profile: hardware counters aren't available (%s", strerror(_error));
+    int paranoid = readParanoid();
+    if ((_error == EACCES || _error == EPERM) && paranoid >= 0) {
+        fprintf(stderr, ", perf_event_paranoid is %d", paranoid);
+    }
+    fprintf(stderr, "), only timings are reported.\n");
+#else
+    fprintf(stderr, "--profile: hardware counters are only supported on Linux, only timings are reported.\n");
+#endif
+    return false;
+}
+
+bool Profiler::read(uint64_t values[PROFILE_COUNTERS]) {
+#ifdef __linux__
+    if (!_group.opened) openGroup(_group);
+    if (_group.leader() == -1) return false;
+
+    // { nr, value for each counter in the group }
+    uint64_t data[1 + PROFILE_COUNTERS];
+    ssize_t n = ::read(_group.leader(), data, sizeof(data));
+    if (n < (ssize_t)sizeof(uint64_t) || data[0] > _group.count ||
+        n < (ssize_t)(sizeof(uint64_t) * (1 + data[0]))) {
+        return false;
+    }
+
+    memset(values, 0, sizeof(uint64_t) * PROFILE_COUNTERS);
+    for (unsigned i = 0; i < data[0]; i++) {
+        values[_group.order[i]] = data[1 + i];
+    }
+    return true;
+#else
+    return false;
+#endif
+}
+
+const char* Profiler::name(const int counter) {
+    return _names[counter];
+}
@@ -0,0 +1,43 @@
+#ifndef _PROFILE_HPP_
+#define _PROFILE_HPP_
+
+#include <cstddef>
+#include <cstdint>
+
+/*
+    Hardware performance counters for --profile, read through
+    perf_event_open() around the same stages --stats times.
+
+    Each thread opens its own counter group the first time it is timed,
+    counting user space only. Counters the CPU doesn't have are left out
+    of the group. If the group can't be opened at all, because
+    perf_event_paranoid forbids it or there is no PMU (as in many VMs),
+    --profile says why once and the report only has the timings.
+
+    Counters are read with one read() per stage boundary, so profiling
+    slows down runs with many small messages.
+*/
+
+enum ProfileCounter {
+    PROFILE_CYCLES,
+    PROFILE_INSTRUCTIONS,
+    PROFILE_CACHE_REFERENCES,
+    PROFILE_CACHE_MISSES,
+    PROFILE_BRANCH_MISSES,
+    PROFILE_L1D_MISSES,
+    PROFILE_COUNTERS
+};
+
+class Profiler
+{
+public:
+    // Opens the calling thread's counters. Returns false, after printing
+    // why, if there are none.
+    static bool start();
+    // Reads the calling thread's counters, opening them if needed.
+    // Counters that aren't available read as 0.
+    static bool read(uint64_t values[PROFILE_COUNTERS]);
+    static const char* name(const int counter);
+};
+
+#endif
@@ -0,0 +1,242 @@
+#include "secmem.hpp"
+#include "memory.hpp"
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cstdint>
+#include <mutex>
+
+#ifdef __linux__
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#elif defined(_WIN32)
+#include <windows.h>
+#endif
+
+#define SECMEM_BLOCKLEN 64
+// Pages per shared arena. Larger allocations get an arena of their own.
+#define SECMEM_ARENA_PAGES 16
+
+struct SecureArena
+{
+    uint8_t* region;   // Start of the mapping, including guard pages
+    size_t regionSize;
+    uint8_t* base;     // First usable byte
+    size_t size;       // Usable bytes
+    bool dedicated;    // Holds exactly one allocation
+    // For every block: number of blocks in the allocation starting there,
+    // or 0 if no allocation starts at that block.
+    std::vector<uint32_t> lengths;
+    std::vector<bool> used;
+    SecureArena* next;
+};
+
+static std::mutex _lock;
+static SecureArena* _arenas = NULL;
+static bool _warned = false;
+
+static size_t pageSize() {
+#ifdef __linux__
+    static const size_t size = (size_t)sysconf(_SC_PAGESIZE);
+#elif defined(_WIN32)
+    static const size_t size = []() {
+        SYSTEM_INFO info;
+        GetSystemInfo(&info);
+        return (size_t)info.dwPageSize;
+    }();
+#endif
+    return size;
+}
+
+static void warnUnlocked() {
+    if (!_warned) {
+        fprintf(stderr, "Warning: could not lock memory for keys, they may be swapped to disk.\n");
+        _warned = true;
+    }
+}
+
+#ifdef __linux__
+// Maps 'size' bytes at 'addr' from a memfd_secret() descriptor.
+static bool mapSecretMemory(uint8_t* addr, const size_t size) {
+#ifdef SYS_memfd_secret
+    static bool unavailable = false;
+    if (unavailable) return false;
+
+    int fd = (int)syscall(SYS_memfd_secret, 0);
+    if (fd == -1) {
+        unavailable = true;
+        return false;
+    }
+    if (ftruncate(fd, size) == -1) {
+        close(fd);
+        return false;
+    }
+    void* p = mmap(addr, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED, fd, 0);
+    close(fd);
+    return p != MAP_FAILED;
+#else
+    (void)addr;
+    (void)size;
+    return false;
+#endif
+}
+#endif
+
+// Returns NULL if there's no memory. Runs under _lock, so it must not
+// exit(): that releases thread_local secure memory, which takes _lock.
+static SecureArena* createArena(const size_t size, const bool dedicated) {
+    const size_t page = pageSize();
+    const size_t usable = (size + page - 1) / page * page;
+
+    SecureArena* arena = new SecureArena;
+    arena->regionSize = usable + 2 * page;
+    arena->size = usable;
+    arena->dedicated = dedicated;
+    arena->lengths.assign(usable / SECMEM_BLOCKLEN, 0);
+    arena->used.assign(usable / SECMEM_BLOCKLEN, false);
+    arena->next = NULL;
+
+#ifdef __linux__
+    // Reserve the whole region inaccessible, then open up everything but
+    // the first and last page.
+    void* p = mmap(NULL, arena->regionSize, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (p == MAP_FAILED) {
+        perror("mmap");
+        delete arena;
+        return NULL;
+    }
+    arena->region = (uint8_t*)p;
+    arena->base = arena->region + page;
+
+    if (!mapSecretMemory(arena->base, usable)) {
+        // A failed MAP_FIXED mapping may already have unmapped the range
+        // (memfd_secret() counts against RLIMIT_MEMLOCK), so map it again
+        p = mmap(arena->base, usable, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED, -1, 0);
+        if (p == MAP_FAILED) {
+            perror("mmap");
+            munmap(arena->region, arena->regionSize);
+            delete arena;
+            return NULL;
+        }
+        if (mlock(arena->base, usable) == -1) {
+            warnUnlocked();
+        }
+    }
+    madvise(arena->base, usable, MADV_DONTDUMP);
+#elif defined(_WIN32)
+    void* p = VirtualAlloc(NULL, arena->regionSize, MEM_RESERVE, PAGE_NOACCESS);
+    if (p == NULL) {
+        puts("VirtualAlloc failed!");
+        delete arena;
+        return NULL;
+    }
+    arena->region = (uint8_t*)p;
+    arena->base = arena->region + page;
+    VirtualAlloc(arena->base, usable, MEM_COMMIT, PAGE_READWRITE);
+    if (!VirtualLock(arena->base, usable)) {
+        warnUnlocked();
+    }
+#endif
+    return arena;
+}
+
+static void destroyArena(SecureArena* arena) {
+    SecureMemory::zero(arena->base, arena->size);
+#ifdef __linux__
+    munlock(arena->base, arena->size);
+    munmap(arena->region, arena->regionSize);
+#elif defined(_WIN32)
+    VirtualUnlock(arena->base, arena->size);
+    VirtualFree(arena->region, 0, MEM_RELEASE);
+#endif
+    delete arena;
+}
+
+// First fit search for 'count' free blocks. Returns -1 if there are none.
+static long findFreeBlocks(const SecureArena* arena, const size_t count) {
+    size_t run = 0;
+    for (size_t i = 0; i < arena->used.size(); i++) {
+        run = arena->used[i] ? 0 : run + 1;
+        if (run == count) {
+            return (long)(i + 1 - count);
+        }
+    }
+    return -1;
+}
+
+void* SecureMemory::allocate(const size_t size) {
+    if (Memory::enabled) Memory::allocated(MEMORY_SECURE, size);
+    MemoryUncounted uncounted;
+    const size_t count = (size > 0) ? (size + SECMEM_BLOCKLEN - 1) / SECMEM_BLOCKLEN : 1;
+    const size_t arenaBlocks = SECMEM_ARENA_PAGES * pageSize() / SECMEM_BLOCKLEN;
+    std::unique_lock<std::mutex> guard(_lock);
+
+    SecureArena* arena = NULL;
+    long first = -1;
+    if (count <= arenaBlocks / 4) {
+        for (arena = _arenas; arena != NULL; arena = arena->next) {
+            if (arena->dedicated) continue;
+            first = findFreeBlocks(arena, count);
+            if (first >= 0) break;
+        }
+    }
+    if (arena == NULL) {
+        const bool dedicated = count > arenaBlocks / 4;
+        arena = createArena(dedicated ? count * SECMEM_BLOCKLEN : arenaBlocks * SECMEM_BLOCKLEN, dedicated);
+        if (arena == NULL) {
+            guard.unlock();
+            exit(1);
+        }
+        arena->next = _arenas;
+        _arenas = arena;
+        first = 0;
+    }
+
+    for (size_t i = 0; i < count; i++) {
+        arena->used[first + i] = true;
+    }
+    arena->lengths[first] = (uint32_t)count;
+    return arena->base + first * SECMEM_BLOCKLEN;
+}
+
+void SecureMemory::release(void* p) {
+    if (p == NULL) return;
+    std::lock_guard<std::mutex> guard(_lock);
+
+    SecureArena** link = &_arenas;
+    for (SecureArena* arena = _arenas; arena != NULL; link = &arena->next, arena = arena->next) {
+        uint8_t* addr = (uint8_t*)p;
+        if (addr < arena->base || addr >= arena->base + arena->size) continue;
+
+        const size_t first = (addr - arena->base) / SECMEM_BLOCKLEN;
+        const size_t count = arena->lengths[first];
+        if (arena->dedicated) {
+            *link = arena->next;
+            destroyArena(arena);
+            return;
+        }
+        SecureMemory::zero(addr, count * SECMEM_BLOCKLEN);
+        for (size_t i = 0; i < count; i++) {
+            arena->used[first + i] = false;
+        }
+        arena->lengths[first] = 0;
+        return;
+    }
+    fprintf(stderr, "SecureMemory::release: %p was not allocated by SecureMemory\n", p);
+    abort();
+}
+
+void SecureMemory::zero(void* p, const size_t size) {
+#if defined(__GNUC__)
+    memset(p, 0, size);
+    // Tell the compiler the zeroed memory is still being looked at
+    __asm__ __volatile__("" : : "r"(p) : "memory");
+#else
+    volatile uint8_t* v = (volatile uint8_t*)p;
+    for (size_t i = 0; i < size; i++) {
+        v[i] = 0;
+    }
+#endif
+}
@@ -0,0 +1,82 @@
+#ifndef _SECMEM_HPP_
+#define _SECMEM_HPP_
+
+#include <cstddef>
+#include <memory>
+#include <new>
+#include <string>
+#include <utility>
+#include <vector>
+
+/*
+    Memory for keys, expanded key schedules and other secrets.
+
+    Allocations are carved out of arenas whose pages are locked into RAM
+    (so they are never written to swap), excluded from core dumps and
+    surrounded by inaccessible guard pages. Where the kernel supports it,
+    arenas are backed by memfd_secret(), which also removes them from the
+    kernel's direct map. Memory is zeroed when it is released.
+
+    If the pages can't be locked (RLIMIT_MEMLOCK), a warning is printed
+    once and the memory is used unlocked.
+*/
+
+class SecureMemory
+{
+public:
+    // Returns 'size' bytes of zeroed secure memory, aligned to 64 bytes.
+    // Exits the program if no memory is available.
+    static void* allocate(const size_t size);
+    // Zeroes and releases memory returned by allocate(). NULL is ignored.
+    static void release(void* p);
+    // memset(p, 0, size) that the compiler can't optimize away
+    static void zero(void* p, const size_t size);
+};
+
+template <typename T>
+struct SecureDelete
+{
+    void operator()(T* p) const {
+        p->~T();
+        SecureMemory::release(p);
+    }
+};
+
+template <typename T>
+using SecurePtr = std::unique_ptr<T, SecureDelete<T>>;
+
+template <typename T, typename... Args>
+SecurePtr<T> makeSecure(Args&&... args) {
+    static_assert(alignof(T) <= 64, "SecureMemory only aligns to 64 bytes");
+    void* p = SecureMemory::allocate(sizeof(T));
+    return SecurePtr<T>(new (p) T(std::forward<Args>(args)...));
+}
+
+// Allocator for standard containers that hold secrets
+template <typename T>
+struct SecureAllocator
+{
+    typedef T value_type;
+
+    SecureAllocator() = default;
+    template <typename U>
+    SecureAllocator(const SecureAllocator<U>&) {}
+
+    T* allocate(const size_t n) {
+        return (T*)SecureMemory::allocate(n * sizeof(T));
+    }
+    void deallocate(T* p, const size_t) {
+        SecureMemory::release(p);
+    }
+};
+
+template <typename T, typename U>
+bool operator==(const SecureAllocator<T>&, const SecureAllocator<U>&) { return true; }
+template <typename T, typename U>
+bool operator!=(const SecureAllocator<T>&, const SecureAllocator<U>&) { return false; }
+
+template <typename T>
+using SecureVector = std::vector<T, SecureAllocator<T>>;
+using SecureString = std::basic_string<char, std::char_traits<char>, SecureAllocator<char>>;
+
+#endif
@@ -0,0 +1,219 @@
+#include "sha256.hpp"
+
+#include <cstring>
+
+#include "cpu.hpp"
+#include "secmem.hpp"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define SHA256_SHANI
+#include <immintrin.h>
+#endif
+
+static const uint32_t K[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+    0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+    0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+    0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+    0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
+
+#define ROTR32(v, n) (((v) >> (n)) | ((v) << (32 - (n))))
+
+static void compressPortable(uint32_t state[8], const uint8_t* data, size_t blocks) {
+    uint32_t w[64];
+    while (blocks--) {
+        for (int i = 0; i < 16; i++) {
+            w[i] = ((uint32_t)data[i * 4] << 24) | ((uint32_t)data[i * 4 + 1] << 16) |
+                ((uint32_t)data[i * 4 + 2] << 8) | data[i * 4 + 3];
+        }
+        for (int i = 16; i < 64; i++) {
+            uint32_t s0 = ROTR32(w[i - 15], 7) ^ ROTR32(w[i - 15], 18) ^ (w[i - 15] >> 3);
+            uint32_t s1 = ROTR32(w[i - 2], 17) ^ ROTR32(w[i - 2], 19) ^ (w[i - 2] >> 10);
+            w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+        }
+
+        uint32_t a = state[0], b = state[1], c = state[2], d = state[3];
+        uint32_t e = state[4], f = state[5], g = state[6], h = state[7];
+        for (int i = 0; i < 64; i++) {
+            uint32_t t1 = h + (ROTR32(e, 6) ^ ROTR32(e, 11) ^ ROTR32(e, 25)) + ((e & f) ^ (~e & g)) + K[i] + w[i];
+            uint32_t t2 = (ROTR32(a, 2) ^ ROTR32(a, 13) ^ ROTR32(a, 22)) + ((a & b) ^ (a & c) ^ (b & c));
+            h = g;
+            g = f;
+            f = e;
+            e = d + t1;
+            d = c;
+            c = b;
+            b = a;
+            a = t1 + t2;
+        }
+        state[0] += a; state[1] += b; state[2] += c; state[3] += d;
+        state[4] += e; state[5] += f; state[6] += g; state[7] += h;
+        data += SHA256_BLOCKLEN;
+    }
+    SecureMemory::zero(w, sizeof(w));
+}
+
+#ifdef SHA256_SHANI
+__attribute__((target("sha,sse4.1")))
+static void compressShaNi(uint32_t state[8], const uint8_t* data, size_t blocks) {
+    const __m128i byteSwap = _mm_set_epi64x(0x0c0d0e0f08090a0bULL, 0x0405060700010203ULL);
+
+    // The instructions want the state as ABEF and CDGH
+    __m128i tmp = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i*)&state[0]), 0xB1);
+    __m128i state1 = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i*)&state[4]), 0x1B);
+    __m128i state0 = _mm_alignr_epi8(tmp, state1, 8);
+    state1 = _mm_blend_epi16(state1, tmp, 0xF0);
+
+    while (blocks--) {
+        const __m128i abef = state0;
+        const __m128i cdgh = state1;
+        __m128i w[4];
+
+        #pragma GCC unroll 16
+        for (int i = 0; i < 16; i++) {
+            if (i < 4) {
+                w[i] = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)(data + i * 16)), byteSwap);
+            } else {
+                // Message schedule for the next four rounds
+                __m128i next = _mm_sha256msg1_epu32(w[i & 3], w[(i + 1) & 3]);
+                next = _mm_add_epi32(next, _mm_alignr_epi8(w[(i + 3) & 3], w[(i + 2) & 3], 4));
+                w[i & 3] = _mm_sha256msg2_epu32(next, w[(i + 3) & 3]);
+            }
+            __m128i msg = _mm_add_epi32(w[i & 3], _mm_loadu_si128((const __m128i*)&K[i * 4]));
+            state1 = _mm_sha256rnds2_epu32(state1, state0, msg);
+            state0 = _mm_sha256rnds2_epu32(state0, state1, _mm_shuffle_epi32(msg, 0x0E));
+        }
+
+        state0 = _mm_add_epi32(state0, abef);
+        state1 = _mm_add_epi32(state1, cdgh);
+        data += SHA256_BLOCKLEN;
+    }
+
+    tmp = _mm_shuffle_epi32(state0, 0x1B);
+    state1 = _mm_shuffle_epi32(state1, 0xB1);
+    _mm_storeu_si128((__m128i*)&state[0], _mm_blend_epi16(tmp, state1, 0xF0));
+    _mm_storeu_si128((__m128i*)&state[4], _mm_alignr_epi8(state1, tmp, 8));
+}
+#endif
+
+typedef void (*CompressFunction)(uint32_t state[8], const uint8_t* data, size_t blocks);
+
+static CompressFunction selectCompress() {
+#ifdef SHA256_SHANI
+    const CpuFeatures& cpu = cpuFeatures();
+    if (cpu.sha && cpu.sse41 && cpu.ssse3) {
+        return &compressShaNi;
+    }
+#endif
+    return &compressPortable;
+}
+
+static void compressBlocks(uint32_t state[8], const uint8_t* data, size_t blocks) {
+    static const CompressFunction compress = selectCompress();
+    compress(state, data, blocks);
+}
+
+Sha256::Sha256() {
+    this->reset();
+}
+
+void Sha256::reset() {
+    static const uint32_t initial[8] = {
+        0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19
+    };
+    memcpy(this->state, initial, sizeof(this->state));
+    SecureMemory::zero(this->buffer, sizeof(this->buffer));
+    this->buffered = 0;
+    this->length = 0;
+}
+
+Sha256::~Sha256() {
+    // The state of a keyed hash is as good as the key
+    SecureMemory::zero(this->state, sizeof(this->state));
+    SecureMemory::zero(this->buffer, sizeof(this->buffer));
+}
+
+void Sha256::update(const void* data, size_t length) {
+    const uint8_t* p = (const uint8_t*)data;
+    this->length += length;
+
+    if (this->buffered > 0) {
+        size_t n = SHA256_BLOCKLEN - this->buffered;
+        if (n > length) n = length;
+        memcpy(this->buffer + this->buffered, p, n);
+        this->buffered += n;
+        p += n;
+        length -= n;
+        if (this->buffered < SHA256_BLOCKLEN) return;
+        compressBlocks(this->state, this->buffer, 1);
+        this->buffered = 0;
+    }
+
+    size_t blocks = length / SHA256_BLOCKLEN;
+    if (blocks > 0) {
+        compressBlocks(this->state, p, blocks);
+        p += blocks * SHA256_BLOCKLEN;
+        length -= blocks * SHA256_BLOCKLEN;
+    }
+    memcpy(this->buffer, p, length);
+    this->buffered = length;
+}
+
+void Sha256::final(uint8_t* digest) {
+    uint64_t bits = this->length * 8;
+    uint8_t padding[SHA256_BLOCKLEN + 8] = { 0x80 };
+    size_t padLength = (this->buffered < 56) ? 56 - this->buffered : 120 - this->buffered;
+    for (int i = 0; i < 8; i++) {
+        padding[padLength + i] = (uint8_t)(bits >> (56 - i * 8));
+    }
+    this->update(padding, padLength + 8);
+
+    for (int i = 0; i < 8; i++) {
+        digest[i * 4 + 0] = (uint8_t)(this->state[i] >> 24);
+        digest[i * 4 + 1] = (uint8_t)(this->state[i] >> 16);
+        digest[i * 4 + 2] = (uint8_t)(this->state[i] >> 8);
+        digest[i * 4 + 3] = (uint8_t)(this->state[i]);
+    }
+}
+
+HmacSha256::HmacSha256(const uint8_t* key, const size_t length) {
+    this->init(key, length);
+}
+
+void HmacSha256::init(const uint8_t* key, const size_t length) {
+    this->inner.reset();
+    this->outer.reset();
+    uint8_t pad[SHA256_BLOCKLEN] = { 0 };
+    if (length > SHA256_BLOCKLEN) {
+        Sha256 hash;
+        hash.update(key, length);
+        hash.final(pad);
+    } else {
+        memcpy(pad, key, length);
+    }
+
+    for (int i = 0; i < SHA256_BLOCKLEN; i++) pad[i] ^= 0x36;
+    this->inner.update(pad, SHA256_BLOCKLEN);
+    for (int i = 0; i < SHA256_BLOCKLEN; i++) pad[i] ^= 0x36 ^ 0x5c;
+    this->outer.update(pad, SHA256_BLOCKLEN);
+    SecureMemory::zero(pad, sizeof(pad));
+}
+
+void HmacSha256::final(uint8_t* tag) {
+    uint8_t digest[SHA256_DIGESTLEN];
+    this->inner.final(digest);
+    this->outer.update(digest, SHA256_DIGESTLEN);
+    this->outer.final(tag);
+}
+
+bool tagsEqual(const uint8_t* a, const uint8_t* b, const size_t length) {
+    uint8_t diff = 0;
+    for (size_t i = 0; i < length; i++) {
+        diff |= a[i] ^ b[i];
+    }
+    return diff == 0;
+}
@@ -0,0 +1,52 @@
+#ifndef _SHA256_HPP_
+#define _SHA256_HPP_
+
+#include <cstddef>
+#include <cstdint>
+
+/*
+    SHA-256 and HMAC-SHA256.
+
+    Blocks are compressed with the SHA extensions (SHA-NI) when the CPU has
+    them, and with portable code otherwise.
+*/
+
+#define SHA256_BLOCKLEN 64
+#define SHA256_DIGESTLEN 32
+
+class Sha256
+{
+private:
+    uint32_t state[8];
+    uint8_t buffer[SHA256_BLOCKLEN];
+    size_t buffered;
+    uint64_t length;
+public:
+    Sha256();
+    ~Sha256();
+    // Starts over with an empty message
+    void reset();
+    void update(const void* data, size_t length);
+    void final(uint8_t* digest);
+};
+
+class HmacSha256
+{
+private:
+    // Hash states after absorbing the padded key
+    Sha256 inner;
+    Sha256 outer;
+public:
+    // Unusable until init() is called
+    HmacSha256() {}
+    HmacSha256(const uint8_t* key, const size_t length);
+    // Starts a new tag under 'key', so an instance can be reused
+    void init(const uint8_t* key, const size_t length);
+    void update(const void* data, const size_t length) { this->inner.update(data, length); }
+    void final(uint8_t* tag);
+};
+
+// Compares two tags in constant time
+bool tagsEqual(const uint8_t* a, const uint8_t* b, const size_t length);
+
+#endif
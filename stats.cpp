@@ -0,0 +1,212 @@
+#include "stats.hpp"
+
+#include <cstdio>
+#include <cstdlib>
+#include <atomic>
+#include <chrono>
+
+#include "memory.hpp"
+#include "trace.hpp"
+
+static const char* _stageNames[STATS_STAGES] = {
+    "input read",
+    "keychain load",
+    "key expansion",
+    "random generation",
+    "compression",
+    "AES",
+    "MAC",
+    "base64",
+    "output write"
+};
+
+static StatsFormat _format = STATS_TEXT;
+static uint64_t _start = 0;
+static std::atomic<uint64_t> _nanoseconds[STATS_STAGES];
+static std::atomic<uint64_t> _bytes[STATS_STAGES];
+static std::atomic<uint64_t> _calls[STATS_STAGES];
+static std::atomic<uint64_t> _counters[STATS_STAGES][PROFILE_COUNTERS];
+
+bool Stats::enabled = false;
+bool Stats::profiling = false;
+
+void Stats::enable(const StatsFormat format) {
+    if (Stats::enabled) return;
+    _format = format;
+    _start = Stats::now();
+    Stats::enabled = true;
+    atexit(&Stats::report);
+}
+
+void Stats::enableProfile() {
+    Stats::profiling = Profiler::start();
+}
+
+uint64_t Stats::now() {
+    return (uint64_t)std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+void Stats::begin(StatsTimer& timer) {
+    if (Stats::profiling) {
+        timer.counting = Profiler::read(timer.counters);
+    }
+    if (Memory::enabled) {
+        timer.previousStage = Memory::enterStage(timer.stage);
+    }
+    timer.start = Stats::now();
+}
+
+void Stats::end(StatsTimer& timer) {
+    uint64_t end = Stats::now();
+    uint64_t nanoseconds = end - timer.start;
+    if (Memory::enabled) {
+        Memory::leaveStage(timer.stage, timer.previousStage);
+    }
+#ifdef XMSG_TRACE
+    if (Trace::enabled) Trace::span(_stageNames[timer.stage], timer.start, end);
+#endif
+    uint64_t counters[PROFILE_COUNTERS];
+    if (timer.counting && Profiler::read(counters)) {
+        for (int i = 0; i < PROFILE_COUNTERS; i++) {
+            _counters[timer.stage][i].fetch_add(counters[i] - timer.counters[i], std::memory_order_relaxed);
+        }
+    }
+    _nanoseconds[timer.stage].fetch_add(nanoseconds, std::memory_order_relaxed);
+    _bytes[timer.stage].fetch_add(timer.bytes, std::memory_order_relaxed);
+    _calls[timer.stage].fetch_add(1, std::memory_order_relaxed);
+}
+
+static double ratio(const double a, const double b) {
+    return (b > 0) ? a / b : 0;
+}
+
+static void reportCounters(const int stage) {
+    uint64_t counters[PROFILE_COUNTERS];
+    for (int i = 0; i < PROFILE_COUNTERS; i++) counters[i] = _counters[stage][i].load();
+    double bytes = (double)_bytes[stage].load();
+    double ipc = ratio(counters[PROFILE_INSTRUCTIONS], counters[PROFILE_CYCLES]);
+
+    if (_format == STATS_JSON) {
+        fprintf(stderr, ", \"counters\": {");
+        for (int i = 0; i < PROFILE_COUNTERS; i++) {
+            fprintf(stderr, "\"%s\": %llu, ", Profiler::name(i), (unsigned long long)counters[i]);
+        }
+        fprintf(stderr, "\"ipc\": %.3f, \"per_byte\": {", ipc);
+        for (int i = 0; i < PROFILE_COUNTERS; i++) {
+            fprintf(stderr, "%s\"%s\": %.4f", (i > 0) ? ", " : "", Profiler::name(i), ratio(counters[i], bytes));
+        }
+        fprintf(stderr, "}}");
+        return;
+    }
+
+    fprintf(stderr, "%-18s %14llu %6.2f", _stageNames[stage], (unsigned long long)counters[PROFILE_CYCLES], ipc);
+    for (int i = 0; i < PROFILE_COUNTERS; i++) {
+        if (bytes > 0) {
+            fprintf(stderr, " %10.4f", ratio(counters[i], bytes));
+        } else {
+            fprintf(stderr, " %10s", "-");
+        }
+    }
+    fprintf(stderr, "\n");
+}
+
+static void reportMemoryStage(const int stage, const char* name) {
+    MemoryCounts counts = Memory::stageCounts(stage);
+    uint64_t growth = Memory::stageRssGrowth(stage);
+
+    if (_format == STATS_JSON) {
+        fprintf(stderr, "{\"allocations\": %llu, \"allocated_bytes\": %llu, \"peak_rss_growth_kb\": %llu}",
+            (unsigned long long)counts.allocations, (unsigned long long)counts.bytes, (unsigned long long)growth);
+        return;
+    }
+    fprintf(stderr, "%-18s %12llu %12.2f %14llu\n",
+        name, (unsigned long long)counts.allocations, counts.bytes / 1e6, (unsigned long long)growth);
+}
+
+static void reportMemory() {
+    uint64_t peak, current;
+    Memory::readRss(&peak, &current);
+
+    if (_format == STATS_JSON) {
+        fprintf(stderr, ", \"memory\": {\"peak_rss_kb\": %llu, \"rss_kb\": %llu, \"sources\": {",
+            (unsigned long long)peak, (unsigned long long)current);
+        for (int i = 0; i < MEMORY_SOURCES; i++) {
+            MemoryCounts counts = Memory::sourceCounts((MemorySource)i);
+            fprintf(stderr, "%s\"%s\": {\"allocations\": %llu, \"allocated_bytes\": %llu}", (i > 0) ? ", " : "",
+                Memory::sourceName((MemorySource)i), (unsigned long long)counts.allocations, (unsigned long long)counts.bytes);
+        }
+        fprintf(stderr, "}, \"other\": ");
+        reportMemoryStage(MEMORY_NOSTAGE, "other");
+        fprintf(stderr, "}");
+        return;
+    }
+
+    fprintf(stderr, "\n%-18s %12s %12s %14s\n", "stage", "allocations", "alloc MB", "peak RSS +kB");
+    for (int i = 0; i < STATS_STAGES; i++) {
+        reportMemoryStage(i, _stageNames[i]);
+    }
+    reportMemoryStage(MEMORY_NOSTAGE, "other");
+    fprintf(stderr, "\n%-18s %12s %12s\n", "allocator", "allocations", "alloc MB");
+    for (int i = 0; i < MEMORY_SOURCES; i++) {
+        MemoryCounts counts = Memory::sourceCounts((MemorySource)i);
+        fprintf(stderr, "%-18s %12llu %12.2f\n", Memory::sourceName((MemorySource)i),
+            (unsigned long long)counts.allocations, counts.bytes / 1e6);
+    }
+    fprintf(stderr, "\n%-18s %12llu kB\n", "peak RSS", (unsigned long long)peak);
+    fprintf(stderr, "%-18s %12llu kB\n", "RSS at exit", (unsigned long long)current);
+}
+
+void Stats::report() {
+    double wall = (Stats::now() - _start) / 1e9;
+    double total = 0;
+
+    if (_format == STATS_JSON) {
+        fprintf(stderr, "{\"wall_seconds\": %.6f, \"stages\": [", wall);
+    } else {
+        fprintf(stderr, "%-18s %12s %8s %14s %10s %10s\n", "stage", "time (ms)", "share", "bytes", "MB/s", "calls");
+    }
+    for (int i = 0; i < STATS_STAGES; i++) {
+        double seconds = _nanoseconds[i].load() / 1e9;
+        uint64_t bytes = _bytes[i].load();
+        uint64_t calls = _calls[i].load();
+        double share = ratio(seconds, wall) * 100;
+        double throughput = ratio(bytes, seconds) / 1e6;
+        total += seconds;
+
+        if (_format == STATS_JSON) {
+            fprintf(stderr, "%s{\"stage\": \"%s\", \"seconds\": %.6f, \"share\": %.2f, \"bytes\": %llu, \"mb_per_s\": %.2f, \"calls\": %llu",
+                (i > 0) ? ", " : "", _stageNames[i], seconds, share, (unsigned long long)bytes, throughput, (unsigned long long)calls);
+            if (Stats::profiling) reportCounters(i);
+            if (Memory::enabled) {
+                fprintf(stderr, ", \"memory\": ");
+                reportMemoryStage(i, _stageNames[i]);
+            }
+            fprintf(stderr, "}");
+        } else {
+            fprintf(stderr, "%-18s %12.3f %7.1f%% %14llu %10.2f %10llu\n",
+                _stageNames[i], seconds * 1e3, share, (unsigned long long)bytes, throughput, (unsigned long long)calls);
+        }
+    }
+
+    // Time spent outside of any stage (parsing, queueing, waiting)
+    double other = (wall > total) ? wall - total : 0;
+    if (_format == STATS_JSON) {
+        fprintf(stderr, "], \"other_seconds\": %.6f", other);
+        if (Memory::enabled) reportMemory();
+        fprintf(stderr, "}\n");
+        return;
+    }
+    fprintf(stderr, "%-18s %12.3f %7.1f%%\n", "other", other * 1e3, ratio(other, wall) * 100);
+    fprintf(stderr, "%-18s %12.3f\n", "wall", wall * 1e3);
+
+    if (Stats::profiling) {
+        // Counts per byte of each stage
+        fprintf(stderr, "\n%-18s %14s %6s %10s %10s %10s %10s %10s %10s\n", "stage", "cycles", "IPC",
+            "cycles/B", "instr/B", "refs/B", "misses/B", "br-miss/B", "L1D-miss/B");
+        for (int i = 0; i < STATS_STAGES; i++) {
+            reportCounters(i);
+        }
+    }
+    if (Memory::enabled) reportMemory();
+}
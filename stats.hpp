@@ -0,0 +1,93 @@
+#ifndef _STATS_HPP_
+#define _STATS_HPP_
+
+#include <cstddef>
+#include <cstdint>
+
+#include "profile.hpp"
+
+/*
+    Per-stage timing and byte counts for --stats.
+
+    Code that belongs to a stage puts a StatsTimer around it. Timers read a
+    monotonic clock and add to process-wide counters, and do nothing but
+    test a flag unless --stats (or --trace) was given. Worker threads add
+    to the same counters, so with --jobs the stages can add up to more than
+    the wall time. With --profile, hardware counters are read along with
+    the clock, see profile.hpp. With --trace, every timer also becomes a
+    span of the trace, see trace.hpp. With --memory, allocations are
+    counted against the stage they're made in, see memory.hpp.
+
+    The report is written to stderr when the program exits, as text or as
+    JSON.
+*/
+
+enum StatsStage {
+    STATS_READ,
+    STATS_KEYCHAIN,
+    STATS_KEYEXPANSION,
+    STATS_RANDOM,
+    STATS_COMPRESSION,
+    STATS_AES,
+    STATS_MAC,
+    STATS_BASE64,
+    STATS_WRITE,
+    STATS_STAGES
+};
+
+enum StatsFormat {
+    STATS_TEXT,
+    STATS_JSON
+};
+
+class StatsTimer;
+
+class Stats
+{
+public:
+    static bool enabled;
+    static bool profiling;
+
+    // Starts the wall clock and reports when the program exits
+    static void enable(const StatsFormat format);
+    // Adds hardware counters to the report, if there are any
+    static void enableProfile();
+    // Monotonic time in nanoseconds
+    static uint64_t now();
+    static void begin(StatsTimer& timer);
+    static void end(StatsTimer& timer);
+    static void report();
+};
+
+// Times its own lifetime as 'stage'
+class StatsTimer
+{
+    friend class Stats;
+private:
+    StatsStage stage;
+    uint64_t bytes;
+    uint64_t start;
+    bool counting;
+    uint64_t counters[PROFILE_COUNTERS];
+    int previousStage;  // For --memory
+public:
+    StatsTimer(const StatsStage stage, const uint64_t bytes = 0) :
+        stage(stage),
+        bytes(bytes),
+        start(0),
+        counting(false),
+        previousStage(0)
+    {
+        if (Stats::enabled) Stats::begin(*this);
+    }
+    ~StatsTimer() {
+        if (Stats::enabled) Stats::end(*this);
+    }
+    StatsTimer(const StatsTimer&) = delete;
+    StatsTimer& operator=(const StatsTimer&) = delete;
+
+    // For stages that only know how much they did once they're done
+    void addBytes(const uint64_t bytes) { this->bytes += bytes; }
+};
+
+#endif
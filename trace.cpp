@@ -0,0 +1,161 @@
+#include "trace.hpp"
+
+#ifdef XMSG_TRACE
+
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <mutex>
+#include <vector>
+
+#ifdef __linux__
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+#include "stats.hpp"
+
+#define TRACE_RESERVE (1 << 16)
+
+enum TraceEventType {
+    TRACE_EVENT_SPAN,
+    TRACE_EVENT_COUNTER
+};
+
+struct TraceEvent
+{
+    const char* name;
+    uint64_t timestamp;
+    int64_t value;  // End of a span, or the value of a counter
+    TraceEventType type;
+};
+
+// Owned by one thread until the trace is written at exit
+struct TraceBuffer
+{
+    unsigned tid;
+    const char* threadName;
+    unsigned threadIndex;
+    std::vector<TraceEvent> events;
+};
+
+static FILE* _file = NULL;
+static uint64_t _start = 0;
+// Buffers are never freed, as threads can end before the trace is written
+static std::mutex _buffersLock;
+static std::vector<TraceBuffer*> _buffers;
+
+bool Trace::enabled = false;
+
+static TraceBuffer& localBuffer() {
+    static thread_local TraceBuffer* buffer = NULL;
+    if (buffer == NULL) {
+        buffer = new TraceBuffer();
+        buffer->threadName = NULL;
+        buffer->threadIndex = 0;
+        buffer->events.reserve(TRACE_RESERVE);
+        std::lock_guard<std::mutex> guard(_buffersLock);
+        buffer->tid = (unsigned)_buffers.size() + 1;
+        _buffers.push_back(buffer);
+    }
+    return *buffer;
+}
+
+static double microseconds(const uint64_t timestamp) {
+    return (timestamp > _start) ? (timestamp - _start) / 1e3 : 0;
+}
+
+static void writeTrace() {
+    Trace::enabled = false;
+    std::lock_guard<std::mutex> guard(_buffersLock);
+
+    fprintf(_file, "{\"displayTimeUnit\": \"ns\", \"traceEvents\": [\n");
+    bool first = true;
+    for (TraceBuffer* buffer : _buffers) {
+        if (buffer->threadName != NULL) {
+            char name[64];
+            snprintf(name, sizeof(name), (buffer->threadIndex > 0) ? "%s %u" : "%s", buffer->threadName, buffer->threadIndex);
+            fprintf(_file, "%s{\"ph\": \"M\", \"name\": \"thread_name\", \"pid\": 1, \"tid\": %u, \"args\": {\"name\": \"%s\"}}",
+                first ? "" : ",\n", buffer->tid, name);
+            first = false;
+        }
+        for (const TraceEvent& event : buffer->events) {
+            if (event.type == TRACE_EVENT_SPAN) {
+                fprintf(_file, "%s{\"ph\": \"X\", \"name\": \"%s\", \"pid\": 1, \"tid\": %u, \"ts\": %.3f, \"dur\": %.3f}",
+                    first ? "" : ",\n", event.name, buffer->tid, microseconds(event.timestamp),
+                    (event.value - (int64_t)event.timestamp) / 1e3);
+            } else {
+                fprintf(_file, "%s{\"ph\": \"C\", \"name\": \"%s\", \"pid\": 1, \"tid\": %u, \"ts\": %.3f, \"args\": {\"value\": %lld}}",
+                    first ? "" : ",\n", event.name, buffer->tid, microseconds(event.timestamp), (long long)event.value);
+            }
+            first = false;
+        }
+    }
+    fprintf(_file, "\n]}\n");
+    fclose(_file);
+}
+
+// xmsg can be setuid root (see "make install"), and the trace is opened
+// while it still is. So it's opened as the user who ran xmsg, like the
+// other paths from the command line, and a symlink at 'path' isn't followed.
+static FILE* openAsUser(const char* path) {
+#ifdef __linux__
+    const uid_t euid = geteuid();
+    const gid_t egid = getegid();
+    // The group first, changing it needs the privileges that go with the uid
+    if (setegid(getgid()) == -1 || seteuid(getuid()) == -1) {
+        perror("seteuid");
+        exit(1);
+    }
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_NOFOLLOW | O_CLOEXEC, 0666);
+    const int error = errno;
+    if (seteuid(euid) == -1 || setegid(egid) == -1) {
+        perror("seteuid");
+        exit(1);
+    }
+    errno = error;
+    return (fd == -1) ? NULL : fdopen(fd, "w");
+#else
+    return fopen(path, "w");
+#endif
+}
+
+void Trace::enable(const char* path) {
+    if (Trace::enabled) return;
+    _file = openAsUser(path);
+    if (_file == NULL) {
+        perror(path);
+        exit(1);
+    }
+    _start = Stats::now();
+    Trace::enabled = true;
+    // The stages are traced through their StatsTimers
+    Stats::enabled = true;
+    Trace::nameThread("main", 0);
+    atexit(&writeTrace);
+}
+
+void Trace::span(const char* name, const uint64_t start, const uint64_t end) {
+    localBuffer().events.push_back({ name, start, (int64_t)end, TRACE_EVENT_SPAN });
+}
+
+void Trace::counter(const char* name, const int64_t value) {
+    localBuffer().events.push_back({ name, Stats::now(), value, TRACE_EVENT_COUNTER });
+}
+
+void Trace::nameThread(const char* name, const unsigned index) {
+    TraceBuffer& buffer = localBuffer();
+    buffer.threadName = name;
+    buffer.threadIndex = index;
+}
+
+TraceSpan::TraceSpan(const char* name) :
+    name(name),
+    start(Trace::enabled ? Stats::now() : 0)
+{}
+
+TraceSpan::~TraceSpan() {
+    if (Trace::enabled) Trace::span(this->name, this->start, Stats::now());
+}
+
+#endif
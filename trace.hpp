@@ -0,0 +1,62 @@
+#ifndef _TRACE_HPP_
+#define _TRACE_HPP_
+
+#include <cstddef>
+#include <cstdint>
+
+/*
+    Timeline tracing for --trace FILE, in the Chrome trace event format
+    (chrome://tracing, ui.perfetto.dev).
+
+    Only built with TRACEFLAGS = -DXMSG_TRACE (see config.mk). Otherwise
+    the macros below are empty and --trace is refused.
+
+    Every thread appends events to a buffer of its own, without locking.
+    The buffers are written out when the program exits. Besides the spans
+    below, every StatsTimer stage (read, AES, base64, write, ...) becomes a
+    span, see stats.hpp.
+*/
+
+#ifdef XMSG_TRACE
+
+class Trace
+{
+public:
+    static bool enabled;
+
+    // Opens 'path' and writes the trace to it when the program exits
+    static void enable(const char* path);
+    // 'name' must be a string literal, it's kept until the trace is written
+    static void span(const char* name, const uint64_t start, const uint64_t end);
+    static void counter(const char* name, const int64_t value);
+    static void nameThread(const char* name, const unsigned index);
+};
+
+class TraceSpan
+{
+private:
+    const char* name;
+    uint64_t start;
+public:
+    TraceSpan(const char* name);
+    ~TraceSpan();
+    TraceSpan(const TraceSpan&) = delete;
+    TraceSpan& operator=(const TraceSpan&) = delete;
+};
+
+#define TRACE_CONCAT_(a, b) a##b
+#define TRACE_CONCAT(a, b) TRACE_CONCAT_(a, b)
+// Traces the rest of the enclosing scope
+#define TRACE_SPAN(name) TraceSpan TRACE_CONCAT(_traceSpan, __LINE__)(name)
+#define TRACE_COUNTER(name, value) do { if (Trace::enabled) Trace::counter(name, (int64_t)(value)); } while (0)
+#define TRACE_THREAD(name, index) do { if (Trace::enabled) Trace::nameThread(name, index); } while (0)
+
+#else
+
+#define TRACE_SPAN(name)
+#define TRACE_COUNTER(name, value)
+#define TRACE_THREAD(name, index)
+
+#endif
+
+#endif
@@ -3,17 +3,6 @@
 #include <cstring>
 #include <string>
 #include <cstdio>
-#include <iostream>
-#include <fstream>
-#include <sstream>
-#include <limits>
-
-#ifdef __linux__
-#include <sys/random.h>
-#elif defined(_WIN32)
-#include <windows.h>
-#include <bcrypt.h>
-#endif
 
 // Compiler hack
 #ifdef __linux__
@@ -22,93 +11,46 @@
 #include "aes.hpp"
 #endif
 #include "base64.hpp"
+#include "archive.hpp"
 #include "argparser.hpp"
+#include "chunkstore.hpp"
+#include "drbg.hpp"
+#include "io.hpp"
+#include "memory.hpp"
+#include "message.hpp"
+#include "pipeline.hpp"
+#include "stats.hpp"
+#include "trace.hpp"
+
+#ifdef __linux__
+#include <unistd.h>
+#endif
 
 static bool _debugMode = false;
 static bool _encrypt = false;
 
-void encryptMessage(AES_ctx* ctx, std::string msg);
-void decryptMessage(AES_ctx* ctx, std::string msg);
 void inline debugPrint(const char* output);
 
-// Metadata that comes BEFORE the encrypted data
-struct AESMetadata {
-    uint16_t messageLength;
-    uint8_t IV[AES_BLOCKLEN];
-};
-
 void debugPrint(const char* output) {
     if (_debugMode == true) {
         puts(output);
+        // Message data is written to the file descriptor directly
+        fflush(stdout);
     }
 }
 
-void encryptMessage(AES_ctx* ctx, std::string msg) {
-    debugPrint("Encrypting data...");
-
-    size_t msgLen = msg.length();
-    while (msgLen % 16 != 0) msgLen++;
-    uint8_t* buf = new uint8_t[msgLen + sizeof(AESMetadata)];
-
-    // Generate random bytes to fill in the extra space at the end of the message.
-    {
-        std::vector<uint8_t> randomBytes = Application::generateRandomBytes(msgLen - msg.length());
-        memcpy(buf + sizeof(AESMetadata) + msg.length(), randomBytes.data(), randomBytes.size());
-        memcpy(buf + sizeof(AESMetadata), msg.data(), msg.length());
-    }
-
-    AESMetadata* md = (AESMetadata*)buf;
-    md->messageLength = msg.length();
-    memcpy(md->IV, ctx->Iv, AES_BLOCKLEN);
-
-    debugPrint("Encrypting buffer...");
-    AES_CBC_encrypt_buffer(ctx, sizeof(AESMetadata) + buf, msgLen);
-
-    std::cout << base64_encode(buf, msgLen + sizeof(AESMetadata)) << std::endl;
-
-    delete buf;
-}
-
-void decryptMessage(AES_ctx* ctx, std::string msg) {
-    debugPrint("Decrypting data...");
-    std::string data = base64_decode(msg);
-    uint8_t* buf = (uint8_t*)data.data();
-
-    // Extract metadata
-    AESMetadata* md = (AESMetadata*)data.data();
-    // Set IV
-    AES_ctx_set_iv(ctx, md->IV);
-
-    debugPrint("Decrypting buffer...");
-    AES_CBC_decrypt_buffer(ctx, buf + sizeof(AESMetadata), data.size() - sizeof(AESMetadata));
-
-    std::string finalMessage = data.substr(sizeof(AESMetadata), md->messageLength);
-    std::cout << finalMessage;
-}
-
 std::vector<uint8_t> Application::generateRandomBytes(const int count) {
     std::vector<uint8_t> result;
     result.resize(count);
-#ifdef __linux__
-    ssize_t n = getrandom(result.data(), count, 0);
-    if (n == -1) {
-        perror("getrandom");
-        return result;
-    }
-#elif defined(_WIN32)
-    BCRYPT_ALG_HANDLE hAlg;
-    BCryptOpenAlgorithmProvider(&hAlg, BCRYPT_RNG_ALGORITHM, 0, 0);
-    NTSTATUS status = BCryptGenRandom(hAlg, result.data(), count, 0);
-    if (status != 0l) {
-        puts("BCryptGenRandom failed!");
-        printf("GetLastError() = %li\n", GetLastError());
-        return result;
-    }
-    BCryptCloseAlgorithmProvider(hAlg, 0);
-#endif
+    Application::generateRandomBytes(result.data(), count);
     return result;
 }
 
+void Application::generateRandomBytes(uint8_t* out, const size_t count) {
+    StatsTimer timer(STATS_RANDOM, count);
+    Drbg::local().generate(out, count);
+}
+
 void Application::processArguments(const int argc, char** argv) {
     
     unsigned overflow_count = 0;
@@ -129,60 +71,256 @@ void Application::processArguments(const int argc, char** argv) {
         exit(1);
     }
 
-    if (argparser_context.encrypt == false && argparser_context.decrypt == false) {
-        printf("Must specify --encrypt or --decrypt...\n");
+    if (argparser_context.encrypt == false && argparser_context.decrypt == false &&
+        argparser_context.rekeyFrom == NULL && !argparser_context.list) {
+        printf("Must specify --encrypt, --decrypt, --rekey or --list...\n");
         exit(1);
     }
 
     _encrypt = argparser_context.encrypt;
     _debugMode = argparser_context.debug;
     this->key = argparser_context.key;
+    this->keyName = argparser_context.keyName;
+    this->batch = argparser_context.batch;
+    this->jobs = (argparser_context.jobs > 0) ? argparser_context.jobs : 1;
+    this->rekeyFrom = argparser_context.rekeyFrom;
+    this->rekeyTo = argparser_context.rekeyTo;
+    this->envelopeCount = argparser_context.envelopeCount;
+    this->envelopeKeys = argparser_context.envelopeKeys;
+    this->compress = argparser_context.compress;
+    this->mac = argparser_context.mac;
+    this->compact = argparser_context.compact;
+    this->incrementalPath = argparser_context.incrementalPath;
+    this->archivePath = argparser_context.archivePath;
+    this->archiveMembers = argparser_context.archiveMembers;
+    this->archiveMemberCount = argparser_context.archiveMemberCount;
+    this->list = argparser_context.list;
+    if ((this->incrementalPath != NULL || this->archivePath != NULL) &&
+        (this->batch || this->rekeyFrom != NULL || this->envelopeCount > 0 || this->compress || this->mac ||
+        this->compact || (this->incrementalPath != NULL && this->archivePath != NULL))) {
+        printf("--incremental and --archive can't be combined with --batch, --rekey, --envelope, --compress, --mac, --compact or each other.\n");
+        exit(1);
+    }
+    if (this->compact && this->envelopeCount > 0) {
+        printf("--compact can't be combined with --envelope.\n");
+        exit(1);
+    }
+    if (this->list && this->archivePath == NULL) {
+        printf("--list needs an --archive.\n");
+        exit(1);
+    }
+    if (_encrypt && this->archivePath != NULL && this->archiveMemberCount == 0) {
+        printf("--archive needs the files or directories to put in the archive.\n");
+        exit(1);
+    }
+    if (argparser_context.stats || argparser_context.profile || argparser_context.memory) {
+        Stats::enable(argparser_context.statsJson ? STATS_JSON : STATS_TEXT);
+    }
+    if (argparser_context.profile) {
+        Stats::enableProfile();
+    }
+    if (argparser_context.memory) {
+        Memory::enable();
+    }
+#ifdef XMSG_TRACE
+    if (argparser_context.traceFile != NULL) {
+        Trace::enable(argparser_context.traceFile);
+    }
+#endif
 }
 
 Application::Application(const int argc, char** argv) :
-    key(-1)
+    key(-1),
+    keyName(NULL),
+    batch(false),
+    jobs(1),
+    rekeyFrom(NULL),
+    rekeyTo(NULL),
+    envelopeCount(0),
+    envelopeKeys(NULL),
+    compress(false),
+    mac(false),
+    compact(false),
+    incrementalPath(NULL),
+    archivePath(NULL),
+    archiveMembers(NULL),
+    archiveMemberCount(0),
+    list(false)
 {
     _debugMode = false;
     processArguments(argc, argv);
 }
 
+// Opens the keychain with the key given as an index or a name
+static std::unique_ptr<Keychain> openKeychain(const char* key) {
+    StatsTimer timer(STATS_KEYCHAIN);
+    if (key[0] != '\0' && strspn(key, "0123456789") == strlen(key)) {
+        return std::make_unique<Keychain>(atoi(key));
+    }
+    return std::make_unique<Keychain>(key);
+}
+
+// Expands the keychain's selected key into secure memory. Every thread
+// shares the one schedule.
+static SecurePtr<AES_key> expandKey(const Keychain& keychain) {
+    StatsTimer timer(STATS_KEYEXPANSION, AES_KEYLEN);
+    SecurePtr<AES_key> expanded = makeSecure<AES_key>();
+    SecureVector<uint8_t> key(AES_KEYLEN);
+    keychain.getKey(key.data());
+    AES_init_key(expanded.get(), key.data());
+    return expanded;
+}
+
+void Application::rekey() {
+    std::unique_ptr<Keychain> from = openKeychain(this->rekeyFrom);
+    std::unique_ptr<Keychain> to = openKeychain(this->rekeyTo);
+    SecurePtr<AES_key> fromKey = expandKey(*from);
+    SecurePtr<AES_key> toKey = expandKey(*to);
+
+    debugPrint("Re-encrypting messages until EOF is reached.");
+    Pipeline pipeline(this->jobs, [&]() {
+        return createRekeyProcessor(fromKey.get(), toKey.get(), this->mac);
+    });
+    pipeline.run(0, 1);
+}
+
+// "make install" makes xmsg setuid, so that only xmsg can read the key file.
+// Once the key is loaded, paths from the command line must be opened as the
+// user who ran it, or they could create and overwrite files as root.
+static void dropPrivileges() {
+#ifdef __linux__
+    const gid_t gid = getgid();
+    const uid_t uid = getuid();
+    // The group first, changing it needs the privileges that go with the uid
+    if (setresgid(gid, gid, gid) == -1 || setresuid(uid, uid, uid) == -1) {
+        perror("setresuid");
+        exit(1);
+    }
+#endif
+}
+
+void Application::incremental() {
+    dropPrivileges();
+    if (!_encrypt) {
+        debugPrint("Decrypting the chunk store...");
+        extractStore(this->incrementalPath, this->schedule.get(), 1);
+        return;
+    }
+    debugPrint("Encrypting input into the chunk store until EOF is reached.");
+    StoreSummary summary = updateStore(this->incrementalPath, this->schedule.get(), 0);
+    char line[160];
+    snprintf(line, sizeof(line), "%llu of %llu chunks (%llu of %llu bytes) were new.%s",
+        (unsigned long long)summary.newChunks, (unsigned long long)summary.chunks,
+        (unsigned long long)summary.newBytes, (unsigned long long)summary.length,
+        summary.compacted ? " The store was compacted." : "");
+    debugPrint(line);
+}
+
+void Application::archive() {
+    dropPrivileges();
+    if (this->list) {
+        listArchive(this->archivePath, this->schedule.get());
+    } else if (_encrypt) {
+        debugPrint("Encrypting files into the archive...");
+        createArchive(this->archivePath, this->schedule.get(), this->archiveMembers, this->archiveMemberCount, this->jobs);
+    } else {
+        debugPrint("Extracting the archive...");
+        extractArchive(this->archivePath, this->schedule.get(), this->archiveMembers, this->archiveMemberCount, this->jobs);
+    }
+}
+
+// Expands every --envelope key and identifies it for the message headers
+void Application::loadRecipients(MessageOptions& options) {
+    if (this->envelopeCount > MESSAGE_MAXRECIPIENTS) {
+        printf("Messages can't have more than %i recipients.\n", MESSAGE_MAXRECIPIENTS);
+        exit(1);
+    }
+    options.flags |= MESSAGE_ENVELOPE;
+    for (int i = 0; i < this->envelopeCount; i++) {
+        std::unique_ptr<Keychain> keychain = openKeychain(this->envelopeKeys[i]);
+        this->recipientKeys.push_back(expandKey(*keychain));
+
+        MessageRecipient recipient;
+        recipient.key = this->recipientKeys.back().get();
+        getKeyId(recipient.key, recipient.keyId);
+        options.recipients.push_back(recipient);
+    }
+}
+
 void Application::start() {
-    // This function essentially just prevents from memory dumps,
-    // by removing sensitive data from memory as soon as we're done using it
-    auto DestroyAES = [](AES_ctx* ctx) -> void {
-        memset(ctx, 0, sizeof(AES_ctx));
-    };
-    auto InitializeAES = [this](AES_ctx* ctx) -> void {
-        auto RandomizeIV = [](AES_ctx* ctx) -> void {
-            std::vector<uint8_t> iv = Application::generateRandomBytes(AES_BLOCKLEN);
-            AES_ctx_set_iv(ctx, iv.data());
-        };
-        // Get key from file
-        std::array<uint8_t, AES_KEYLEN> key = this->keychain->getKey();
-        // Initialize AES
-        AES_init_ctx(ctx, key.data());
-        RandomizeIV(ctx);
-    };
-
-    // Create AES context
-    AES_ctx* ctx = new AES_ctx;
-    // Create Keychain instance
-    this->keychain = std::make_unique<Keychain>(this->key);
-
-    std::string data;
+    if (this->rekeyFrom != NULL) {
+        this->rekey();
+        return;
+    }
+
+    MessageOptions options;
+    if (this->compress) {
+        options.flags |= MESSAGE_COMPRESSED;
+    }
+    if (this->mac) {
+        options.flags |= MESSAGE_MAC;
+    }
+    if (this->compact) {
+        options.flags |= MESSAGE_COMPACT;
+    }
+    if (_encrypt && this->envelopeCount > 0) {
+        this->loadRecipients(options);
+    } else {
+        // Create Keychain instance
+        {
+            StatsTimer timer(STATS_KEYCHAIN);
+            if (this->keyName != NULL) {
+                this->keychain = std::make_unique<Keychain>(this->keyName);
+            } else {
+                this->keychain = std::make_unique<Keychain>(this->key);
+            }
+        }
+
+        // The expanded key lives in secure memory, which is wiped when it is released
+        if (!this->schedule) {
+            this->schedule = expandKey(*this->keychain);
+        }
+    }
+
+    if (this->incrementalPath != NULL) {
+        this->incremental();
+        return;
+    }
+    if (this->archivePath != NULL) {
+        this->archive();
+        return;
+    }
+
+    if (this->batch) {
+        const AES_key* key = this->schedule.get();
+        debugPrint("Processing one message per line until EOF is reached.");
+        Pipeline pipeline(this->jobs, [&]() {
+            return _encrypt ? createEncryptProcessor(key, options) : createDecryptProcessor(key, this->mac);
+        });
+        pipeline.run(0, 1);
+        return;
+    }
+
+    PoolString data;
     debugPrint("Reading input until EOF is reached.");
-    while (std::cin.good()) {
-        char c;
-        std::cin.get(c);
-        data.push_back(c);
-    };
-    // Get rid of EOF char
-    data.pop_back();
-
-    InitializeAES(ctx);
-    (_encrypt) ? encryptMessage(ctx, data) : decryptMessage(ctx, data);
-    DestroyAES(ctx);
-
-    delete ctx;
-}
+    readAll(0, data);
 
+    PoolString output;
+    if (_encrypt) {
+        if (data.length() > options.maxLength()) {
+            printf("Messages are limited to %zu bytes.\n", options.maxLength());
+            exit(1);
+        }
+        debugPrint("Encrypting data...");
+        encryptMessage(this->schedule.get(), options, (const uint8_t*)data.data(), data.length(), output);
+        output.push_back('\n');
+        writeOutput(1, output);
+    } else {
+        debugPrint("Decrypting data...");
+        if (!decryptMessage(this->schedule.get(), data, this->mac, output)) {
+            printf("Invalid message.\n");
+            exit(1);
+        }
+        writeOutput(1, output);
+    }
+}
@@ -5,7 +5,9 @@
 #include <string>
 #include <vector>
 
+#include "aes.h"
 #include "keychain.hpp"
+#include "secmem.hpp"
 
 constexpr float _xmsg_version = 1.0f;
 
@@ -13,13 +15,36 @@ class Application
 {
 private:
     int key;
+    const char* keyName;
+    bool batch;
+    unsigned jobs;
+    const char* rekeyFrom;
+    const char* rekeyTo;
+    int envelopeCount;
+    const char** envelopeKeys;
+    bool compress;
+    bool mac;
+    bool compact;
+    const char* incrementalPath;
+    const char* archivePath;
+    const char** archiveMembers;
+    int archiveMemberCount;
+    bool list;
+    std::vector<SecurePtr<AES_key>> recipientKeys;
     std::unique_ptr<Keychain> keychain;
+    // Cached expanded key, shared by every thread
+    SecurePtr<AES_key> schedule;
 public:
     Application(const int argc, char** argv);
     void start();
     static std::vector<uint8_t> generateRandomBytes(const int count);
+    static void generateRandomBytes(uint8_t* out, const size_t count);
 private:
     void processArguments(const int argc, char** argv);
+    void rekey();
+    void incremental();
+    void archive();
+    void loadRecipients(struct MessageOptions& options);
     std::string getInput();
 };
 